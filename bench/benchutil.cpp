@@ -0,0 +1,78 @@
+#include "benchutil.h"
+
+namespace bench {
+
+std::vector<unsigned long> createBenchPockets(pqxx::connection *dbConn, unsigned long pocketCount, long long amount) {
+    dropBenchAgent(dbConn);
+    
+    //the agent and its pockets point at each other; both foreign keys are only
+    //checked at the end of the statement, as in REGISTER_AGENT
+    pqxx::work tx(*dbConn, "CreateBenchPocketsWork");
+    pqxx::result result = tx.exec("WITH new_pockets AS ("
+                                      "INSERT INTO pockets (owner, amount) "
+                                      "SELECT " + tx.quote(BENCH_AGENT_ADDRESS) + ", " + tx.quote(amount) + " "
+                                      "FROM generate_series(1, " + tx.quote(pocketCount) + ") "
+                                      "RETURNING pocket_id"
+                                  "), new_agent AS ("
+                                      "INSERT INTO agents (agent_address, public_key, default_pocket) "
+                                      "SELECT " + tx.quote(BENCH_AGENT_ADDRESS) + ", ''::bytea, MIN(pocket_id) FROM new_pockets"
+                                  ") "
+                                  "SELECT pocket_id FROM new_pockets ORDER BY pocket_id");
+    tx.commit();
+    
+    std::vector<unsigned long> pocketIDs(result.size());
+    for (unsigned int i=0; i<result.size(); i++) {
+        result[i][0].to(pocketIDs[i]);
+    }
+    return pocketIDs;
+}
+
+std::vector<unsigned long> createBenchFiles(pqxx::connection *dbConn) {
+    pqxx::work tx(*dbConn, "CreateBenchFilesWork");
+    pqxx::result result = tx.exec("WITH new_files AS ("
+                                      "INSERT INTO files (owner, name, pocket) "
+                                      "SELECT owner, 'bench-' || pocket_id, pocket_id FROM pockets "
+                                      "WHERE owner = " + tx.quote(BENCH_AGENT_ADDRESS) + " "
+                                      "RETURNING file_id, pocket"
+                                  "), stored AS ("
+                                      "INSERT INTO file_data (file_id) SELECT file_id FROM new_files"
+                                  "), counted AS ("
+                                      "UPDATE pockets SET file_count = file_count + 1 "
+                                      "FROM new_files WHERE pockets.pocket_id = new_files.pocket"
+                                  ") "
+                                  "SELECT file_id FROM new_files ORDER BY pocket");
+    tx.commit();
+    
+    std::vector<unsigned long> fileIDs(result.size());
+    for (unsigned int i=0; i<result.size(); i++) {
+        result[i][0].to(fileIDs[i]);
+    }
+    return fileIDs;
+}
+
+void dropBenchAgent(pqxx::connection *dbConn) {
+    dropAgents(dbConn, std::vector<std::string>(1, BENCH_AGENT_ADDRESS));
+}
+
+void dropAgents(pqxx::connection *dbConn, const std::vector<std::string> &agentAddresses) {
+    if (agentAddresses.empty()) return;
+    
+    pqxx::work tx(*dbConn, "DropBenchAgentsWork");
+    std::string addressList;
+    for (unsigned int i=0; i<agentAddresses.size(); i++) {
+        addressList += (i == 0 ? "" : ", ") + tx.quote(agentAddresses[i]);
+    }
+    //files take their data and chunks with them
+    tx.exec("DELETE FROM files WHERE owner IN (" + addressList + ")");
+    tx.exec("WITH dropped_agents AS ("
+                "DELETE FROM agents WHERE agent_address IN (" + addressList + ")"
+            ") "
+            "DELETE FROM pockets WHERE owner IN (" + addressList + ")");
+    tx.commit();
+}
+
+double secondsSince(boost::chrono::steady_clock::time_point start) {
+    return boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+}
+
+}//namespace bench
@@ -0,0 +1,34 @@
+#ifndef NETVEND_BENCHUTIL_H
+#define NETVEND_BENCHUTIL_H
+
+#include <string>
+#include <vector>
+#include <boost/chrono.hpp>
+#include <pqxx/pqxx>
+
+//Helpers for the benchmarks in bench/. They run against the database in
+//database::CONNECTION_STRING, set up with tables.sql. Everything they create
+//belongs to one bench agent, and is dropped again by dropBenchAgent().
+namespace bench {
+
+const std::string BENCH_AGENT_ADDRESS = "1NetvendBenchAgent0000000000000000";
+
+//The bench agent (after dropping any left over from an earlier run) with
+//pocketCount pockets of amount credits each, in one statement. Returns the
+//pockets' IDs in order; the first is the agent's default pocket.
+std::vector<unsigned long> createBenchPockets(pqxx::connection *dbConn, unsigned long pocketCount, long long amount);
+
+//One empty file in each of the bench agent's pockets, counted against it.
+//Returns the files' IDs, in the order of their pockets.
+std::vector<unsigned long> createBenchFiles(pqxx::connection *dbConn);
+
+//the bench agent, and its pockets and files
+void dropBenchAgent(pqxx::connection *dbConn);
+//the same for other agents a benchmark made
+void dropAgents(pqxx::connection *dbConn, const std::vector<std::string> &agentAddresses);
+
+double secondsSince(boost::chrono::steady_clock::time_point start);
+
+}//namespace bench
+
+#endif
@@ -0,0 +1,85 @@
+//Shared-buffer hit rates, per table, under a mixed read/write load on the
+//bench agent's files: each operation either checks a file's owner and reads
+//it, or rewrites it whole (which also settles its pocket's fees), picked at
+//random in the given proportion. Reported are the blocks each table (with its
+//indexes and TOAST) found in shared buffers or had to read in during the run,
+//from fetchTableCacheStats(), as StatsReporter reports them.
+//
+//For a hit rate that means something, make the files' total size (files times
+//file size) bigger than shared_buffers.
+//
+//usage: cachehit_bench [operations] [read percent] [files] [file size]
+
+#include <iostream>
+#include <cstdlib>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "util/database.h"
+#include "bench/benchutil.h"
+
+int main(int argc, char* argv[]) {
+    unsigned long operations = argc > 1 ? boost::lexical_cast<unsigned long>(argv[1]) : 20000;
+    unsigned int readPercent = argc > 2 ? boost::lexical_cast<unsigned int>(argv[2]) : 90;
+    unsigned long fileCount = argc > 3 ? boost::lexical_cast<unsigned long>(argv[3]) : 10000;
+    unsigned short fileSize = argc > 4 ? boost::lexical_cast<unsigned short>(argv[4]) : 4000;
+    
+    database::setFeeRates(0, 0);
+    pqxx::connection* dbConn;
+    database::prepareConnection(&dbConn);
+    
+    bench::createBenchPockets(dbConn, fileCount, 1000000000000LL);
+    std::vector<unsigned long> fileIDs = bench::createBenchFiles(dbConn);
+    
+    std::vector<unsigned char> fileData(fileSize);
+    for (unsigned int i=0; i<fileData.size(); i++) {
+        fileData[i] = i * 31;
+    }
+    {
+        pqxx::work tx(*dbConn, "FillBenchFilesWork");
+        for (unsigned long i=0; i<fileIDs.size(); i++) {
+            database::updateFileByID(tx, bench::BENCH_AGENT_ADDRESS, fileIDs[i], fileData.data(), fileData.size());
+        }
+        tx.commit();
+    }
+    
+    //the stats collector only hears about a backend's counts some time after
+    boost::this_thread::sleep_for(boost::chrono::seconds(1));
+    std::vector<database::TableCacheStats> before = database::fetchTableCacheStats(dbConn);
+    
+    srand(1);
+    unsigned long reads = 0;
+    boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+    for (unsigned long i=0; i<operations; i++) {
+        unsigned long fileID = fileIDs[rand() % fileIDs.size()];
+        pqxx::work tx(*dbConn, "CacheHitBenchWork");
+        if ((unsigned int)(rand() % 100) < readPercent) {
+            database::verifyFileOwner(tx, fileID, bench::BENCH_AGENT_ADDRESS);
+            database::readFileByID(tx, fileID, false);
+            reads++;
+        }
+        else {
+            fileData[i % fileData.size()]++;
+            database::updateFileByID(tx, bench::BENCH_AGENT_ADDRESS, fileID, fileData.data(), fileData.size());
+        }
+        tx.commit();
+    }
+    double seconds = bench::secondsSince(start);
+    
+    boost::this_thread::sleep_for(boost::chrono::seconds(1));
+    std::vector<database::TableCacheStats> after = database::fetchTableCacheStats(dbConn);
+    
+    std::cout << operations << " operations (" << reads << " reads, " << operations - reads << " writes) on "
+              << fileCount << " files of " << fileSize << " bytes in " << seconds << "s, " << operations / seconds << " operations/s" << std::endl;
+    //both are ordered by table, and the tables don't change during the run
+    for (unsigned int i=0; i<after.size() && i<before.size(); i++) {
+        unsigned long long hit = after[i].blocksHit - before[i].blocksHit;
+        unsigned long long read = after[i].blocksRead - before[i].blocksRead;
+        std::cout << "  " << after[i].table << ": " << hit << " blocks hit, " << read << " read, "
+                  << (hit + read > 0 ? 100.0 * hit / (hit + read) : 100.0) << "% hit rate" << std::endl;
+    }
+    
+    bench::dropBenchAgent(dbConn);
+    delete dbConn;
+    return 0;
+}
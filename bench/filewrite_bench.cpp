@@ -0,0 +1,107 @@
+//Small writes to a full-size (MAX_FILE_SIZE, about 64KB) file, made with
+//WriteFileRange, against the same writes made by rewriting the whole file with
+//UpdateFileByID, as clients had to before partial writes. Then the file is
+//grown from empty by AppendToFile, against rewriting it whole at each step.
+//Each write is its own transaction.
+//
+//Runs without a blob store, since partial writes go to a file's chunks (a file
+//in a blob is moved into them by its first one).
+//
+//usage: filewrite_bench [writes] [write size]...
+
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+
+#include "util/database.h"
+#include "bench/benchutil.h"
+
+//one line of results, for writes of writeSize bytes each
+static void report(std::string what, unsigned long writes, unsigned int writeSize, double seconds) {
+    std::cout << "  " << what << ": " << writes << " writes in " << seconds << "s, "
+              << writes / seconds << " writes/s, " << writes * writeSize / seconds / 1024 << " KB/s written by clients" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long writes = argc > 1 ? boost::lexical_cast<unsigned long>(argv[1]) : 1000;
+    std::vector<unsigned int> writeSizes;
+    for (int i=2; i<argc; i++) {
+        writeSizes.push_back(boost::lexical_cast<unsigned int>(argv[i]));
+    }
+    if (writeSizes.empty()) {
+        writeSizes.push_back(16);
+        writeSizes.push_back(512);
+        writeSizes.push_back(4000);
+    }
+    
+    //no fees, so the writes are all that's timed
+    database::setFeeRates(0, 0);
+    pqxx::connection* dbConn;
+    database::prepareConnection(&dbConn);
+    
+    bench::createBenchPockets(dbConn, 1, 1000000000000LL);
+    unsigned long fileID = bench::createBenchFiles(dbConn)[0];
+    
+    std::vector<unsigned char> fileData(database::MAX_FILE_SIZE);
+    for (unsigned int i=0; i<fileData.size(); i++) {
+        fileData[i] = i * 31;
+    }
+    
+    for (unsigned int w=0; w<writeSizes.size(); w++) {
+        unsigned int writeSize = writeSizes[w];
+        std::vector<unsigned char> piece(writeSize, w + 1);
+        std::cout << writeSize << " byte writes:" << std::endl;
+        
+        {
+            pqxx::work tx(*dbConn, "FillBenchFileWork");
+            database::updateFileByID(tx, bench::BENCH_AGENT_ADDRESS, fileID, fileData.data(), fileData.size());
+            tx.commit();
+        }
+        
+        //spread over the file, so they land in different chunks
+        boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+        for (unsigned long i=0; i<writes; i++) {
+            unsigned short offset = (i * 7919) % (fileData.size() - writeSize + 1);
+            pqxx::work tx(*dbConn, "WriteFileRangeWork");
+            database::writeFileRange(tx, bench::BENCH_AGENT_ADDRESS, fileID, offset, piece.data(), writeSize);
+            tx.commit();
+        }
+        report("WriteFileRange", writes, writeSize, bench::secondsSince(start));
+        
+        start = boost::chrono::steady_clock::now();
+        for (unsigned long i=0; i<writes; i++) {
+            unsigned short offset = (i * 7919) % (fileData.size() - writeSize + 1);
+            std::copy(piece.begin(), piece.end(), fileData.begin() + offset);
+            pqxx::work tx(*dbConn, "UpdateFileByIDWork");
+            database::updateFileByID(tx, bench::BENCH_AGENT_ADDRESS, fileID, fileData.data(), fileData.size());
+            tx.commit();
+        }
+        report("UpdateFileByID of the whole file", writes, writeSize, bench::secondsSince(start));
+        
+        //growing the file from empty to full
+        unsigned long appends = fileData.size() / writeSize;
+        {
+            pqxx::work tx(*dbConn, "EmptyBenchFileWork");
+            database::updateFileByID(tx, bench::BENCH_AGENT_ADDRESS, fileID, fileData.data(), 0);
+            tx.commit();
+        }
+        start = boost::chrono::steady_clock::now();
+        for (unsigned long i=0; i<appends; i++) {
+            pqxx::work tx(*dbConn, "AppendToFileWork");
+            database::appendToFile(tx, bench::BENCH_AGENT_ADDRESS, fileID, fileData.data() + i * writeSize, writeSize);
+            tx.commit();
+        }
+        report("AppendToFile", appends, writeSize, bench::secondsSince(start));
+        
+        start = boost::chrono::steady_clock::now();
+        for (unsigned long i=0; i<appends; i++) {
+            pqxx::work tx(*dbConn, "UpdateFileByIDWork");
+            database::updateFileByID(tx, bench::BENCH_AGENT_ADDRESS, fileID, fileData.data(), (i + 1) * writeSize);
+            tx.commit();
+        }
+        report("UpdateFileByID of the grown file", appends, writeSize, bench::secondsSince(start));
+    }
+    
+    bench::dropBenchAgent(dbConn);
+    delete dbConn;
+    return 0;
+}
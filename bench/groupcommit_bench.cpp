@@ -0,0 +1,62 @@
+//Commits per second with each write batch committed on its own, as without
+//server.group-commit, against batches committed together in groups, each in
+//its own savepoint within the group's transaction, as runCommandBatchGroup()
+//runs them. Each batch is one PocketTransfer between two bench pockets.
+//
+//Batches are sent one after another on one connection, so what's measured is
+//what sharing a commit (and its WAL flush) saves per batch; with
+//synchronous_commit off there's little to save.
+//
+//usage: groupcommit_bench [batches] [group size]...
+
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+
+#include "util/database.h"
+#include "bench/benchutil.h"
+
+int main(int argc, char* argv[]) {
+    unsigned long batches = argc > 1 ? boost::lexical_cast<unsigned long>(argv[1]) : 10000;
+    std::vector<unsigned int> groupSizes;
+    for (int i=2; i<argc; i++) {
+        groupSizes.push_back(boost::lexical_cast<unsigned int>(argv[i]));
+    }
+    if (groupSizes.empty()) {
+        groupSizes.push_back(1);
+        groupSizes.push_back(8);
+        groupSizes.push_back(32);
+    }
+    
+    //no fees, so transfers are all the batches do
+    database::setFeeRates(0, 0);
+    pqxx::connection* dbConn;
+    database::prepareConnection(&dbConn);
+    
+    std::vector<unsigned long> pocketIDs = bench::createBenchPockets(dbConn, 2, 1000000000000LL);
+    
+    for (unsigned int g=0; g<groupSizes.size(); g++) {
+        unsigned int groupSize = groupSizes[g];
+        unsigned long commits = 0;
+        
+        boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+        for (unsigned long first=0; first < batches; first += groupSize) {
+            pqxx::work tx(*dbConn, "CommandBatchGroupWork");
+            for (unsigned long i=first; i < batches && i < first + groupSize; i++) {
+                pqxx::subtransaction batchTx(tx, "CommandBatchWork");
+                database::pocketTransfer(batchTx, bench::BENCH_AGENT_ADDRESS, pocketIDs[i % 2], pocketIDs[(i + 1) % 2], 1);
+                batchTx.commit();
+            }
+            tx.commit();
+            commits++;
+        }
+        double seconds = bench::secondsSince(start);
+        
+        std::cout << "group size " << groupSize << (groupSize == 1 ? " (no group commit)" : "") << ": "
+                  << batches << " batches in " << seconds << "s, "
+                  << commits / seconds << " commits/s, " << batches / seconds << " batches/s" << std::endl;
+    }
+    
+    bench::dropBenchAgent(dbConn);
+    delete dbConn;
+    return 0;
+}
@@ -0,0 +1,56 @@
+//Handshakes per second, as far as the database goes: registerAgent() for
+//agents never seen before, each created with its default pocket in one
+//statement, and then again for the same agents returning, which finds them
+//and writes nothing. Agent addresses are derived from the keys as part of
+//each handshake, as processHandshakePacket() does.
+//
+//The agents' keys are random ed25519 pubkeys; registerAgent() doesn't check
+//them, and making thousands of RSA keys would take longer than the benchmark.
+//
+//usage: handshake_bench [agents]
+
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+
+#include "util/database.h"
+#include "bench/benchutil.h"
+
+int main(int argc, char* argv[]) {
+    unsigned long agents = argc > 1 ? boost::lexical_cast<unsigned long>(argv[1]) : 10000;
+    
+    //the fee rates go into the prepared statements, handshakes or not
+    database::setFeeRates(0, 0);
+    pqxx::connection* dbConn;
+    database::prepareConnection(&dbConn);
+    
+    CryptoPP::AutoSeededRandomPool rng;
+    std::vector<crypto::AgentPubkey> pubkeys;
+    for (unsigned long i=0; i<agents; i++) {
+        std::vector<unsigned char> encoded(ED25519_PUBKEY_SIZE);
+        rng.GenerateBlock(encoded.data(), encoded.size());
+        pubkeys.push_back(crypto::AgentPubkey(KEYTYPE_ED25519, encoded));
+    }
+    std::vector<std::string> agentAddresses;
+    
+    for (int returning=0; returning<2; returning++) {
+        unsigned long registered = 0;
+        
+        boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+        for (unsigned long i=0; i<agents; i++) {
+            std::string agentAddress = crypto::agentPubkeyToNetvendAddress(pubkeys[i]);
+            unsigned long defaultPocketID;
+            if (database::registerAgent(dbConn, agentAddress, pubkeys[i], &defaultPocketID)) {
+                registered++;
+                agentAddresses.push_back(agentAddress);
+            }
+        }
+        double seconds = bench::secondsSince(start);
+        
+        std::cout << (returning ? "returning" : "new") << " agents: " << agents << " handshakes in " << seconds << "s, "
+                  << agents / seconds << " handshakes/s, " << registered << " agents created" << std::endl;
+    }
+    
+    bench::dropAgents(dbConn, agentAddresses);
+    delete dbConn;
+    return 0;
+}
@@ -0,0 +1,69 @@
+//How long the fee scheduler takes to find and settle a large number of
+//pockets: fetchAllFeeDeadlines(), as at startup, and settlePocketFees() on
+//every pocket at once, as if all their deadlines came together.
+//
+//Each bench pocket holds one empty file, charged at one credit per second,
+//and was last settled ten seconds ago. Every other pocket holds too little to
+//cover that and runs dry, so half the settlement is deleting files.
+//
+//usage: settle_bench [chunk size] [pockets]...
+
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+
+#include "util/database.h"
+#include "bench/benchutil.h"
+
+int main(int argc, char* argv[]) {
+    size_t chunkSize = argc > 1 ? boost::lexical_cast<size_t>(argv[1]) : 1000;
+    std::vector<unsigned long> pocketCounts;
+    for (int i=2; i<argc; i++) {
+        pocketCounts.push_back(boost::lexical_cast<unsigned long>(argv[i]));
+    }
+    if (pocketCounts.empty()) {
+        pocketCounts.push_back(100000);
+        pocketCounts.push_back(1000000);
+    }
+    
+    database::setFeeRates(1, 0);
+    pqxx::connection* dbConn;
+    database::prepareConnection(&dbConn);
+    
+    for (unsigned int p=0; p<pocketCounts.size(); p++) {
+        unsigned long pocketCount = pocketCounts[p];
+        
+        std::vector<unsigned long> pocketIDs = bench::createBenchPockets(dbConn, pocketCount, 0);
+        bench::createBenchFiles(dbConn);
+        {
+            pqxx::work tx(*dbConn, "SeedBenchPocketsWork");
+            tx.exec("UPDATE pockets SET "
+                        "amount = CASE WHEN pocket_id % 2 = 0 THEN 1000 ELSE 5 END, "
+                        "fees_settled_at = now() - interval '10 seconds' "
+                    "WHERE owner = " + tx.quote(bench::BENCH_AGENT_ADDRESS));
+            tx.commit();
+        }
+        
+        boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+        std::vector<database::FeeDeadline> deadlines = database::fetchAllFeeDeadlines(dbConn);
+        double fetchSeconds = bench::secondsSince(start);
+        
+        start = boost::chrono::steady_clock::now();
+        database::settlePocketFees(dbConn, pocketIDs, chunkSize);
+        double settleSeconds = bench::secondsSince(start);
+        
+        unsigned long filesLeft;
+        {
+            pqxx::work tx(*dbConn, "CountBenchFilesWork");
+            tx.exec("SELECT COUNT(*) FROM files WHERE owner = " + tx.quote(bench::BENCH_AGENT_ADDRESS))[0][0].to(filesLeft);
+        }
+        
+        std::cout << pocketCount << " pockets: " << deadlines.size() << " deadlines fetched in " << fetchSeconds << "s; "
+                  << "settled in " << settleSeconds << "s (chunks of " << chunkSize << "), "
+                  << pocketCount / settleSeconds << " pockets/s, "
+                  << pocketCount - filesLeft << " ran dry" << std::endl;
+    }
+    
+    bench::dropBenchAgent(dbConn);
+    delete dbConn;
+    return 0;
+}
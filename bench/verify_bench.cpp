@@ -0,0 +1,61 @@
+//Signature verifies per second as verifier threads are added. Each thread
+//checks the same CommandBatch-sized message against one agent's verifier,
+//shared as the verifier cache shares it, so what's measured is how well
+//verifying on the verifier pool scales across cores.
+//
+//usage: verify_bench [verifies] [max threads] [message size]
+
+#include <iostream>
+#include <boost/lexical_cast.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "util/crypto.h"
+#include "bench/benchutil.h"
+
+//verifies until the shared count of those left to do runs out
+static void verifyUntilDone(const crypto::SigVerifier* verifier, const std::vector<unsigned char>* message, const std::vector<unsigned char>* sig, boost::atomic<long>* left, boost::atomic<unsigned long>* failed) {
+    while (left->fetch_sub(1) > 0) {
+        if (!crypto::verifySig(*verifier, *message, *sig)) (*failed)++;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    long verifies = argc > 1 ? boost::lexical_cast<long>(argv[1]) : 20000;
+    unsigned int maxThreads = argc > 2 ? boost::lexical_cast<unsigned int>(argv[2]) : boost::thread::hardware_concurrency();
+    size_t messageSize = argc > 3 ? boost::lexical_cast<size_t>(argv[3]) : 512;
+    
+    CryptoPP::AutoSeededRandomPool rng;
+    CryptoPP::InvertibleRSAFunction RSAFunction;
+    RSAFunction.GenerateRandomWithKeySize(rng, AGENT_KEYSIZE);
+    crypto::RSAPrivkey privkey(RSAFunction);
+    
+    std::vector<unsigned char> message(messageSize);
+    rng.GenerateBlock(message.data(), message.size());
+    std::vector<unsigned char> sig = crypto::cryptoSign(message, privkey, rng);
+    
+    boost::shared_ptr<const crypto::SigVerifier> verifier(crypto::newVerifier(crypto::AgentPubkey(crypto::RSAPubkey(RSAFunction))));
+    
+    double singleThreadRate = 0;
+    for (unsigned int threads=1; threads<=maxThreads; threads++) {
+        boost::atomic<long> left(verifies);
+        boost::atomic<unsigned long> failed(0);
+        
+        boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+        boost::thread_group verifiers;
+        for (unsigned int i=0; i<threads; i++) {
+            verifiers.create_thread(boost::bind(&verifyUntilDone, verifier.get(), &message, &sig, &left, &failed));
+        }
+        verifiers.join_all();
+        double seconds = bench::secondsSince(start);
+        
+        double rate = verifies / seconds;
+        if (threads == 1) singleThreadRate = rate;
+        std::cout << threads << " thread" << (threads == 1 ? "" : "s") << ": "
+                  << verifies << " verifies in " << seconds << "s, " << rate << " verifies/s, "
+                  << rate / singleThreadRate << "x one thread" << (failed > 0 ? " (SOME FAILED)" : "") << std::endl;
+    }
+    
+    return 0;
+}
@@ -1,401 +1,725 @@
-#define _SCL_SECURE_NO_WARNINGS
-
-#include <iostream>
-#include <string>
-#include <map>
-#include <boost/asio.hpp>
-#include <boost/shared_ptr.hpp>
-#include <boost/lexical_cast.hpp>
-#include <stdexcept>
-
-#include "netvend/common_constants.h"
-#include "util/crypto.h"
-#include "util/networking.h"
-#include "netvend/commands.h"
-#include "netvend/packet.h"
-#include "netvend/response.h"
-
-using boost::asio::ip::tcp;
-
-CryptoPP::AutoSeededRandomPool rng;
-
-class NetvendConnection {
-    tcp::socket socket_;
-    bool connected;
-public:
-    NetvendConnection(boost::asio::io_service& io)
-      : socket_(io) 
-    {
-        connected = false;
-    }
-    tcp::socket& socket() {
-        return socket_;
-    }
-    bool disconnect() {
-        if (!connected) return true;
-        
-        if (networking::disconnectSocket(socket_)) {
-            connected = false;
-            return true;
-        }
-        else return false;
-    }
-    bool connect(std::string ip=DEFAULT_SERVER_IP, unsigned int port=DEFAULT_SERVER_PORT) {
-        if (connected) {
-            if (!disconnect()) {
-                std::cerr << "cannot disconnect before connecting." << std::endl;
-                return false;
-            }
-        }
-        
-        if (networking::connectSocket(socket_, ip, port)) {
-            connected = true;
-            return true;
-        }
-        else {
-            connected = false;
-            return false;
-        }
-    }
-};
-
-class Agent {
-    CryptoPP::InvertibleRSAFunction RSAFunction;
-    crypto::RSAPubkey pubkey;
-    crypto::RSAPrivkey privkey;
-    std::string agentAddress;
-    std::string depositAddress;
-    bool populated;
-    NetvendConnection* nvConnection;
-    
-    bool connectToNetvend(std::string ip=DEFAULT_SERVER_IP, unsigned int port=DEFAULT_SERVER_PORT) {
-        if (nvConnection == NULL) throw std::runtime_error("Must first associate NetvendConnection with Agent.setConnection()");
-        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
-        
-        return nvConnection->connect(ip, port);
-    }
-    bool disconnectFromNetvend() {
-        if (nvConnection == NULL) throw std::runtime_error("Agent has a NULL NetvendConnection pointer");
-        return nvConnection->disconnect();
-    }
-    
-public:
-    Agent(boost::asio::io_service& io) {
-        populated = false;
-        nvConnection = NULL;
-    }
-    void setConnection(NetvendConnection *nv) {
-        nvConnection = nv;
-    }
-    void updateInfo() {
-        //update public key
-        pubkey = crypto::RSAPubkey(RSAFunction);
-        privkey = crypto::RSAPrivkey(RSAFunction);
-
-        //update address
-        agentAddress = crypto::RSAPubkeyToNetvendAddress(pubkey);
-    }
-    void generateNew() {
-        RSAFunction.GenerateRandomWithKeySize(rng, AGENT_KEYSIZE);
-        updateInfo();
-        populated = true;
-    }
-    void test() {
-
-    }
-    std::string getAddress() {
-        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
-        return agentAddress;
-    }
-    std::vector<unsigned char> getAddressBytes() {
-        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
-        return std::vector<unsigned char>(getAddress().begin(), getAddress().end());
-    }
-    CryptoPP::InvertibleRSAFunction getFunction() {
-        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
-        return RSAFunction;
-    }
-    std::vector<unsigned char> signMessage(std::vector<unsigned char> &message) {
-        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
-        
-        return crypto::cryptoSign(message, privkey, rng);
-    }
-    
-    //functions that need to connect to netvend
-    unsigned long performNetvendHandshake() {
-        connectToNetvend();
-        
-        //send handshake
-        networking::HandshakePacket packet(pubkey);
-        packet.writeToSocket(nvConnection->socket());
-        
-        //receive handshake response
-        boost::shared_ptr<networking::HandshakeResponse> response(networking::HandshakeResponse::readFromSocket(nvConnection->socket()));
-        if (response.get() == NULL) std::cerr << "read failed" << std::endl;
-        
-        disconnectFromNetvend();
-        
-        return response->defaultPocketID();
-    }
-    
-    boost::shared_ptr<commands::results::Result> performSingleCommand(boost::shared_ptr<commands::Command> command) {
-        connectToNetvend();
-        
-        commands::Batch* cb = new commands::Batch();
-        cb->addCommand(command);
-        
-        boost::shared_ptr<std::vector<unsigned char> > cbData(new std::vector<unsigned char>());
-        cb->writeToVch(cbData.get());
-        
-        std::vector<unsigned char> sig = crypto::cryptoSign(*cbData, privkey, rng);
-        
-        //create commandBatchPacket
-        networking::CommandBatchPacket cbp(agentAddress, cbData, sig);
-        
-        //send it
-        cbp.writeToSocket(nvConnection->socket());
-        
-        //receive response
-        boost::shared_ptr<networking::CommandBatchResponse> response(networking::CommandBatchResponse::readFromSocket(nvConnection->socket(), cb));
-        if (response.get() == NULL) std::cerr << "read failed" << std::endl;
-        
-        disconnectFromNetvend();
-        
-        boost::shared_ptr<commands::results::Result> result = response->commandResultBatch()->results()->at(0);
-        
-        if (result->error()) {
-            boost::shared_ptr<commands::errors::Error> error = boost::dynamic_pointer_cast<commands::errors::Error>(result);
-            throw *error;
-        }
-        
-        return result;
-    }
-    
-    unsigned long createPocket() {
-        boost::shared_ptr<commands::Command> command(new commands::CreatePocket());
-        
-        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
-        
-        boost::shared_ptr<commands::results::CreatePocket> cpResult =
-          boost::dynamic_pointer_cast<commands::results::CreatePocket>(result);
-        
-        assert(cpResult.get() != NULL);
-        
-        return cpResult->pocketID();
-    }
-    
-    std::string requestPocketDepositAddress(unsigned long pocketID) {
-        boost::shared_ptr<commands::Command> command(new commands::RequestPocketDepositAddress(pocketID));
-        
-        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
-        
-        boost::shared_ptr<commands::results::RequestPocketDepositAddress> rpdaResult =
-          boost::dynamic_pointer_cast<commands::results::RequestPocketDepositAddress>(result);
-        
-        assert(rpdaResult.get() != NULL);
-        
-        return rpdaResult->depositAddress();
-    }
-    
-    void transfer(unsigned long fromPocketID, unsigned long toPocketID, long long amount) {
-        boost::shared_ptr<commands::Command> command(new commands::PocketTransfer(fromPocketID, toPocketID, amount));
-        
-        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
-        
-        boost::shared_ptr<commands::results::PocketTransfer> ptResult = 
-          boost::dynamic_pointer_cast<commands::results::PocketTransfer>(result);
-        
-        assert(ptResult.get() != NULL);
-    }
-    
-    unsigned long createFile(std::string name, unsigned long pocketID) {
-        boost::shared_ptr<commands::Command> command(new commands::CreateFile(name, pocketID));
-        
-        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
-        
-        boost::shared_ptr<commands::results::CreateFile> ccResult =
-          boost::dynamic_pointer_cast<commands::results::CreateFile>(result);
-        
-        assert(ccResult.get() != NULL);
-        
-        return ccResult->fileID();
-    }
-    
-    void updateFileByID(unsigned long fileID, unsigned char* data, unsigned short dataSize) {
-        boost::shared_ptr<commands::Command> command(new commands::UpdateFileByID(fileID, data, dataSize));
-        
-        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
-        
-        boost::shared_ptr<commands::results::UpdateFileByID> ucbiResult =
-        boost::dynamic_pointer_cast<commands::results::UpdateFileByID>(result);
-        
-        assert(ucbiResult.get() != NULL);
-    }
-    
-    std::vector<unsigned char> readFileByID(unsigned long fileID) {
-        boost::shared_ptr<commands::Command> command(new commands::ReadFileByID(fileID));
-        
-        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
-        
-        boost::shared_ptr<commands::results::ReadFileByID> readResult =
-        boost::dynamic_pointer_cast<commands::results::ReadFileByID>(result);
-        
-        assert(readResult.get() != NULL);
-        
-        return *(readResult->fileData());
-    }
-};
-
-std::map<std::string, Agent> agents;
-
-std::string selectedAgentName;
-Agent* selectedAgent;
-
-const char helpstr[] = 
-"help - help\n\
-q - quit\n\
-newagent [name] - new agent\n\
-agents - list agents\n\
-agent [name] - select agent\n\
-\n\
-h - Perform netvend handshake\n\
-\n\
-newpocket - Create new Pocket\n\
-pocketdeposit [pocketID] - Request deposit address for pocket\n\
-transfer [fromPocketID] [toPocketID] [amount] - Transfer credit from one pocket to another\n\
-\n\
-newfile [name] [pocketID] - Create a new file with [name], thethered to pocket [pocketID]\n\
-write [fileID] [data] - write to file [fileID] with [data] (overwrites old data)\n\
-read [fileID] - read data from file [fileID]";
-
-void createNewAgent(std::string name, boost::asio::io_service& io, bool output=true) {
-    Agent agent(io);
-    agent.generateNew();
-    agents.insert(std::pair<std::string, Agent>(name, agent));
-    if (output)
-        std::cout << "new agent '" << name << "' created with address " << agent.getAddress() << std::endl;
-}
-
-bool selectAgent(std::string name, bool output=true) {
-    selectedAgentName = name;
-    try {
-        selectedAgent = &(agents.at(name));
-    }
-    catch (std::out_of_range &e) {
-    if (output)
-        std::cout << "no agent '" << name << "' exists!" << std::endl;
-    return false;
-    }
-    if (output)
-        std::cout << "agent '" << name << "' selected." << std::endl;
-    return true;
-}
-
-int main() {
-    boost::asio::io_service io;
-    NetvendConnection nvConnection(io);
-    
-    while (true) {
-        std::cin.sync();
-
-        std::string commandCode;
-        std::cout << "> ";
-        std::cin >> commandCode;
-
-        if (commandCode == "help") {
-            std::cout << helpstr << std::endl;
-        }
-        else if (commandCode == "q") {
-            return 0;
-        }
-        else if (commandCode == "newagent") {
-            std::string name;
-            std::cin >> name;
-
-            createNewAgent(name, io);
-
-            selectAgent(name);
-            selectedAgent->setConnection(&nvConnection);
-        }
-        else if (commandCode == "agents") {
-            for (std::map<std::string, Agent>::iterator it=agents.begin(); it != agents.end(); it++) {
-                std::cout << it->first << " (" << it->second.getAddress() << ")" << std::endl;
-            }
-        }
-        else if (commandCode == "agent") {
-            std::string name;
-            std::cin >> name;
-
-            selectAgent(name);
-        }
-        else if (commandCode == "h") {
-            unsigned long defaultPocketID = selectedAgent->performNetvendHandshake();
-            if (defaultPocketID) {
-                std::cout << "Handshake complete; added to netvend as a new agent." << std::endl;
-                std::cout << "Default agent pocket id: " << defaultPocketID << std::endl;
-            }
-            else {
-                std::cout << "Handshake complete; recognized by netvend as an existing agent." << std::endl;
-            }
-        }
-        else if (commandCode == "newpocket") {
-            std::cout << "Pocket created with id " << selectedAgent->createPocket() << std::endl;
-        }
-        else if (commandCode == "pocketdeposit") {
-            unsigned long pocketID;
-            
-            std::cin >> pocketID;
-            
-            std::cout << "Pocket " << pocketID << " now has a deposit address " << selectedAgent->requestPocketDepositAddress(pocketID) << std::endl;
-        }
-        else if (commandCode == "transfer") {
-            unsigned long fromPocketID, toPocketID;
-            long long amount;
-            
-            std::cin >> fromPocketID >> toPocketID >> amount;
-            
-            selectedAgent->transfer(fromPocketID, toPocketID, amount);
-            
-            std::cout << "Transfered." << std::endl;
-        }
-        else if (commandCode == "newfile") {
-            std::string name;
-            unsigned long pocketID;
-            
-            std::cin >> name >> pocketID;
-            
-            std::cout << "File " << selectedAgent->createFile(name, pocketID) << " has been created." << std::endl;
-        }
-        else if (commandCode == "write") {
-            unsigned long fileID;
-            std::string s;
-            
-            std::cin >> fileID >> s;
-            
-            selectedAgent->updateFileByID(fileID, (unsigned char*)s.data(), s.size());
-            
-            std::cout << "File " << fileID << " updated." << std::endl;
-        }
-        else if (commandCode == "read") {
-            unsigned long fileID;
-            
-            std::cin >> fileID;
-            
-            std::vector<unsigned char> fileData = selectedAgent->readFileByID(fileID);
-            
-            std::string s;
-            s.resize(fileData.size());
-            std::copy(fileData.begin(), fileData.end(), s.begin());
-            
-            std::cout << "data: " << s << std::endl;
-        }
-        else if (commandCode == "t") {
-            
-        }
-        else {
-            std::cout << "Unrecognized command." << std::endl;
-        }
-    }
-    
-    std::cin.get();
+#define _SCL_SECURE_NO_WARNINGS
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <stdexcept>
+
+#include "netvend/common_constants.h"
+#include "util/crypto.h"
+#include "util/networking.h"
+#include "netvend/commands.h"
+#include "netvend/packet.h"
+#include "netvend/response.h"
+
+using boost::asio::ip::tcp;
+
+CryptoPP::AutoSeededRandomPool rng;
+
+//batches signed together in one AggregateCommandBatch; the server's default max-aggregate-batches
+const unsigned int MAX_AGGREGATE_BATCHES = 256;
+
+class NetvendConnection {
+    tcp::socket socket_;
+    bool connected;
+public:
+    NetvendConnection(boost::asio::io_service& io)
+      : socket_(io) 
+    {
+        connected = false;
+    }
+    tcp::socket& socket() {
+        return socket_;
+    }
+    bool isConnected() {
+        return connected;
+    }
+    void drop() {
+        //close without a clean shutdown; used when the server has already hung up on us
+        boost::system::error_code error;
+        socket_.close(error);
+        connected = false;
+    }
+    bool disconnect() {
+        if (!connected) return true;
+        
+        if (networking::disconnectSocket(socket_)) {
+            connected = false;
+            return true;
+        }
+        else return false;
+    }
+    bool connect(std::string ip=DEFAULT_SERVER_IP, unsigned int port=DEFAULT_SERVER_PORT) {
+        if (connected) {
+            if (!disconnect()) {
+                std::cerr << "cannot disconnect before connecting." << std::endl;
+                return false;
+            }
+        }
+        
+        if (networking::connectSocket(socket_, ip, port)) {
+            connected = true;
+            return true;
+        }
+        else {
+            connected = false;
+            return false;
+        }
+    }
+};
+
+class Agent {
+    unsigned char keyType;
+    CryptoPP::InvertibleRSAFunction RSAFunction;
+    crypto::RSAPrivkey privkey;
+    boost::shared_ptr<CryptoPP::ed25519Signer> ed25519Signer;
+    crypto::AgentPubkey pubkey;
+    std::string agentAddress;
+    std::string depositAddress;
+    bool populated;
+    NetvendConnection* nvConnection;
+    unsigned long nextRequestID;
+    
+    //session mode; the session only lasts as long as the connection
+    bool sessionWanted;
+    bool sessionOpen;
+    std::vector<unsigned char> sessionKey;
+    unsigned long long nextSessionSeq;
+    
+    bool connectToNetvend(std::string ip=DEFAULT_SERVER_IP, unsigned int port=DEFAULT_SERVER_PORT) {
+        if (nvConnection == NULL) throw std::runtime_error("Must first associate NetvendConnection with Agent.setConnection()");
+        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
+        
+        //the server keeps connections open between packets, so reuse ours if we have one
+        if (nvConnection->isConnected()) return true;
+        
+        return nvConnection->connect(ip, port);
+    }
+    bool disconnectFromNetvend() {
+        if (nvConnection == NULL) throw std::runtime_error("Agent has a NULL NetvendConnection pointer");
+        return nvConnection->disconnect();
+    }
+    void dropNetvendConnection() {
+        if (nvConnection == NULL) throw std::runtime_error("Agent has a NULL NetvendConnection pointer");
+        nvConnection->drop();
+        sessionOpen = false;
+    }
+    
+    //Exchanges session pubkeys with the server over the current connection.
+    //Doesn't retry; callers handle NetworkingExceptions.
+    void openSession() {
+        std::vector<unsigned char> sessionPrivkey, sessionPubkey;
+        crypto::generateSessionKeypair(rng, &sessionPrivkey, &sessionPubkey);
+        
+        std::vector<unsigned char> sig = signMessage(sessionPubkey);
+        networking::StartSessionPacket packet(nextRequestID++, agentAddress, keyType, sessionPubkey, sig);
+        packet.writeToSocket(nvConnection->socket());
+        
+        unsigned long requestID = networking::readResponseRequestID(nvConnection->socket());
+        if (requestID != packet.requestID()) throw std::runtime_error("StartSession response has an unexpected request ID");
+        
+        boost::shared_ptr<networking::StartSessionResponse> response(networking::StartSessionResponse::readFromSocket(requestID, nvConnection->socket()));
+        
+        sessionKey = crypto::deriveSessionKey(sessionPrivkey, sessionPubkey, response->sessionPubkey(), true);
+        nextSessionSeq = 0;
+        sessionOpen = true;
+    }
+    
+    //the packet carrying one batch: MACed if we have a session, signed otherwise
+    boost::shared_ptr<networking::NetvendPacket> commandBatchPacket(unsigned long requestID, boost::shared_ptr<std::vector<unsigned char> > cbData) {
+        if (sessionOpen) {
+            unsigned long long seq = nextSessionSeq++;
+            std::vector<unsigned char> mac = crypto::sessionMAC(sessionKey, seq, *cbData);
+            return boost::shared_ptr<networking::NetvendPacket>(new networking::SessionCommandBatchPacket(requestID, seq, cbData, mac));
+        }
+        
+        std::vector<unsigned char> sig = signMessage(*cbData);
+        return boost::shared_ptr<networking::NetvendPacket>(new networking::CommandBatchPacket(requestID, agentAddress, keyType, cbData, sig));
+    }
+    
+    //cbDatas are answered as requests firstRequestID, firstRequestID+1, ...
+    boost::shared_ptr<networking::NetvendPacket> aggregateCommandBatchPacket(unsigned long firstRequestID, const std::vector<boost::shared_ptr<std::vector<unsigned char> > > &cbDatas) {
+        std::vector<unsigned char> root = crypto::merkleRoot(cbDatas);
+        std::vector<unsigned char> sig = signMessage(root);
+        return boost::shared_ptr<networking::NetvendPacket>(new networking::AggregateCommandBatchPacket(firstRequestID, agentAddress, keyType, cbDatas, sig));
+    }
+    
+public:
+    Agent(boost::asio::io_service& io) {
+        populated = false;
+        nvConnection = NULL;
+        nextRequestID = 1;
+        sessionWanted = false;
+        sessionOpen = false;
+        nextSessionSeq = 0;
+    }
+    void setConnection(NetvendConnection *nv) {
+        nvConnection = nv;
+    }
+    void updateInfo() {
+        //update public key
+        if (keyType == KEYTYPE_ED25519) {
+            const CryptoPP::ed25519PrivateKey& edPrivkey = dynamic_cast<const CryptoPP::ed25519PrivateKey&>(ed25519Signer->GetPrivateKey());
+            const unsigned char* pubkeyBytes = edPrivkey.GetPublicKeyBytePtr();
+            pubkey = crypto::AgentPubkey(KEYTYPE_ED25519, std::vector<unsigned char>(pubkeyBytes, pubkeyBytes + ED25519_PUBKEY_SIZE));
+        }
+        else {
+            pubkey = crypto::AgentPubkey(crypto::RSAPubkey(RSAFunction));
+            privkey = crypto::RSAPrivkey(RSAFunction);
+        }
+
+        //update address
+        agentAddress = crypto::agentPubkeyToNetvendAddress(pubkey);
+    }
+    void generateNew(unsigned char newKeyType=KEYTYPE_RSA) {
+        keyType = newKeyType;
+        if (keyType == KEYTYPE_ED25519)
+            ed25519Signer.reset(new CryptoPP::ed25519Signer(rng));
+        else
+            RSAFunction.GenerateRandomWithKeySize(rng, AGENT_KEYSIZE);
+        updateInfo();
+        populated = true;
+    }
+    void test() {
+
+    }
+    std::string getAddress() {
+        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
+        return agentAddress;
+    }
+    std::vector<unsigned char> getAddressBytes() {
+        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
+        return std::vector<unsigned char>(getAddress().begin(), getAddress().end());
+    }
+    unsigned char getKeyType() {
+        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
+        return keyType;
+    }
+    std::vector<unsigned char> signMessage(std::vector<unsigned char> &message) {
+        if (!populated) throw std::runtime_error("Agent keypair has not been generated");
+        
+        if (keyType == KEYTYPE_ED25519)
+            return crypto::cryptoSign(message, *ed25519Signer, rng);
+        return crypto::cryptoSign(message, privkey, rng);
+    }
+    
+    //functions that need to connect to netvend
+    unsigned long performNetvendHandshake() {
+        networking::HandshakePacket packet(nextRequestID++, pubkey);
+        boost::shared_ptr<networking::HandshakeResponse> response;
+        
+        for (int attempt=0; ; attempt++) {
+            connectToNetvend();
+            try {
+                //send handshake
+                packet.writeToSocket(nvConnection->socket());
+                
+                //receive handshake response
+                unsigned long requestID = networking::readResponseRequestID(nvConnection->socket());
+                if (requestID != packet.requestID()) throw std::runtime_error("Handshake response has an unexpected request ID");
+                
+                response.reset(networking::HandshakeResponse::readFromSocket(requestID, nvConnection->socket()));
+                break;
+            }
+            catch (networking::NetworkingException& e) {
+                //the server may have closed our connection for being idle; reconnect and try once more
+                dropNetvendConnection();
+                if (attempt > 0) throw;
+            }
+        }
+        if (response.get() == NULL) std::cerr << "read failed" << std::endl;
+        
+        return response->defaultPocketID();
+    }
+    
+    //After this, batches are sent with a session MAC instead of a signature.
+    //If the connection drops, the session is reopened on the next one.
+    void startSession() {
+        sessionWanted = true;
+        for (int attempt=0; ; attempt++) {
+            connectToNetvend();
+            try {
+                openSession();
+                break;
+            }
+            catch (networking::NetworkingException& e) {
+                dropNetvendConnection();
+                if (attempt > 0) throw;
+            }
+        }
+    }
+    void endSession() {
+        sessionWanted = false;
+        sessionOpen = false;
+    }
+    
+    //Sends every batch before reading any responses, so the server can work
+    //on them concurrently. Responses come back in whatever order the server
+    //finishes them and are matched up by request ID; the returned vector is
+    //in the same order as batches.
+    std::vector<boost::shared_ptr<networking::CommandBatchResponse> > performCommandBatches(std::vector<boost::shared_ptr<commands::Batch> > &batches) {
+        std::vector<boost::shared_ptr<std::vector<unsigned char> > > cbDatas;
+        std::vector<unsigned long> requestIDs;
+        std::map<unsigned long, unsigned int> batchIndexByRequestID;
+        
+        for (unsigned int i=0; i<batches.size(); i++) {
+            boost::shared_ptr<std::vector<unsigned char> > cbData(new std::vector<unsigned char>());
+            batches[i]->writeToVch(cbData.get());
+            cbDatas.push_back(cbData);
+            
+            unsigned long requestID = nextRequestID++;
+            requestIDs.push_back(requestID);
+            batchIndexByRequestID[requestID] = i;
+        }
+        
+        std::vector<boost::shared_ptr<networking::CommandBatchResponse> > responses(batches.size());
+        unsigned int numReceived = 0;
+        
+        for (int attempt=0; ; attempt++) {
+            connectToNetvend();
+            try {
+                //a reconnect loses the session, so the packets are built per attempt
+                if (sessionWanted && !sessionOpen) {
+                    openSession();
+                }
+                std::vector<boost::shared_ptr<networking::NetvendPacket> > packets;
+                if (!sessionOpen && cbDatas.size() > 1) {
+                    //sign the batches in groups rather than one by one; the
+                    //server still answers each batch under its own request ID
+                    for (unsigned int i=0; i<cbDatas.size(); i+=MAX_AGGREGATE_BATCHES) {
+                        unsigned int end = std::min<unsigned int>(i + MAX_AGGREGATE_BATCHES, cbDatas.size());
+                        std::vector<boost::shared_ptr<std::vector<unsigned char> > > group(cbDatas.begin() + i, cbDatas.begin() + end);
+                        packets.push_back(aggregateCommandBatchPacket(requestIDs[i], group));
+                    }
+                }
+                else {
+                    for (unsigned int i=0; i<cbDatas.size(); i++) {
+                        packets.push_back(commandBatchPacket(requestIDs[i], cbDatas[i]));
+                    }
+                }
+                
+                for (unsigned int i=0; i<packets.size(); i++) {
+                    packets[i]->writeToSocket(nvConnection->socket());
+                }
+                
+                while (numReceived < batches.size()) {
+                    unsigned long requestID = networking::readResponseRequestID(nvConnection->socket());
+                    
+                    std::map<unsigned long, unsigned int>::iterator it = batchIndexByRequestID.find(requestID);
+                    if (it == batchIndexByRequestID.end()) throw std::runtime_error("CommandBatch response has an unexpected request ID");
+                    
+                    responses[it->second].reset(networking::CommandBatchResponse::readFromSocket(requestID, nvConnection->socket(), batches[it->second].get()));
+                    numReceived++;
+                }
+                break;
+            }
+            catch (networking::NetworkingException& e) {
+                //the server may have closed our connection for being idle; reconnect and try once more.
+                //if some responses already arrived the server was clearly working on them, so
+                //resending could run batches twice.
+                dropNetvendConnection();
+                if (attempt > 0 || numReceived > 0) throw;
+            }
+        }
+        
+        return responses;
+    }
+    
+    boost::shared_ptr<commands::results::Result> performSingleCommand(boost::shared_ptr<commands::Command> command) {
+        std::vector<boost::shared_ptr<commands::Batch> > batches(1, boost::shared_ptr<commands::Batch>(new commands::Batch()));
+        batches[0]->addCommand(command);
+        
+        boost::shared_ptr<networking::CommandBatchResponse> response = performCommandBatches(batches)[0];
+        if (response.get() == NULL) std::cerr << "read failed" << std::endl;
+        
+        boost::shared_ptr<commands::results::Result> result = response->commandResultBatch()->results()->at(0);
+        
+        if (result->error()) {
+            boost::shared_ptr<commands::errors::Error> error = boost::dynamic_pointer_cast<commands::errors::Error>(result);
+            throw *error;
+        }
+        
+        return result;
+    }
+    
+    unsigned long createPocket() {
+        boost::shared_ptr<commands::Command> command(new commands::CreatePocket());
+        
+        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
+        
+        boost::shared_ptr<commands::results::CreatePocket> cpResult =
+          boost::dynamic_pointer_cast<commands::results::CreatePocket>(result);
+        
+        assert(cpResult.get() != NULL);
+        
+        return cpResult->pocketID();
+    }
+    
+    std::string requestPocketDepositAddress(unsigned long pocketID) {
+        boost::shared_ptr<commands::Command> command(new commands::RequestPocketDepositAddress(pocketID));
+        
+        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
+        
+        boost::shared_ptr<commands::results::RequestPocketDepositAddress> rpdaResult =
+          boost::dynamic_pointer_cast<commands::results::RequestPocketDepositAddress>(result);
+        
+        assert(rpdaResult.get() != NULL);
+        
+        return rpdaResult->depositAddress();
+    }
+    
+    void transfer(unsigned long fromPocketID, unsigned long toPocketID, long long amount) {
+        boost::shared_ptr<commands::Command> command(new commands::PocketTransfer(fromPocketID, toPocketID, amount));
+        
+        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
+        
+        boost::shared_ptr<commands::results::PocketTransfer> ptResult = 
+          boost::dynamic_pointer_cast<commands::results::PocketTransfer>(result);
+        
+        assert(ptResult.get() != NULL);
+    }
+    
+    unsigned long createFile(std::string name, unsigned long pocketID) {
+        boost::shared_ptr<commands::Command> command(new commands::CreateFile(name, pocketID));
+        
+        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
+        
+        boost::shared_ptr<commands::results::CreateFile> ccResult =
+          boost::dynamic_pointer_cast<commands::results::CreateFile>(result);
+        
+        assert(ccResult.get() != NULL);
+        
+        return ccResult->fileID();
+    }
+    
+    void updateFileByID(unsigned long fileID, unsigned char* data, unsigned short dataSize) {
+        boost::shared_ptr<commands::Command> command(new commands::UpdateFileByID(fileID, data, dataSize));
+        
+        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
+        
+        boost::shared_ptr<commands::results::UpdateFileByID> ucbiResult =
+        boost::dynamic_pointer_cast<commands::results::UpdateFileByID>(result);
+        
+        assert(ucbiResult.get() != NULL);
+    }
+    
+    void appendToFile(unsigned long fileID, unsigned char* data, unsigned short dataSize) {
+        boost::shared_ptr<commands::Command> command(new commands::AppendToFile(fileID, data, dataSize));
+        
+        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
+        
+        boost::shared_ptr<commands::results::AppendToFile> appendResult =
+        boost::dynamic_pointer_cast<commands::results::AppendToFile>(result);
+        
+        assert(appendResult.get() != NULL);
+    }
+    
+    void writeFileRange(unsigned long fileID, unsigned short offset, unsigned char* data, unsigned short dataSize) {
+        boost::shared_ptr<commands::Command> command(new commands::WriteFileRange(fileID, offset, data, dataSize));
+        
+        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
+        
+        boost::shared_ptr<commands::results::WriteFileRange> rangeResult =
+        boost::dynamic_pointer_cast<commands::results::WriteFileRange>(result);
+        
+        assert(rangeResult.get() != NULL);
+    }
+    
+    std::vector<unsigned char> readFileByID(unsigned long fileID) {
+        boost::shared_ptr<commands::Command> command(new commands::ReadFileByID(fileID));
+        
+        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
+        
+        boost::shared_ptr<commands::results::ReadFileByID> readResult =
+        boost::dynamic_pointer_cast<commands::results::ReadFileByID>(result);
+        
+        assert(readResult.get() != NULL);
+        
+        return *(readResult->fileData());
+    }
+    
+    std::vector<unsigned char> readFileRange(unsigned long fileID, unsigned short offset, unsigned short length) {
+        boost::shared_ptr<commands::Command> command(new commands::ReadFileRange(fileID, offset, length));
+        
+        boost::shared_ptr<commands::results::Result> result = performSingleCommand(command);
+        
+        boost::shared_ptr<commands::results::ReadFileRange> rangeResult =
+        boost::dynamic_pointer_cast<commands::results::ReadFileRange>(result);
+        
+        assert(rangeResult.get() != NULL);
+        
+        return *(rangeResult->fileData());
+    }
+    
+    //reads each file with its own pipelined CommandBatch
+    std::vector<std::vector<unsigned char> > readFilesByID(std::vector<unsigned long> fileIDs) {
+        std::vector<boost::shared_ptr<commands::Batch> > batches;
+        for (unsigned int i=0; i<fileIDs.size(); i++) {
+            boost::shared_ptr<commands::Batch> cb(new commands::Batch());
+            cb->addCommand(boost::shared_ptr<commands::Command>(new commands::ReadFileByID(fileIDs[i])));
+            batches.push_back(cb);
+        }
+        
+        std::vector<boost::shared_ptr<networking::CommandBatchResponse> > responses = performCommandBatches(batches);
+        
+        std::vector<std::vector<unsigned char> > filesData;
+        for (unsigned int i=0; i<responses.size(); i++) {
+            boost::shared_ptr<commands::results::Result> result = responses[i]->commandResultBatch()->results()->at(0);
+            
+            if (result->error()) {
+                boost::shared_ptr<commands::errors::Error> error = boost::dynamic_pointer_cast<commands::errors::Error>(result);
+                throw *error;
+            }
+            
+            boost::shared_ptr<commands::results::ReadFileByID> readResult =
+            boost::dynamic_pointer_cast<commands::results::ReadFileByID>(result);
+            
+            assert(readResult.get() != NULL);
+            
+            filesData.push_back(*(readResult->fileData()));
+        }
+        
+        return filesData;
+    }
+};
+
+std::map<std::string, Agent> agents;
+
+std::string selectedAgentName;
+Agent* selectedAgent;
+
+const char helpstr[] = 
+"help - help\n\
+q - quit\n\
+newagent [name] [rsa|ed25519] - new agent, with an RSA key unless ed25519 is given\n\
+agents - list agents\n\
+agent [name] - select agent\n\
+\n\
+h - Perform netvend handshake\n\
+\n\
+newpocket - Create new Pocket\n\
+pocketdeposit [pocketID] - Request deposit address for pocket\n\
+transfer [fromPocketID] [toPocketID] [amount] - Transfer credit from one pocket to another\n\
+\n\
+newfile [name] [pocketID] - Create a new file with [name], thethered to pocket [pocketID]\n\
+write [fileID] [data] - write to file [fileID] with [data] (overwrites old data)\n\
+append [fileID] [data] - add [data] to the end of file [fileID]\n\
+writerange [fileID] [offset] [data] - write [data] over file [fileID], starting at [offset]\n\
+read [fileID] - read data from file [fileID]\n\
+readrange [fileID] [offset] [length] - read [length] bytes of file [fileID], starting at [offset]\n\
+readmany [count] [fileID]... - read [count] files at once, each in its own pipelined request\n\
+\n\
+session [on|off] - authenticate batches with a session key instead of signing each one";
+
+void createNewAgent(std::string name, boost::asio::io_service& io, unsigned char keyType=KEYTYPE_RSA, bool output=true) {
+    Agent agent(io);
+    agent.generateNew(keyType);
+    agents.insert(std::pair<std::string, Agent>(name, agent));
+    if (output)
+        std::cout << "new agent '" << name << "' created with address " << agent.getAddress() << std::endl;
+}
+
+bool selectAgent(std::string name, bool output=true) {
+    selectedAgentName = name;
+    try {
+        selectedAgent = &(agents.at(name));
+    }
+    catch (std::out_of_range &e) {
+    if (output)
+        std::cout << "no agent '" << name << "' exists!" << std::endl;
+    return false;
+    }
+    if (output)
+        std::cout << "agent '" << name << "' selected." << std::endl;
+    return true;
+}
+
+int main() {
+    boost::asio::io_service io;
+    NetvendConnection nvConnection(io);
+    
+    while (true) {
+        std::cin.sync();
+
+        std::string commandCode;
+        std::cout << "> ";
+        std::cin >> commandCode;
+
+        if (commandCode == "help") {
+            std::cout << helpstr << std::endl;
+        }
+        else if (commandCode == "q") {
+            nvConnection.disconnect();
+            return 0;
+        }
+        else if (commandCode == "newagent") {
+            std::string name;
+            std::cin >> name;
+            
+            //optional key type; anything left on the line
+            std::string keyTypeStr;
+            std::getline(std::cin, keyTypeStr);
+            boost::algorithm::trim(keyTypeStr);
+            unsigned char keyType = KEYTYPE_RSA;
+            if (keyTypeStr == "ed25519")
+                keyType = KEYTYPE_ED25519;
+            else if (keyTypeStr != "" && keyTypeStr != "rsa") {
+                std::cout << "unknown key type '" << keyTypeStr << "'" << std::endl;
+                continue;
+            }
+
+            createNewAgent(name, io, keyType);
+
+            selectAgent(name);
+            selectedAgent->setConnection(&nvConnection);
+        }
+        else if (commandCode == "agents") {
+            for (std::map<std::string, Agent>::iterator it=agents.begin(); it != agents.end(); it++) {
+                std::cout << it->first << " (" << it->second.getAddress() << ")" << std::endl;
+            }
+        }
+        else if (commandCode == "agent") {
+            std::string name;
+            std::cin >> name;
+
+            selectAgent(name);
+        }
+        else if (commandCode == "h") {
+            unsigned long defaultPocketID = selectedAgent->performNetvendHandshake();
+            if (defaultPocketID) {
+                std::cout << "Handshake complete; added to netvend as a new agent." << std::endl;
+                std::cout << "Default agent pocket id: " << defaultPocketID << std::endl;
+            }
+            else {
+                std::cout << "Handshake complete; recognized by netvend as an existing agent." << std::endl;
+            }
+        }
+        else if (commandCode == "newpocket") {
+            std::cout << "Pocket created with id " << selectedAgent->createPocket() << std::endl;
+        }
+        else if (commandCode == "pocketdeposit") {
+            unsigned long pocketID;
+            
+            std::cin >> pocketID;
+            
+            std::cout << "Pocket " << pocketID << " now has a deposit address " << selectedAgent->requestPocketDepositAddress(pocketID) << std::endl;
+        }
+        else if (commandCode == "transfer") {
+            unsigned long fromPocketID, toPocketID;
+            long long amount;
+            
+            std::cin >> fromPocketID >> toPocketID >> amount;
+            
+            selectedAgent->transfer(fromPocketID, toPocketID, amount);
+            
+            std::cout << "Transfered." << std::endl;
+        }
+        else if (commandCode == "newfile") {
+            std::string name;
+            unsigned long pocketID;
+            
+            std::cin >> name >> pocketID;
+            
+            std::cout << "File " << selectedAgent->createFile(name, pocketID) << " has been created." << std::endl;
+        }
+        else if (commandCode == "write") {
+            unsigned long fileID;
+            std::string s;
+            
+            std::cin >> fileID >> s;
+            
+            selectedAgent->updateFileByID(fileID, (unsigned char*)s.data(), s.size());
+            
+            std::cout << "File " << fileID << " updated." << std::endl;
+        }
+        else if (commandCode == "append") {
+            unsigned long fileID;
+            std::string s;
+            
+            std::cin >> fileID >> s;
+            
+            selectedAgent->appendToFile(fileID, (unsigned char*)s.data(), s.size());
+            
+            std::cout << "File " << fileID << " appended to." << std::endl;
+        }
+        else if (commandCode == "writerange") {
+            unsigned long fileID;
+            unsigned short offset;
+            std::string s;
+            
+            std::cin >> fileID >> offset >> s;
+            
+            selectedAgent->writeFileRange(fileID, offset, (unsigned char*)s.data(), s.size());
+            
+            std::cout << "File " << fileID << " updated." << std::endl;
+        }
+        else if (commandCode == "read") {
+            unsigned long fileID;
+            
+            std::cin >> fileID;
+            
+            std::vector<unsigned char> fileData = selectedAgent->readFileByID(fileID);
+            
+            std::string s;
+            s.resize(fileData.size());
+            std::copy(fileData.begin(), fileData.end(), s.begin());
+            
+            std::cout << "data: " << s << std::endl;
+        }
+        else if (commandCode == "readrange") {
+            unsigned long fileID;
+            unsigned short offset, length;
+            
+            std::cin >> fileID >> offset >> length;
+            
+            std::vector<unsigned char> fileData = selectedAgent->readFileRange(fileID, offset, length);
+            
+            std::string s(fileData.begin(), fileData.end());
+            std::cout << "data: " << s << std::endl;
+        }
+        else if (commandCode == "readmany") {
+            unsigned int count;
+            std::cin >> count;
+            
+            std::vector<unsigned long> fileIDs(count);
+            for (unsigned int i=0; i<count; i++) {
+                std::cin >> fileIDs[i];
+            }
+            
+            std::vector<std::vector<unsigned char> > filesData = selectedAgent->readFilesByID(fileIDs);
+            
+            for (unsigned int i=0; i<count; i++) {
+                std::string s(filesData[i].begin(), filesData[i].end());
+                std::cout << fileIDs[i] << ": " << s << std::endl;
+            }
+        }
+        else if (commandCode == "session") {
+            std::string onOff;
+            std::cin >> onOff;
+            
+            if (onOff == "on") {
+                selectedAgent->startSession();
+                std::cout << "Session started." << std::endl;
+            }
+            else if (onOff == "off") {
+                selectedAgent->endSession();
+                std::cout << "Session ended; batches will be signed." << std::endl;
+            }
+            else {
+                std::cout << "session on or session off?" << std::endl;
+            }
+        }
+        else if (commandCode == "t") {
+            
+        }
+        else {
+            std::cout << "Unrecognized command." << std::endl;
+        }
+    }
+    
+    std::cin.get();
 }
\ No newline at end of file
@@ -0,0 +1,3 @@
+-- Agents may now use ed25519 keys as well as RSA ones (see KEYTYPE_* in
+-- netvend/common_constants.h). Every existing agent has an RSA key.
+ALTER TABLE agents ADD COLUMN key_type smallint NOT NULL DEFAULT 0;
@@ -0,0 +1,15 @@
+-- Each pocket keeps a running count of the files it supports and their total
+-- size, and each file its own size, so working out upkeep fees only reads
+-- pockets (see feeRateSQL and SETTLE_POCKET_FEES in util/database.cpp).
+BEGIN;
+
+ALTER TABLE files ADD COLUMN size int NOT NULL DEFAULT 0;
+UPDATE files SET size = COALESCE(OCTET_LENGTH(data), 0);
+
+ALTER TABLE pockets ADD COLUMN file_count int NOT NULL DEFAULT 0;
+ALTER TABLE pockets ADD COLUMN total_bytes bigint NOT NULL DEFAULT 0;
+UPDATE pockets SET file_count = sub.file_count, total_bytes = sub.total_bytes
+FROM (SELECT pocket, COUNT(*) AS file_count, SUM(size) AS total_bytes FROM files GROUP BY pocket) AS sub
+WHERE pockets.pocket_id = sub.pocket;
+
+COMMIT;
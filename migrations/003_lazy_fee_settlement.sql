@@ -0,0 +1,4 @@
+-- Upkeep fees are no longer charged to every pocket on an interval. Each
+-- pocket accrues them from fees_settled_at on, and they are settled when the
+-- pocket is next used or is due to run dry (see FeeScheduler in server.cpp).
+ALTER TABLE pockets ADD COLUMN fees_settled_at timestamptz NOT NULL DEFAULT now();
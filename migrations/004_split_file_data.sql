@@ -0,0 +1,20 @@
+-- File payloads move out of files into file_data, so that ownership checks,
+-- fee settlement and the rest of the metadata paths don't pull TOAST pages
+-- through the buffer cache. files(pocket) is indexed for settlement, which
+-- looks up and deletes files by pocket.
+BEGIN;
+
+CREATE TABLE file_data (
+    file_id int NOT NULL REFERENCES files(file_id) ON DELETE CASCADE,
+    data bytea,
+    PRIMARY KEY (file_id)
+);
+INSERT INTO file_data (file_id, data) SELECT file_id, data FROM files;
+
+ALTER TABLE files DROP COLUMN data;
+CREATE INDEX files_pocket ON files (pocket);
+
+COMMIT;
+
+-- Dropping the column doesn't give its space back; run VACUUM FULL files;
+-- afterwards, when the server can be down long enough.
@@ -0,0 +1,20 @@
+-- File data may now be kept in a local blob store (server.blob-store-dir)
+-- instead of in file_data.data. Each distinct content is stored once, named by
+-- its SHA-256 hash; blobs records where it is and how many files use it.
+BEGIN;
+
+CREATE TABLE blobs (
+    hash bytea NOT NULL,
+    segment int NOT NULL,
+    segment_offset bigint NOT NULL,
+    length int NOT NULL,
+    refcount int NOT NULL,
+    PRIMARY KEY (hash)
+);
+
+CREATE INDEX blobs_segment ON blobs (segment);
+CREATE INDEX blobs_dead ON blobs (hash) WHERE refcount = 0;
+
+ALTER TABLE file_data ADD COLUMN blob_hash bytea REFERENCES blobs(hash);
+
+COMMIT;
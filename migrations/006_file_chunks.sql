@@ -0,0 +1,26 @@
+-- File data kept in the database moves out of file_data.data into file_chunks,
+-- 4000 bytes a row (FILE_CHUNK_SIZE in util/database.h), so that appending to
+-- or writing part of a file only replaces the chunks it touches instead of
+-- the whole TOASTed value. Chunks are kept small enough to store inline, and
+-- uncompressed, so no write goes through TOAST at all.
+BEGIN;
+
+CREATE TABLE file_chunks (
+    file_id int NOT NULL REFERENCES files(file_id) ON DELETE CASCADE,
+    chunk_no int NOT NULL,
+    data bytea NOT NULL,
+    PRIMARY KEY (file_id, chunk_no)
+);
+ALTER TABLE file_chunks ALTER COLUMN data SET STORAGE PLAIN;
+
+INSERT INTO file_chunks (file_id, chunk_no, data)
+SELECT file_id, chunk.n, substring(data FROM chunk.n * 4000 + 1 FOR 4000)
+FROM file_data, generate_series(0, (length(data) + 4000 - 1) / 4000 - 1) AS chunk(n)
+WHERE data IS NOT NULL AND blob_hash IS NULL;
+
+ALTER TABLE file_data DROP COLUMN data;
+
+COMMIT;
+
+-- As with 004, run VACUUM FULL file_data; afterwards to get the old data's
+-- space back.
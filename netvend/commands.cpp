@@ -1,5 +1,8 @@
 #include "commands.h"
 
+#include <cerrno>
+#include <unistd.h>
+
 namespace commands {
 
     Command::Command(unsigned char typeChar)
@@ -38,6 +41,15 @@ namespace commands {
         if (typeChar == COMMANDTYPECHAR_READ_FILE_BY_ID) {
             return commands::ReadFileByID::consumeFromBuf(ptrPtr);
         }
+        if (typeChar == COMMANDTYPECHAR_READ_FILE_RANGE) {
+            return commands::ReadFileRange::consumeFromBuf(ptrPtr);
+        }
+        if (typeChar == COMMANDTYPECHAR_APPEND_TO_FILE) {
+            return commands::AppendToFile::consumeFromBuf(ptrPtr);
+        }
+        if (typeChar == COMMANDTYPECHAR_WRITE_FILE_RANGE) {
+            return commands::WriteFileRange::consumeFromBuf(ptrPtr);
+        }
         else {
             throw std::runtime_error("bad packet; unrecognized command typechar '" + boost::lexical_cast<std::string>(typeChar) + "'");
             return NULL;
@@ -50,7 +62,8 @@ namespace commands {
     
     
     
-    Batch::Batch()
+    Batch::Batch(unsigned char flags)
+    : flags_(flags)
     {}
     
     void Batch::writeToVch(std::vector<unsigned char>* vch) {
@@ -58,12 +71,13 @@ namespace commands {
         
         unsigned char numCmds = commands_.size();
         
-        static const size_t DATA_SIZE = PACK_C_SIZE;
+        static const size_t DATA_SIZE = PACK_C_SIZE + PACK_C_SIZE;
         
         unsigned int place = vch->size();
         
         vch->resize(place + DATA_SIZE);
         place += pack(vch->data()+place, "C", numCmds);
+        place += pack(vch->data()+place, "C", flags_);
         assert(place == vch->size());
         
         for (int i=0; i<numCmds; i++) {
@@ -73,9 +87,11 @@ namespace commands {
     
     commands::Batch* Batch::consumeFromBuf(unsigned char **ptrPtr) {
         unsigned char numCmds;
+        unsigned char flags;
         *ptrPtr += unpack(*ptrPtr, "C", &numCmds);
+        *ptrPtr += unpack(*ptrPtr, "C", &flags);
         
-        commands::Batch* cb = new Batch();
+        commands::Batch* cb = new Batch(flags);
         for (int i=0; i<numCmds; i++) {
             Command* command = Command::consumeFromBuf(ptrPtr);
             cb->addCommand(boost::shared_ptr<Command>(command));
@@ -92,6 +108,14 @@ namespace commands {
         return &commands_;
     }
     
+    unsigned char Batch::flags() {
+        return flags_;
+    }
+    
+    bool Batch::atomic() {
+        return flags_ & BATCHFLAG_ATOMIC;
+    }
+    
     
 
     CreatePocket::CreatePocket()
@@ -232,6 +256,12 @@ namespace commands {
         mustFreeData_ = false;
     }
     
+    UpdateFileByID::UpdateFileByID(unsigned char typeChar, unsigned long fileID, unsigned char* data, unsigned short dataSize)
+    : Command(typeChar), fileID_(fileID), data_(data), dataSize_(dataSize)
+    {
+        mustFreeData_ = false;
+    }
+    
     UpdateFileByID::~UpdateFileByID() {
         if (mustFreeData_) {
             delete [] data_;
@@ -307,6 +337,95 @@ namespace commands {
     }
     
     unsigned long ReadFileByID::fileID() {return fileID_;}
+    
+    
+    
+    ReadFileRange::ReadFileRange(unsigned long fileID, unsigned short offset, unsigned short length)
+    : Command(COMMANDTYPECHAR_READ_FILE_RANGE), fileID_(fileID), offset_(offset), length_(length)
+    {}
+    
+    void ReadFileRange::writeToVch(std::vector<unsigned char>* vch) {
+        Command::writeToVch(vch);
+        
+        const size_t DATA_SIZE = PACK_L_SIZE + PACK_H_SIZE + PACK_H_SIZE;
+        
+        unsigned int place = vch->size();
+        
+        vch->resize(place + DATA_SIZE);
+        
+        place += pack(vch->data()+place, "LHH", fileID_, offset_, length_);
+        
+        assert(place == vch->size());
+    }
+    
+    commands::ReadFileRange* ReadFileRange::consumeFromBuf(unsigned char **ptrPtr) {
+        unsigned long fileID;
+        unsigned short offset, length;
+        *ptrPtr += unpack(*ptrPtr, "LHH", &fileID, &offset, &length);
+        
+        return new ReadFileRange(fileID, offset, length);
+    }
+    
+    unsigned long ReadFileRange::fileID() {return fileID_;}
+    unsigned short ReadFileRange::offset() {return offset_;}
+    unsigned short ReadFileRange::length() {return length_;}
+    
+    
+    
+    AppendToFile::AppendToFile(unsigned long fileID, unsigned char* data, unsigned short dataSize)
+    : UpdateFileByID(COMMANDTYPECHAR_APPEND_TO_FILE, fileID, data, dataSize)
+    {}
+    
+    commands::AppendToFile* AppendToFile::consumeFromBuf(unsigned char **ptrPtr) {
+        unsigned long fileID;
+        unsigned short dataSize;
+        *ptrPtr += unpack(*ptrPtr, "LH", &fileID, &dataSize);
+        
+        commands::AppendToFile* newAppendCmd = new AppendToFile(fileID, NULL, dataSize);
+        newAppendCmd->allocSpace();
+        std::copy_n(*ptrPtr, dataSize, newAppendCmd->data());
+        *ptrPtr += dataSize;
+        
+        return newAppendCmd;
+    }
+    
+    
+    
+    WriteFileRange::WriteFileRange(unsigned long fileID, unsigned short offset, unsigned char* data, unsigned short dataSize)
+    : UpdateFileByID(COMMANDTYPECHAR_WRITE_FILE_RANGE, fileID, data, dataSize), offset_(offset)
+    {}
+    
+    void WriteFileRange::writeToVch(std::vector<unsigned char>* vch) {
+        Command::writeToVch(vch);
+        
+        const size_t DATA_SIZE = PACK_L_SIZE + PACK_H_SIZE + PACK_H_SIZE + dataSize();
+        
+        unsigned int place = vch->size();
+        
+        vch->resize(place + DATA_SIZE);
+        
+        place += pack(vch->data()+place, "LHH", fileID(), offset_, dataSize());
+        
+        std::copy_n(data(), dataSize(), vch->data()+place);
+        place += dataSize();
+        
+        assert(place == vch->size());
+    }
+    
+    commands::WriteFileRange* WriteFileRange::consumeFromBuf(unsigned char **ptrPtr) {
+        unsigned long fileID;
+        unsigned short offset, dataSize;
+        *ptrPtr += unpack(*ptrPtr, "LHH", &fileID, &offset, &dataSize);
+        
+        commands::WriteFileRange* newWriteCmd = new WriteFileRange(fileID, offset, NULL, dataSize);
+        newWriteCmd->allocSpace();
+        std::copy_n(*ptrPtr, dataSize, newWriteCmd->data());
+        *ptrPtr += dataSize;
+        
+        return newWriteCmd;
+    }
+    
+    unsigned short WriteFileRange::offset() {return offset_;}
 
 namespace results {
 
@@ -351,6 +470,15 @@ namespace results {
         else if (commandType == commands::COMMANDTYPECHAR_READ_FILE_BY_ID) {
             return results::ReadFileByID::consumeFromBuf(cost, ptrPtr);
         }
+        else if (commandType == commands::COMMANDTYPECHAR_READ_FILE_RANGE) {
+            return results::ReadFileRange::consumeFromBuf(cost, ptrPtr);
+        }
+        else if (commandType == commands::COMMANDTYPECHAR_APPEND_TO_FILE) {
+            return results::AppendToFile::consumeFromBuf(cost, ptrPtr);
+        }
+        else if (commandType == commands::COMMANDTYPECHAR_WRITE_FILE_RANGE) {
+            return results::WriteFileRange::consumeFromBuf(cost, ptrPtr);
+        }
         
         else {
             throw std::runtime_error("bad response; commandTypeChar " + boost::lexical_cast<std::string>(commandType) + " unrecognized.");
@@ -378,6 +506,10 @@ namespace results {
     }
     
     void Batch::writeToVch(std::vector<unsigned char>* vch) {
+        writeToVch(vch, NULL);
+    }
+    
+    void Batch::writeToVch(std::vector<unsigned char>* vch, std::vector<Splice>* splices) {
         assert(results_.size() <= 255);
         unsigned char numCmds = results_.size();
         
@@ -392,7 +524,13 @@ namespace results {
         assert(place == vch->size());
         
         for (int i=0; i<numCmds; i++) {
-            results_[i]->writeToVch(vch);
+            boost::shared_ptr<ReadFileByID> readResult = boost::dynamic_pointer_cast<ReadFileByID>(results_[i]);
+            if (readResult.get() != NULL) {
+                readResult->writeToVch(vch, splices);
+            }
+            else {
+                results_[i]->writeToVch(vch);
+            }
         }
     }
     
@@ -542,15 +680,39 @@ namespace results {
     
     
     ReadFileByID::ReadFileByID(unsigned long long cost, std::vector<unsigned char> fileData)
-    : Result(errors::ERRORTYPECHAR_NONE, cost), fileData_(fileData)
+    : Result(errors::ERRORTYPECHAR_NONE, cost), dataOffset_(0), dataLength_(fileData.size()), spliced_(false)
+    {
+        boost::shared_ptr<std::vector<unsigned char> > ownData(new std::vector<unsigned char>());
+        ownData->swap(fileData);
+        fileData_ = ownData;
+    }
+    
+    ReadFileByID::ReadFileByID(unsigned long long cost, boost::shared_ptr<const std::vector<unsigned char> > fileData)
+    : Result(errors::ERRORTYPECHAR_NONE, cost), fileData_(fileData), dataOffset_(0), dataLength_(fileData->size()), spliced_(false)
+    {}
+    
+    ReadFileByID::ReadFileByID(unsigned long long cost, boost::shared_ptr<const std::vector<unsigned char> > fileData, unsigned short offset, unsigned short length)
+    : Result(errors::ERRORTYPECHAR_NONE, cost), fileData_(fileData), dataOffset_(offset), dataLength_(length), spliced_(false)
+    {
+        assert((size_t)offset + length <= fileData_->size());
+    }
+    
+    ReadFileByID::ReadFileByID(unsigned long long cost, FileSpan span)
+    : Result(errors::ERRORTYPECHAR_NONE, cost), dataOffset_(0), dataLength_(0), spliced_(true), span_(span)
     {}
     
     void ReadFileByID::writeToVch(std::vector<unsigned char>* vch) {
+        writeToVch(vch, NULL);
+    }
+    
+    //with no splices to note it in, spliced file data is read into the vch after all
+    void ReadFileByID::writeToVch(std::vector<unsigned char>* vch, std::vector<Splice>* splices) {
         Result::writeToVch(vch);
         
-        unsigned short fileDataSize = fileData_.size();
+        unsigned short fileDataSize = spliced_ ? span_.length : dataLength_;
+        bool inVch = !spliced_ || splices == NULL;
         
-        const size_t DATA_SIZE = PACK_H_SIZE + fileDataSize;
+        const size_t DATA_SIZE = PACK_H_SIZE + (inVch ? fileDataSize : 0);
         
         unsigned int place = vch->size();
         
@@ -558,8 +720,26 @@ namespace results {
         
         place += pack(vch->data()+place, "H", fileDataSize);
         
-        std::copy(fileData_.begin(), fileData_.end(), vch->data()+place);
-        place += fileDataSize;
+        if (!spliced_) {
+            std::copy_n(fileData_->begin() + dataOffset_, dataLength_, vch->data()+place);
+            place += fileDataSize;
+        }
+        else if (splices == NULL) {
+            unsigned int done = 0;
+            while (done < fileDataSize) {
+                ssize_t n = pread(span_.file->fd(), vch->data()+place+done, fileDataSize-done, span_.offset+done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) throw std::runtime_error("reading spliced file data failed");
+                done += n;
+            }
+            place += fileDataSize;
+        }
+        else {
+            Splice splice;
+            splice.place = place;
+            splice.span = span_;
+            splices->push_back(splice);
+        }
         
         assert(place == vch->size());
     }
@@ -576,8 +756,52 @@ namespace results {
         return new results::ReadFileByID(cost, fileData);
     }
     
-    std::vector<unsigned char>* ReadFileByID::fileData() {
-        return &fileData_;
+    const std::vector<unsigned char>* ReadFileByID::fileData() {
+        return fileData_.get();
+    }
+    
+    
+    
+    ReadFileRange::ReadFileRange(unsigned long long cost, std::vector<unsigned char> fileData)
+    : ReadFileByID(cost, fileData)
+    {}
+    
+    ReadFileRange::ReadFileRange(unsigned long long cost, boost::shared_ptr<const std::vector<unsigned char> > fileData, unsigned short offset, unsigned short length)
+    : ReadFileByID(cost, fileData, offset, length)
+    {}
+    
+    ReadFileRange::ReadFileRange(unsigned long long cost, FileSpan span)
+    : ReadFileByID(cost, span)
+    {}
+    
+    results::ReadFileRange* ReadFileRange::consumeFromBuf(unsigned long long cost, unsigned char **ptrPtr) {
+        unsigned short fileDataSize;
+        *ptrPtr += unpack(*ptrPtr, "H", &fileDataSize);
+        
+        std::vector<unsigned char> fileData(*ptrPtr, *ptrPtr + fileDataSize);
+        *ptrPtr += fileDataSize;
+        
+        return new results::ReadFileRange(cost, fileData);
+    }
+    
+    
+    
+    AppendToFile::AppendToFile(unsigned long long cost)
+    : UpdateFileByID(cost)
+    {}
+    
+    results::AppendToFile* AppendToFile::consumeFromBuf(unsigned long long cost, unsigned char **ptrPtr) {
+        return new results::AppendToFile(cost);
+    }
+    
+    
+    
+    WriteFileRange::WriteFileRange(unsigned long long cost)
+    : UpdateFileByID(cost)
+    {}
+    
+    results::WriteFileRange* WriteFileRange::consumeFromBuf(unsigned long long cost, unsigned char **ptrPtr) {
+        return new results::WriteFileRange(cost);
     }
 
 }//namesace commands::results
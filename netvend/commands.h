@@ -8,6 +8,7 @@
 
 #include "netvend/common_constants.h"
 #include "util/pack.h"
+#include "util/blobstore.h"
 
 namespace commands {
 
@@ -15,12 +16,19 @@ namespace commands {
     const unsigned char COMMANDBATCH_COMPLETION_SOME = 1;
     const unsigned char COMMANDBATCH_COMPLETION_ALL = 2;
     
+    //Batch flags. An atomic batch runs all or nothing: the first error in it
+    //rolls back every command, and it completes with COMMANDBATCH_COMPLETION_NONE.
+    const unsigned char BATCHFLAG_ATOMIC = 0x01;
+    
     const char COMMANDTYPECHAR_CREATE_POCKET = 0;
     const char COMMANDTYPECHAR_REQUEST_POCKET_DEPOSIT_ADDRESS = 1;
     const char COMMANDTYPECHAR_POCKET_TRANSFER = 2;
     const char COMMANDTYPECHAR_CREATE_FILE = 3;
     const char COMMANDTYPECHAR_UPDATE_FILE_BY_ID = 4;
     const char COMMANDTYPECHAR_READ_FILE_BY_ID = 5;
+    const char COMMANDTYPECHAR_READ_FILE_RANGE = 6;
+    const char COMMANDTYPECHAR_APPEND_TO_FILE = 7;
+    const char COMMANDTYPECHAR_WRITE_FILE_RANGE = 8;
 
     class Command {
         unsigned char typeChar_;
@@ -33,12 +41,15 @@ namespace commands {
     
     class Batch {
         std::vector<boost::shared_ptr<Command> > commands_;
+        unsigned char flags_;
     public:
-        Batch();
+        Batch(unsigned char flags=0);
         virtual void writeToVch(std::vector<unsigned char>* vch);
         static commands::Batch* consumeFromBuf(unsigned char **ptrPtr);
         void addCommand(boost::shared_ptr<Command> command);
         std::vector<boost::shared_ptr<Command> >* commands();
+        unsigned char flags();
+        bool atomic();
     };
 
     class CreatePocket : public Command {
@@ -86,6 +97,8 @@ namespace commands {
         unsigned char* data_;
         unsigned short dataSize_;
         bool mustFreeData_;
+    protected:
+        UpdateFileByID(unsigned char typeChar, unsigned long fileID, unsigned char* data, unsigned short dataSize);
     public:
         UpdateFileByID(unsigned long fileID, unsigned char* data, unsigned short dataSize);
         ~UpdateFileByID();
@@ -105,6 +118,38 @@ namespace commands {
 	static commands::ReadFileByID* consumeFromBuf(unsigned char **ptrPtr);
 	unsigned long fileID();
     };
+    
+    //length bytes of a file from offset on, or as many as there are
+    class ReadFileRange : public Command {
+        unsigned long fileID_;
+        unsigned short offset_;
+        unsigned short length_;
+    public:
+        ReadFileRange(unsigned long fileID, unsigned short offset, unsigned short length);
+        void writeToVch(std::vector<unsigned char>* vch);
+        static commands::ReadFileRange* consumeFromBuf(unsigned char **ptrPtr);
+        unsigned long fileID();
+        unsigned short offset();
+        unsigned short length();
+    };
+    
+    //data added to the end of a file; encoded just like UpdateFileByID
+    class AppendToFile : public UpdateFileByID {
+    public:
+        AppendToFile(unsigned long fileID, unsigned char* data, unsigned short dataSize);
+        static commands::AppendToFile* consumeFromBuf(unsigned char **ptrPtr);
+    };
+    
+    //data written over a file from offset on, growing it if need be. If offset
+    //is past the end, the bytes in between read as zeros.
+    class WriteFileRange : public UpdateFileByID {
+        unsigned short offset_;
+    public:
+        WriteFileRange(unsigned long fileID, unsigned short offset, unsigned char* data, unsigned short dataSize);
+        void writeToVch(std::vector<unsigned char>* vch);
+        static commands::WriteFileRange* consumeFromBuf(unsigned char **ptrPtr);
+        unsigned short offset();
+    };
 
 namespace results {
 
@@ -119,6 +164,21 @@ namespace results {
         bool error();
     };
     
+    //Bytes of a serialized result that are left in a file, to be sent to the
+    //socket straight from it rather than copied through the vch. The span holds
+    //the file open until it's sent, even if its segment is removed meanwhile.
+    struct FileSpan {
+        boost::shared_ptr<blobstore::SegmentFile> file;
+        unsigned long long offset;
+        unsigned short length;
+    };
+    
+    //a FileSpan whose bytes belong at place in the vch
+    struct Splice {
+        unsigned int place;
+        FileSpan span;
+    };
+    
     class Batch {
         commands::Batch* initiatingCommandBatch_;
         std::vector<boost::shared_ptr<Result> > results_;
@@ -127,6 +187,8 @@ namespace results {
         Batch(commands::Batch* initiatingCommandBatch);
         void addResult(boost::shared_ptr<Result> result);
         void writeToVch(std::vector<unsigned char>* vch);
+        //leaves the file data of any spliced ReadFileByID results out, noting where it goes in splices
+        void writeToVch(std::vector<unsigned char>* vch, std::vector<Splice>* splices);
         void consumeFromBuf(unsigned char **ptrPtr);
         std::vector<boost::shared_ptr<Result> >* results();
         unsigned long long cost();
@@ -173,13 +235,47 @@ namespace results {
         static results::UpdateFileByID* consumeFromBuf(unsigned long long cost, unsigned char **ptrPtr);
     };
     
+    //encoded just like UpdateFileByID
+    class AppendToFile : public UpdateFileByID {
+    public:
+        AppendToFile(unsigned long long cost);
+        static results::AppendToFile* consumeFromBuf(unsigned long long cost, unsigned char **ptrPtr);
+    };
+    
+    //encoded just like UpdateFileByID
+    class WriteFileRange : public UpdateFileByID {
+    public:
+        WriteFileRange(unsigned long long cost);
+        static results::WriteFileRange* consumeFromBuf(unsigned long long cost, unsigned char **ptrPtr);
+    };
+    
     class ReadFileByID : public Result {
-        std::vector<unsigned char> fileData_;
+        boost::shared_ptr<const std::vector<unsigned char> > fileData_;
+        //the part of fileData_ that's sent
+        unsigned short dataOffset_;
+        unsigned short dataLength_;
+        bool spliced_;
+        FileSpan span_;
     public:
         ReadFileByID(unsigned long long cost, std::vector<unsigned char> fileData);
+        //shares the data (with the file cache, say) rather than copying it
+        ReadFileByID(unsigned long long cost, boost::shared_ptr<const std::vector<unsigned char> > fileData);
+        ReadFileByID(unsigned long long cost, boost::shared_ptr<const std::vector<unsigned char> > fileData, unsigned short offset, unsigned short length);
+        //the file data stays in the file until it's written out
+        ReadFileByID(unsigned long long cost, FileSpan span);
         void writeToVch(std::vector<unsigned char>* vch);
+        void writeToVch(std::vector<unsigned char>* vch, std::vector<Splice>* splices);
         static results::ReadFileByID* consumeFromBuf(unsigned long long cost, unsigned char **ptrPtr);
-        std::vector<unsigned char>* fileData();
+        const std::vector<unsigned char>* fileData();
+    };
+    
+    //encoded just like ReadFileByID, with the range's data
+    class ReadFileRange : public ReadFileByID {
+    public:
+        ReadFileRange(unsigned long long cost, std::vector<unsigned char> fileData);
+        ReadFileRange(unsigned long long cost, boost::shared_ptr<const std::vector<unsigned char> > fileData, unsigned short offset, unsigned short length);
+        ReadFileRange(unsigned long long cost, FileSpan span);
+        static results::ReadFileRange* consumeFromBuf(unsigned long long cost, unsigned char **ptrPtr);
     };
 
 }//namespace commands::results
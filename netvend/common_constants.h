@@ -7,8 +7,20 @@ const std::string DEFAULT_SERVER_IP = "127.0.0.1";
 const unsigned int DEFAULT_SERVER_PORT = 8395;
 
 const unsigned int MAX_ADDRESS_SIZE = 34;
+
+//agent key types, chosen by the agent in its HandshakePacket
+const unsigned char KEYTYPE_RSA = 0;
+const unsigned char KEYTYPE_ED25519 = 1;
+
 const unsigned int DERENCODED_PUBKEY_SIZE = 420;
 const unsigned int MAX_SIG_SIZE = 384;
+const unsigned int ED25519_PUBKEY_SIZE = 32;
+const unsigned int ED25519_SIG_SIZE = 64;
+
+//session mode: x25519 ephemeral keys, and the HMAC-SHA256 key and tag derived from them
+const unsigned int SESSION_PUBKEY_SIZE = 32;
+const unsigned int SESSION_KEY_SIZE = 32;
+const unsigned int SESSION_MAC_SIZE = 32;
 
 const unsigned int AGENT_KEYSIZE = 3072;
 const unsigned char AGENT_ADDRESS_VERSION_BYTE = 61;
@@ -2,38 +2,41 @@
 
 namespace networking {
 
-NetvendPacket::NetvendPacket(unsigned char typeChar) 
-: typeChar_(typeChar)
+NetvendPacket::NetvendPacket(unsigned char typeChar, unsigned long requestID) 
+: typeChar_(typeChar), requestID_(requestID)
 {
 }
 
 NetvendPacket* NetvendPacket::readFromSocket(boost::asio::ip::tcp::socket& socket) {
-    unsigned char buf[1];
-    readToBufOrThrow(socket, buf, 1);
+    unsigned char buf[PACKET_HEADER_SIZE];
+    readToBufOrThrow(socket, buf, PACKET_HEADER_SIZE);
     
     unsigned char typeChar;
-    unpack(buf, "c", &typeChar);
+    unsigned long requestID;
+    unpack(buf, "cL", &typeChar, &requestID);
     
     if (typeChar == PACKETTYPECHAR_HANDSHAKE) {
-        return HandshakePacket::readFromSocket(socket);
+        return HandshakePacket::readFromSocket(requestID, socket);
     }
     else if (typeChar == PACKETTYPECHAR_COMMANDBATCH) {
-        return CommandBatchPacket::readFromSocket(socket);
+        return CommandBatchPacket::readFromSocket(requestID, socket);
     }
     return NULL;
 }
 
 void NetvendPacket::writeToSocket(boost::asio::ip::tcp::socket& socket) {
-    unsigned char buf[1];
-    pack(buf, "c", typeChar_);
+    unsigned char buf[PACKET_HEADER_SIZE];
+    pack(buf, "cL", typeChar_, requestID_);
     
-    writeBufOrThrow(socket, buf, 1);
+    writeBufOrThrow(socket, buf, PACKET_HEADER_SIZE);
     
     writeDataToSocket(socket);//calls child's function to write more data
 }
 
 unsigned char NetvendPacket::typeChar() {return typeChar_;}
 
+unsigned long NetvendPacket::requestID() {return requestID_;}
+
 void NetvendPacket::writeDataToSocket(boost::asio::ip::tcp::socket& socket) {}
 
 
@@ -42,71 +45,104 @@ void NetvendPacket::writeDataToSocket(boost::asio::ip::tcp::socket& socket) {}
 
 //HandshakePacket
 
-HandshakePacket::HandshakePacket(CryptoPP::RSA::PublicKey pubkey)
-: NetvendPacket(PACKETTYPECHAR_HANDSHAKE), pubkey_(pubkey)
+HandshakePacket::HandshakePacket(unsigned long requestID, crypto::AgentPubkey pubkey)
+: NetvendPacket(PACKETTYPECHAR_HANDSHAKE, requestID), pubkey_(pubkey)
 {}
 
-HandshakePacket* HandshakePacket::readFromSocket(boost::asio::ip::tcp::socket& socket) {
-    unsigned char buf[DERENCODED_PUBKEY_SIZE];
-    networking::readToBufOrThrow(socket, buf, DERENCODED_PUBKEY_SIZE);
+HandshakePacket* HandshakePacket::readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket) {
+    std::vector<unsigned char> buf(HANDSHAKE_PACKET_HEADER_SIZE);
+    networking::readToVchOrThrow(socket, &buf);
     
-    CryptoPP::ByteQueue bq;
-    bq.Put(buf, DERENCODED_PUBKEY_SIZE);
-    bq.MessageEnd();
+    size_t bodySize = bodySizeFromHeader(buf.data());
+    buf.resize(HANDSHAKE_PACKET_HEADER_SIZE + bodySize);
+    networking::readToBufOrThrow(socket, buf.data() + HANDSHAKE_PACKET_HEADER_SIZE, bodySize);
     
-    CryptoPP::RSA::PublicKey pubkey;
-    pubkey.Load(bq);
+    unsigned char* ptr = buf.data();
+    return consumeFromBuf(requestID, &ptr);
+}
+
+size_t HandshakePacket::bodySizeFromHeader(unsigned char *headerBuf) {
+    unsigned char keyType;
+    unpack(headerBuf, "C", &keyType);
     
-    return new HandshakePacket(pubkey);
+    return crypto::pubkeySizeForKeyType(keyType);
+}
+
+HandshakePacket* HandshakePacket::consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr) {
+    unsigned char keyType;
+    *ptrPtr += unpack(*ptrPtr, "C", &keyType);
+    
+    size_t pubkeySize = crypto::pubkeySizeForKeyType(keyType);
+    std::vector<unsigned char> encodedPubkey(*ptrPtr, *ptrPtr + pubkeySize);
+    *ptrPtr += pubkeySize;
+    
+    return new HandshakePacket(requestID, crypto::AgentPubkey(keyType, encodedPubkey));
 }
 
 void HandshakePacket::writeDataToSocket(boost::asio::ip::tcp::socket& socket) {
-    //get the pubkey into a bytequeue
-    CryptoPP::ByteQueue bq;
-    pubkey_.DEREncode(bq);
-    size_t pubkeySize = bq.CurrentSize();
-    assert(pubkeySize == DERENCODED_PUBKEY_SIZE);
+    unsigned char ktbuf[HANDSHAKE_PACKET_HEADER_SIZE];
+    pack(ktbuf, "C", pubkey_.keyType());
     
-    //copy to command vch
-    std::vector<unsigned char> vch(pubkeySize);
-    bq.Get(vch.data(), pubkeySize);
+    std::vector<unsigned char> encodedPubkey = pubkey_.encoded();
+    assert(encodedPubkey.size() == crypto::pubkeySizeForKeyType(pubkey_.keyType()));
     
     //write data to socket
-    networking::writeVchOrThrow(socket, vch);
+    networking::writeBufOrThrow(socket, ktbuf, HANDSHAKE_PACKET_HEADER_SIZE);
+    networking::writeVchOrThrow(socket, encodedPubkey);
 }
 
-CryptoPP::RSA::PublicKey HandshakePacket::pubkey() {return pubkey_;}
+crypto::AgentPubkey HandshakePacket::pubkey() {return pubkey_;}
 
-CommandBatchPacket::CommandBatchPacket(std::string agentAddress, boost::shared_ptr<std::vector<unsigned char> > commandBatchData, std::vector<unsigned char> &sig)
-: NetvendPacket(PACKETTYPECHAR_COMMANDBATCH), agentAddress_(agentAddress), commandBatchData_(commandBatchData), sig_(sig)
+CommandBatchPacket::CommandBatchPacket(unsigned long requestID, std::string agentAddress, unsigned char keyType, boost::shared_ptr<std::vector<unsigned char> > commandBatchData, std::vector<unsigned char> &sig)
+: NetvendPacket(PACKETTYPECHAR_COMMANDBATCH, requestID), agentAddress_(agentAddress), keyType_(keyType), commandBatchData_(commandBatchData), sig_(sig)
 {
     assert(commandBatchData_->size() < 65535);
 }
 
-CommandBatchPacket* CommandBatchPacket::readFromSocket(boost::asio::ip::tcp::socket& socket) {
+CommandBatchPacket* CommandBatchPacket::readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket) {
+    std::vector<unsigned char> buf(COMMANDBATCH_PACKET_HEADER_SIZE);
+    networking::readToVchOrThrow(socket, &buf);
+    
+    size_t bodySize = bodySizeFromHeader(buf.data());
+    buf.resize(COMMANDBATCH_PACKET_HEADER_SIZE + bodySize);
+    networking::readToBufOrThrow(socket, buf.data() + COMMANDBATCH_PACKET_HEADER_SIZE, bodySize);
+    
+    unsigned char* ptr = buf.data();
+    return consumeFromBuf(requestID, &ptr);
+}
+
+size_t CommandBatchPacket::bodySizeFromHeader(unsigned char *headerBuf) {
+    unsigned char keyType;
+    unsigned short commandBatchSize;
+    int n = unpack(headerBuf + MAX_ADDRESS_SIZE, "CH", &keyType, &commandBatchSize);
+    assert(n==3);
+    
+    return commandBatchSize + crypto::sigSizeForKeyType(keyType);
+}
+
+CommandBatchPacket* CommandBatchPacket::consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr) {
     //leave an extra byte so even a full address is followed by a \0.
     //this allows the string(buf) constructor later to get the right size
     unsigned char addrbuf[MAX_ADDRESS_SIZE+1];
     memset(addrbuf, '\0', MAX_ADDRESS_SIZE+1);
     
-    networking::readToBufOrThrow(socket, addrbuf, MAX_ADDRESS_SIZE);
+    std::copy_n(*ptrPtr, MAX_ADDRESS_SIZE, addrbuf);
+    *ptrPtr += MAX_ADDRESS_SIZE;
     
     std::string agentAddress((char*)addrbuf);
     
-    unsigned char cbsbuf[2];
-    networking::readToBufOrThrow(socket, cbsbuf, 2);
-    
+    unsigned char keyType;
     unsigned short commandBatchSize;
-    int n = unpack(cbsbuf, "H", &commandBatchSize);
-    assert(n==2);
+    *ptrPtr += unpack(*ptrPtr, "CH", &keyType, &commandBatchSize);
     
-    boost::shared_ptr<std::vector<unsigned char> > cbData(new std::vector<unsigned char>(commandBatchSize));
-    networking::readToVchOrThrow(socket, cbData.get());
+    boost::shared_ptr<std::vector<unsigned char> > cbData(new std::vector<unsigned char>(*ptrPtr, *ptrPtr + commandBatchSize));
+    *ptrPtr += commandBatchSize;
     
-    std::vector<unsigned char> sig(MAX_SIG_SIZE);
-    networking::readToVchOrThrow(socket, &sig);
+    size_t sigSize = crypto::sigSizeForKeyType(keyType);
+    std::vector<unsigned char> sig(*ptrPtr, *ptrPtr + sigSize);
+    *ptrPtr += sigSize;
     
-    return new CommandBatchPacket(agentAddress, cbData, sig);
+    return new CommandBatchPacket(requestID, agentAddress, keyType, cbData, sig);
 }
 
 void CommandBatchPacket::writeDataToSocket(boost::asio::ip::tcp::socket& socket) {
@@ -115,18 +151,18 @@ void CommandBatchPacket::writeDataToSocket(boost::asio::ip::tcp::socket& socket)
     assert(commandBatchData_->size() > 0 && commandBatchData_->size() <= 65535);
     unsigned short cbDataSize = commandBatchData_->size();
     
-    assert(sig_.size() == MAX_SIG_SIZE);
+    assert(sig_.size() == crypto::sigSizeForKeyType(keyType_));
     
     unsigned char addrbuf[MAX_ADDRESS_SIZE];
     memset(addrbuf, '\0', MAX_ADDRESS_SIZE);
     agentAddress_.copy((char*)addrbuf, agentAddress_.size());
     
-    unsigned char cbsbuf[2];
-    int n = pack(cbsbuf, "H", cbDataSize);
-    assert(n==2);
+    unsigned char ktcbsbuf[PACK_C_SIZE + PACK_H_SIZE];
+    int n = pack(ktcbsbuf, "CH", keyType_, cbDataSize);
+    assert(n==3);
     
     networking::writeBufOrThrow(socket, addrbuf, MAX_ADDRESS_SIZE);
-    networking::writeBufOrThrow(socket, cbsbuf, 2);
+    networking::writeBufOrThrow(socket, ktcbsbuf, PACK_C_SIZE + PACK_H_SIZE);
     networking::writeVchOrThrow(socket, *commandBatchData_);
     networking::writeVchOrThrow(socket, sig_);
 }
@@ -135,6 +171,10 @@ std::string CommandBatchPacket::agentAddress() {
     return agentAddress_;
 }
 
+unsigned char CommandBatchPacket::keyType() {
+    return keyType_;
+}
+
 boost::shared_ptr<std::vector<unsigned char> > CommandBatchPacket::commandBatchData() {
     return commandBatchData_;
 }
@@ -143,4 +183,238 @@ std::vector<unsigned char> CommandBatchPacket::sig() {
     return sig_;
 }
 
+//AggregateCommandBatch
+
+AggregateCommandBatchPacket::AggregateCommandBatchPacket(unsigned long requestID, std::string agentAddress, unsigned char keyType, const std::vector<boost::shared_ptr<std::vector<unsigned char> > > &commandBatchesData, std::vector<unsigned char> &sig)
+: NetvendPacket(PACKETTYPECHAR_AGGREGATECOMMANDBATCH, requestID), agentAddress_(agentAddress), keyType_(keyType), commandBatchesData_(commandBatchesData), sig_(sig)
+{
+    assert(commandBatchesData_.size() > 0 && commandBatchesData_.size() <= 65535);
+}
+
+unsigned short AggregateCommandBatchPacket::numBatchesFromHeader(unsigned char *headerBuf) {
+    unsigned short numBatches;
+    unpack(headerBuf + MAX_ADDRESS_SIZE + PACK_C_SIZE, "H", &numBatches);
+    
+    return numBatches;
+}
+
+size_t AggregateCommandBatchPacket::bodySizeFromHeader(unsigned char *headerBuf) {
+    unsigned char keyType;
+    unsigned short numBatches;
+    unsigned long batchesSize;
+    unpack(headerBuf + MAX_ADDRESS_SIZE, "CHL", &keyType, &numBatches, &batchesSize);
+    
+    return batchesSize + crypto::sigSizeForKeyType(keyType);
+}
+
+AggregateCommandBatchPacket* AggregateCommandBatchPacket::consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr) {
+    //see CommandBatchPacket::consumeFromBuf
+    unsigned char addrbuf[MAX_ADDRESS_SIZE+1];
+    memset(addrbuf, '\0', MAX_ADDRESS_SIZE+1);
+    
+    std::copy_n(*ptrPtr, MAX_ADDRESS_SIZE, addrbuf);
+    *ptrPtr += MAX_ADDRESS_SIZE;
+    
+    std::string agentAddress((char*)addrbuf);
+    
+    unsigned char keyType;
+    unsigned short numBatches;
+    unsigned long batchesSize;
+    *ptrPtr += unpack(*ptrPtr, "CHL", &keyType, &numBatches, &batchesSize);
+    
+    //each batch is prefixed with its size; together they fill batchesSize exactly
+    unsigned char* batchesEnd = *ptrPtr + batchesSize;
+    std::vector<boost::shared_ptr<std::vector<unsigned char> > > cbDatas;
+    for (unsigned int i=0; i<numBatches; i++) {
+        if (*ptrPtr + PACK_H_SIZE > batchesEnd) throw NetvendDecodeException("AggregateCommandBatch batches overrun their stated size.");
+        
+        unsigned short commandBatchSize;
+        *ptrPtr += unpack(*ptrPtr, "H", &commandBatchSize);
+        
+        if (*ptrPtr + commandBatchSize > batchesEnd) throw NetvendDecodeException("AggregateCommandBatch batches overrun their stated size.");
+        
+        cbDatas.push_back(boost::shared_ptr<std::vector<unsigned char> >(new std::vector<unsigned char>(*ptrPtr, *ptrPtr + commandBatchSize)));
+        *ptrPtr += commandBatchSize;
+    }
+    if (*ptrPtr != batchesEnd) throw NetvendDecodeException("AggregateCommandBatch batches don't fill their stated size.");
+    
+    size_t sigSize = crypto::sigSizeForKeyType(keyType);
+    std::vector<unsigned char> sig(*ptrPtr, *ptrPtr + sigSize);
+    *ptrPtr += sigSize;
+    
+    return new AggregateCommandBatchPacket(requestID, agentAddress, keyType, cbDatas, sig);
+}
+
+void AggregateCommandBatchPacket::writeDataToSocket(boost::asio::ip::tcp::socket& socket) {
+    assert(agentAddress_.size() > 0 && agentAddress_.size() <= MAX_ADDRESS_SIZE);
+    assert(sig_.size() == crypto::sigSizeForKeyType(keyType_));
+    
+    std::vector<unsigned char> batchesVch;
+    for (unsigned int i=0; i<commandBatchesData_.size(); i++) {
+        assert(commandBatchesData_[i]->size() > 0 && commandBatchesData_[i]->size() <= 65535);
+        
+        unsigned int place = batchesVch.size();
+        batchesVch.resize(place + PACK_H_SIZE);
+        pack(batchesVch.data() + place, "H", (unsigned short)commandBatchesData_[i]->size());
+        batchesVch.insert(batchesVch.end(), commandBatchesData_[i]->begin(), commandBatchesData_[i]->end());
+    }
+    
+    unsigned char addrbuf[MAX_ADDRESS_SIZE];
+    memset(addrbuf, '\0', MAX_ADDRESS_SIZE);
+    agentAddress_.copy((char*)addrbuf, agentAddress_.size());
+    
+    unsigned char ktnbsbuf[PACK_C_SIZE + PACK_H_SIZE + PACK_L_SIZE];
+    int n = pack(ktnbsbuf, "CHL", keyType_, (unsigned short)commandBatchesData_.size(), (unsigned long)batchesVch.size());
+    assert(n == PACK_C_SIZE + PACK_H_SIZE + PACK_L_SIZE);
+    
+    networking::writeBufOrThrow(socket, addrbuf, MAX_ADDRESS_SIZE);
+    networking::writeBufOrThrow(socket, ktnbsbuf, PACK_C_SIZE + PACK_H_SIZE + PACK_L_SIZE);
+    networking::writeVchOrThrow(socket, batchesVch);
+    networking::writeVchOrThrow(socket, sig_);
+}
+
+std::string AggregateCommandBatchPacket::agentAddress() {
+    return agentAddress_;
+}
+
+unsigned char AggregateCommandBatchPacket::keyType() {
+    return keyType_;
+}
+
+std::vector<boost::shared_ptr<std::vector<unsigned char> > > AggregateCommandBatchPacket::commandBatchesData() {
+    return commandBatchesData_;
+}
+
+std::vector<unsigned char> AggregateCommandBatchPacket::sig() {
+    return sig_;
+}
+
+//StartSession
+
+StartSessionPacket::StartSessionPacket(unsigned long requestID, std::string agentAddress, unsigned char keyType, const std::vector<unsigned char> &sessionPubkey, const std::vector<unsigned char> &sig)
+: NetvendPacket(PACKETTYPECHAR_STARTSESSION, requestID), agentAddress_(agentAddress), keyType_(keyType), sessionPubkey_(sessionPubkey), sig_(sig)
+{
+    assert(sessionPubkey_.size() == SESSION_PUBKEY_SIZE);
+}
+
+size_t StartSessionPacket::bodySizeFromHeader(unsigned char *headerBuf) {
+    unsigned char keyType;
+    unpack(headerBuf + MAX_ADDRESS_SIZE, "C", &keyType);
+    
+    return SESSION_PUBKEY_SIZE + crypto::sigSizeForKeyType(keyType);
+}
+
+StartSessionPacket* StartSessionPacket::consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr) {
+    //see CommandBatchPacket::consumeFromBuf
+    unsigned char addrbuf[MAX_ADDRESS_SIZE+1];
+    memset(addrbuf, '\0', MAX_ADDRESS_SIZE+1);
+    
+    std::copy_n(*ptrPtr, MAX_ADDRESS_SIZE, addrbuf);
+    *ptrPtr += MAX_ADDRESS_SIZE;
+    
+    std::string agentAddress((char*)addrbuf);
+    
+    unsigned char keyType;
+    *ptrPtr += unpack(*ptrPtr, "C", &keyType);
+    
+    std::vector<unsigned char> sessionPubkey(*ptrPtr, *ptrPtr + SESSION_PUBKEY_SIZE);
+    *ptrPtr += SESSION_PUBKEY_SIZE;
+    
+    size_t sigSize = crypto::sigSizeForKeyType(keyType);
+    std::vector<unsigned char> sig(*ptrPtr, *ptrPtr + sigSize);
+    *ptrPtr += sigSize;
+    
+    return new StartSessionPacket(requestID, agentAddress, keyType, sessionPubkey, sig);
+}
+
+void StartSessionPacket::writeDataToSocket(boost::asio::ip::tcp::socket& socket) {
+    assert(agentAddress_.size() > 0 && agentAddress_.size() <= MAX_ADDRESS_SIZE);
+    assert(sig_.size() == crypto::sigSizeForKeyType(keyType_));
+    
+    unsigned char addrbuf[MAX_ADDRESS_SIZE];
+    memset(addrbuf, '\0', MAX_ADDRESS_SIZE);
+    agentAddress_.copy((char*)addrbuf, agentAddress_.size());
+    
+    unsigned char ktbuf[PACK_C_SIZE];
+    pack(ktbuf, "C", keyType_);
+    
+    networking::writeBufOrThrow(socket, addrbuf, MAX_ADDRESS_SIZE);
+    networking::writeBufOrThrow(socket, ktbuf, PACK_C_SIZE);
+    networking::writeVchOrThrow(socket, sessionPubkey_);
+    networking::writeVchOrThrow(socket, sig_);
+}
+
+std::string StartSessionPacket::agentAddress() {
+    return agentAddress_;
+}
+
+unsigned char StartSessionPacket::keyType() {
+    return keyType_;
+}
+
+std::vector<unsigned char> StartSessionPacket::sessionPubkey() {
+    return sessionPubkey_;
+}
+
+std::vector<unsigned char> StartSessionPacket::sig() {
+    return sig_;
+}
+
+//SessionCommandBatch
+
+SessionCommandBatchPacket::SessionCommandBatchPacket(unsigned long requestID, unsigned long long seq, boost::shared_ptr<std::vector<unsigned char> > commandBatchData, const std::vector<unsigned char> &mac)
+: NetvendPacket(PACKETTYPECHAR_SESSIONCOMMANDBATCH, requestID), seq_(seq), commandBatchData_(commandBatchData), mac_(mac)
+{
+    assert(commandBatchData_->size() < 65535);
+}
+
+size_t SessionCommandBatchPacket::bodySizeFromHeader(unsigned char *headerBuf) {
+    unsigned long long seq;
+    unsigned short commandBatchSize;
+    unpack(headerBuf, "QH", &seq, &commandBatchSize);
+    
+    return commandBatchSize + SESSION_MAC_SIZE;
+}
+
+SessionCommandBatchPacket* SessionCommandBatchPacket::consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr) {
+    unsigned long long seq;
+    unsigned short commandBatchSize;
+    *ptrPtr += unpack(*ptrPtr, "QH", &seq, &commandBatchSize);
+    
+    boost::shared_ptr<std::vector<unsigned char> > cbData(new std::vector<unsigned char>(*ptrPtr, *ptrPtr + commandBatchSize));
+    *ptrPtr += commandBatchSize;
+    
+    std::vector<unsigned char> mac(*ptrPtr, *ptrPtr + SESSION_MAC_SIZE);
+    *ptrPtr += SESSION_MAC_SIZE;
+    
+    return new SessionCommandBatchPacket(requestID, seq, cbData, mac);
+}
+
+void SessionCommandBatchPacket::writeDataToSocket(boost::asio::ip::tcp::socket& socket) {
+    assert(commandBatchData_->size() > 0 && commandBatchData_->size() <= 65535);
+    unsigned short cbDataSize = commandBatchData_->size();
+    
+    assert(mac_.size() == SESSION_MAC_SIZE);
+    
+    unsigned char headerbuf[SESSIONCOMMANDBATCH_PACKET_HEADER_SIZE];
+    int n = pack(headerbuf, "QH", seq_, cbDataSize);
+    assert(n == SESSIONCOMMANDBATCH_PACKET_HEADER_SIZE);
+    
+    networking::writeBufOrThrow(socket, headerbuf, SESSIONCOMMANDBATCH_PACKET_HEADER_SIZE);
+    networking::writeVchOrThrow(socket, *commandBatchData_);
+    networking::writeVchOrThrow(socket, mac_);
+}
+
+unsigned long long SessionCommandBatchPacket::seq() {
+    return seq_;
+}
+
+boost::shared_ptr<std::vector<unsigned char> > SessionCommandBatchPacket::commandBatchData() {
+    return commandBatchData_;
+}
+
+std::vector<unsigned char> SessionCommandBatchPacket::mac() {
+    return mac_;
+}
+
 }//namespace networking
\ No newline at end of file
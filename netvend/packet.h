@@ -2,47 +2,128 @@
 #define NETVEND_NV_PACKET_H
 
 #include <string>
-#include <cryptopp/rsa.h>
 
 #include "util/pack.h"
 #include "util/networking.h"
+#include "util/crypto.h"
 #include "netvend/common_constants.h"
 
 namespace networking {
 
 const char PACKETTYPECHAR_HANDSHAKE = 'H';
 const char PACKETTYPECHAR_COMMANDBATCH = 'C';
+const char PACKETTYPECHAR_STARTSESSION = 'S';
+const char PACKETTYPECHAR_SESSIONCOMMANDBATCH = 'B';
+const char PACKETTYPECHAR_AGGREGATECOMMANDBATCH = 'A';
+
+//every packet starts with its typechar and a client-chosen request ID,
+//which the server echoes at the start of the matching response.
+const unsigned int PACKET_HEADER_SIZE = PACK_C_SIZE + PACK_L_SIZE;
+//the rest of each packet is a fixed-size header, then a body whose size the header gives.
+const unsigned int HANDSHAKE_PACKET_HEADER_SIZE = PACK_C_SIZE;
+const unsigned int COMMANDBATCH_PACKET_HEADER_SIZE = MAX_ADDRESS_SIZE + PACK_C_SIZE + PACK_H_SIZE;
+const unsigned int STARTSESSION_PACKET_HEADER_SIZE = MAX_ADDRESS_SIZE + PACK_C_SIZE;
+const unsigned int SESSIONCOMMANDBATCH_PACKET_HEADER_SIZE = PACK_Q_SIZE + PACK_H_SIZE;
+const unsigned int AGGREGATECOMMANDBATCH_PACKET_HEADER_SIZE = MAX_ADDRESS_SIZE + PACK_C_SIZE + PACK_H_SIZE + PACK_L_SIZE;
 
 class NetvendPacket {
     unsigned char typeChar_;
+    unsigned long requestID_;
 public:
-    NetvendPacket(unsigned char typeChar);
+    NetvendPacket(unsigned char typeChar, unsigned long requestID);
     static NetvendPacket* readFromSocket(boost::asio::ip::tcp::socket& socket);
     void writeToSocket(boost::asio::ip::tcp::socket& socket);
     unsigned char typeChar();
+    unsigned long requestID();
 protected:
     virtual void writeDataToSocket(boost::asio::ip::tcp::socket& socket);
 };
 
 class HandshakePacket : public NetvendPacket {
-    CryptoPP::RSA::PublicKey pubkey_;
+    crypto::AgentPubkey pubkey_;
 public:
-    HandshakePacket(CryptoPP::RSA::PublicKey pubkey);
-    static HandshakePacket* readFromSocket(boost::asio::ip::tcp::socket& socket);
-    CryptoPP::RSA::PublicKey pubkey();
+    HandshakePacket(unsigned long requestID, crypto::AgentPubkey pubkey);
+    static HandshakePacket* readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket);
+    static size_t bodySizeFromHeader(unsigned char *headerBuf);
+    static HandshakePacket* consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr);
+    crypto::AgentPubkey pubkey();
 protected:
     void writeDataToSocket(boost::asio::ip::tcp::socket& socket);
 };
 
 class CommandBatchPacket : public NetvendPacket {//remember to check size
 std::string agentAddress_;
+unsigned char keyType_;
 boost::shared_ptr<std::vector<unsigned char> > commandBatchData_;
 std::vector<unsigned char> sig_;
 public:
-    CommandBatchPacket(std::string agentAddress, boost::shared_ptr<std::vector<unsigned char> > commandBatchData, std::vector<unsigned char> &sig);
-    static CommandBatchPacket* readFromSocket(boost::asio::ip::tcp::socket& socket);
+    CommandBatchPacket(unsigned long requestID, std::string agentAddress, unsigned char keyType, boost::shared_ptr<std::vector<unsigned char> > commandBatchData, std::vector<unsigned char> &sig);
+    static CommandBatchPacket* readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket);
+    static size_t bodySizeFromHeader(unsigned char *headerBuf);
+    static CommandBatchPacket* consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr);
     std::string agentAddress();
+    unsigned char keyType();
+    boost::shared_ptr<std::vector<unsigned char> > commandBatchData();
+    std::vector<unsigned char> sig();
+protected:
+    void writeDataToSocket(boost::asio::ip::tcp::socket& socket);
+};
+
+//Opens a session on this connection: an x25519 ephemeral pubkey, signed
+//with the agent's key. Only one session is open per connection at a time;
+//a new one replaces the old.
+class StartSessionPacket : public NetvendPacket {
+std::string agentAddress_;
+unsigned char keyType_;
+std::vector<unsigned char> sessionPubkey_;
+std::vector<unsigned char> sig_;
+public:
+    StartSessionPacket(unsigned long requestID, std::string agentAddress, unsigned char keyType, const std::vector<unsigned char> &sessionPubkey, const std::vector<unsigned char> &sig);
+    static size_t bodySizeFromHeader(unsigned char *headerBuf);
+    static StartSessionPacket* consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr);
+    std::string agentAddress();
+    unsigned char keyType();
+    std::vector<unsigned char> sessionPubkey();
+    std::vector<unsigned char> sig();
+protected:
+    void writeDataToSocket(boost::asio::ip::tcp::socket& socket);
+};
+
+//A CommandBatch for the connection's session agent, authenticated by an
+//HMAC over the batch and its sequence number instead of a signature.
+//Sequence numbers start at 0 for each session and go up by one per batch.
+class SessionCommandBatchPacket : public NetvendPacket {
+unsigned long long seq_;
+boost::shared_ptr<std::vector<unsigned char> > commandBatchData_;
+std::vector<unsigned char> mac_;
+public:
+    SessionCommandBatchPacket(unsigned long requestID, unsigned long long seq, boost::shared_ptr<std::vector<unsigned char> > commandBatchData, const std::vector<unsigned char> &mac);
+    static size_t bodySizeFromHeader(unsigned char *headerBuf);
+    static SessionCommandBatchPacket* consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr);
+    unsigned long long seq();
     boost::shared_ptr<std::vector<unsigned char> > commandBatchData();
+    std::vector<unsigned char> mac();
+protected:
+    void writeDataToSocket(boost::asio::ip::tcp::socket& socket);
+};
+
+//Several CommandBatches from one agent under a single signature over the
+//Merkle root of their data. Each batch is still executed and answered on
+//its own: batch i is answered as request requestID+i, so the client has
+//to reserve that many request IDs.
+class AggregateCommandBatchPacket : public NetvendPacket {
+std::string agentAddress_;
+unsigned char keyType_;
+std::vector<boost::shared_ptr<std::vector<unsigned char> > > commandBatchesData_;
+std::vector<unsigned char> sig_;
+public:
+    AggregateCommandBatchPacket(unsigned long requestID, std::string agentAddress, unsigned char keyType, const std::vector<boost::shared_ptr<std::vector<unsigned char> > > &commandBatchesData, std::vector<unsigned char> &sig);
+    static unsigned short numBatchesFromHeader(unsigned char *headerBuf);
+    static size_t bodySizeFromHeader(unsigned char *headerBuf);
+    static AggregateCommandBatchPacket* consumeFromBuf(unsigned long requestID, unsigned char **ptrPtr);
+    std::string agentAddress();
+    unsigned char keyType();
+    std::vector<boost::shared_ptr<std::vector<unsigned char> > > commandBatchesData();
     std::vector<unsigned char> sig();
 protected:
     void writeDataToSocket(boost::asio::ip::tcp::socket& socket);
@@ -50,4 +131,4 @@ protected:
 
 }//namespace networking
 
-#endif
\ No newline at end of file
+#endif
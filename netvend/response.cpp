@@ -2,18 +2,28 @@
 
 namespace networking {
 
-HandshakeResponse::HandshakeResponse(bool isNewAgent, unsigned long defaultPocketID)
-: isNewAgent_(isNewAgent), defaultPocketID_(defaultPocketID)
+unsigned long readResponseRequestID(boost::asio::ip::tcp::socket& socket) {
+    unsigned char buf[RESPONSE_HEADER_SIZE];
+    networking::readToBufOrThrow(socket, buf, RESPONSE_HEADER_SIZE);
+    
+    unsigned long requestID;
+    unpack(buf, "L", &requestID);
+    
+    return requestID;
+}
+
+HandshakeResponse::HandshakeResponse(unsigned long requestID, bool isNewAgent, unsigned long defaultPocketID)
+: requestID_(requestID), isNewAgent_(isNewAgent), defaultPocketID_(defaultPocketID)
 {}
 
-HandshakeResponse::HandshakeResponse(bool isNewAgent)
-: isNewAgent_(isNewAgent)
+HandshakeResponse::HandshakeResponse(unsigned long requestID, bool isNewAgent)
+: requestID_(requestID), isNewAgent_(isNewAgent)
 {
     assert(!isNewAgent);//if new agent, should specify defaultPocketID.
     defaultPocketID_ = 0;
 }
 
-HandshakeResponse* HandshakeResponse::readFromSocket(boost::asio::ip::tcp::socket& socket) {
+HandshakeResponse* HandshakeResponse::readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket) {
     static const int BUFSIZE = PACK_C_SIZE + PACK_L_SIZE;
     unsigned char buf[BUFSIZE];
     
@@ -27,21 +37,32 @@ HandshakeResponse* HandshakeResponse::readFromSocket(boost::asio::ip::tcp::socke
     place += unpack(buf+place, "L", &defaultPocketID);
     assert(place == BUFSIZE);
     
-    return new HandshakeResponse((bool)isNewAgentChar, defaultPocketID);
+    return new HandshakeResponse(requestID, (bool)isNewAgentChar, defaultPocketID);
 }
 
-void HandshakeResponse::writeToSocket(boost::asio::ip::tcp::socket& socket) {
-    static const int BUFSIZE = PACK_C_SIZE + PACK_L_SIZE;
-    unsigned char buf[BUFSIZE];
+void HandshakeResponse::writeToVch(std::vector<unsigned char>* vch) {
+    static const size_t DATA_SIZE = RESPONSE_HEADER_SIZE + PACK_C_SIZE + PACK_L_SIZE;
     
     unsigned char isNewAgentChar = (unsigned char)isNewAgent_;
     
-    int place = 0;
-    place += pack(buf+place, "C", isNewAgentChar);
-    place += pack(buf+place, "L", defaultPocketID_);
-    assert(place == BUFSIZE);
+    unsigned int place = vch->size();
     
-    networking::writeBufOrThrow(socket, buf, BUFSIZE);
+    vch->resize(place + DATA_SIZE);
+    place += pack(vch->data()+place, "L", requestID_);
+    place += pack(vch->data()+place, "C", isNewAgentChar);
+    place += pack(vch->data()+place, "L", defaultPocketID_);
+    assert(place == vch->size());
+}
+
+void HandshakeResponse::writeToSocket(boost::asio::ip::tcp::socket& socket) {
+    std::vector<unsigned char> vch;
+    writeToVch(&vch);
+    
+    networking::writeVchOrThrow(socket, vch);
+}
+
+unsigned long HandshakeResponse::requestID() {
+    return requestID_;
 }
 
 bool HandshakeResponse::isNewAgent() {
@@ -52,27 +73,86 @@ unsigned long HandshakeResponse::defaultPocketID() {
     return defaultPocketID_;
 }
 
-CommandBatchResponse::CommandBatchResponse(boost::shared_ptr<commands::results::Batch> commandResultBatch, unsigned char completion)
-: commandResultBatch_(commandResultBatch), completion_(completion)
-{}
+StartSessionResponse::StartSessionResponse(unsigned long requestID, const std::vector<unsigned char> &sessionPubkey)
+: requestID_(requestID), sessionPubkey_(sessionPubkey)
+{
+    assert(sessionPubkey_.size() == SESSION_PUBKEY_SIZE);
+}
 
-void CommandBatchResponse::writeToSocket(boost::asio::ip::tcp::socket& socket) {
-    unsigned char completionbuf[1];
-    pack(completionbuf, "C", completion_);
+StartSessionResponse* StartSessionResponse::readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket) {
+    std::vector<unsigned char> sessionPubkey(SESSION_PUBKEY_SIZE);
+    networking::readToVchOrThrow(socket, &sessionPubkey);
     
-    std::vector<unsigned char> dataVch;
-    commandResultBatch_->writeToVch(&dataVch);
+    return new StartSessionResponse(requestID, sessionPubkey);
+}
+
+void StartSessionResponse::writeToVch(std::vector<unsigned char>* vch) {
+    unsigned int place = vch->size();
+    
+    vch->resize(place + RESPONSE_HEADER_SIZE + SESSION_PUBKEY_SIZE);
+    place += pack(vch->data()+place, "L", requestID_);
+    std::copy(sessionPubkey_.begin(), sessionPubkey_.end(), vch->begin()+place);
+    place += SESSION_PUBKEY_SIZE;
+    assert(place == vch->size());
+}
+
+void StartSessionResponse::writeToSocket(boost::asio::ip::tcp::socket& socket) {
+    std::vector<unsigned char> vch;
+    writeToVch(&vch);
     
-    unsigned short dataVchSize = dataVch.size();
-    unsigned char dvsbuf[2];
-    pack(dvsbuf, "H", dataVchSize);
+    networking::writeVchOrThrow(socket, vch);
+}
+
+unsigned long StartSessionResponse::requestID() {
+    return requestID_;
+}
+
+std::vector<unsigned char> StartSessionResponse::sessionPubkey() {
+    return sessionPubkey_;
+}
+
+CommandBatchResponse::CommandBatchResponse(unsigned long requestID, boost::shared_ptr<commands::results::Batch> commandResultBatch, unsigned char completion)
+: requestID_(requestID), commandResultBatch_(commandResultBatch), completion_(completion)
+{}
+
+void CommandBatchResponse::writeToVch(std::vector<unsigned char>* vch) {
+    writeToVch(vch, NULL);
+}
+
+void CommandBatchResponse::writeToVch(std::vector<unsigned char>* vch, std::vector<commands::results::Splice>* splices) {
+    static const size_t HEADER_SIZE = RESPONSE_HEADER_SIZE + PACK_C_SIZE + PACK_H_SIZE;
+    
+    unsigned int headerPlace = vch->size();
+    size_t firstSplice = splices == NULL ? 0 : splices->size();
+    
+    //write the result batch after room for the header, then fill the header in
+    //once we know how big the result batch turned out.
+    vch->resize(headerPlace + HEADER_SIZE);
+    commandResultBatch_->writeToVch(vch, splices);
+    
+    size_t splicedSize = 0;
+    for (size_t i = firstSplice; splices != NULL && i < splices->size(); i++) {
+        splicedSize += (*splices)[i].span.length;
+    }
+    
+    assert(vch->size() + splicedSize - headerPlace - HEADER_SIZE <= 65535);
+    unsigned short dataVchSize = vch->size() + splicedSize - headerPlace - HEADER_SIZE;
+    
+    unsigned int place = headerPlace;
+    place += pack(vch->data()+place, "L", requestID_);
+    place += pack(vch->data()+place, "C", completion_);
+    place += pack(vch->data()+place, "H", dataVchSize);
+    assert(place == headerPlace + HEADER_SIZE);
+}
+
+void CommandBatchResponse::writeToSocket(boost::asio::ip::tcp::socket& socket) {
+    std::vector<unsigned char> vch;
+    writeToVch(&vch);
     
-    networking::writeBufOrThrow(socket, completionbuf, 1);
-    networking::writeBufOrThrow(socket, dvsbuf, 2);
-    networking::writeVchOrThrow(socket, dataVch);
+    networking::writeVchOrThrow(socket, vch);
 }
 
-CommandBatchResponse* CommandBatchResponse::readFromSocket(boost::asio::ip::tcp::socket& socket, commands::Batch* initiatingCommandBatch) {
+CommandBatchResponse* CommandBatchResponse::readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket, commands::Batch* initiatingCommandBatch) {
     unsigned char completionbuf[1];
     unsigned char dvsbuf[2];
     
@@ -92,11 +172,19 @@ CommandBatchResponse* CommandBatchResponse::readFromSocket(boost::asio::ip::tcp:
     unsigned char* ptr = dataVch.data();
     commandResultBatch->consumeFromBuf(&ptr);
     
-    CommandBatchResponse* cbr = new CommandBatchResponse(commandResultBatch, completion);
+    CommandBatchResponse* cbr = new CommandBatchResponse(requestID, commandResultBatch, completion);
     
     return cbr;
 }
 
+unsigned long CommandBatchResponse::requestID() {
+    return requestID_;
+}
+
+unsigned char CommandBatchResponse::completion() {
+    return completion_;
+}
+
 boost::shared_ptr<commands::results::Batch> CommandBatchResponse::commandResultBatch() {
     return commandResultBatch_;
 }
@@ -10,24 +10,53 @@
 
 namespace networking {
 
+//every response starts with the request ID of the packet it answers.
+//responses to pipelined packets may arrive in any order, so clients read
+//this first to find out which request the rest of the response belongs to.
+const unsigned int RESPONSE_HEADER_SIZE = PACK_L_SIZE;
+
+unsigned long readResponseRequestID(boost::asio::ip::tcp::socket& socket);
+
 class HandshakeResponse {
+    unsigned long requestID_;
     bool isNewAgent_;
     unsigned long defaultPocketID_;
 public:
-    HandshakeResponse(bool isNewAgent, unsigned long defaultPocketID);
-    HandshakeResponse(bool isNewAgent);
-    static HandshakeResponse* readFromSocket(boost::asio::ip::tcp::socket& socket);
+    HandshakeResponse(unsigned long requestID, bool isNewAgent, unsigned long defaultPocketID);
+    HandshakeResponse(unsigned long requestID, bool isNewAgent);
+    static HandshakeResponse* readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket);
+    unsigned long requestID();
     bool isNewAgent();
     unsigned long defaultPocketID();
+    void writeToVch(std::vector<unsigned char>* vch);
+    void writeToSocket(boost::asio::ip::tcp::socket& socket);
+};
+
+//the server's half of the session key exchange
+class StartSessionResponse {
+    unsigned long requestID_;
+    std::vector<unsigned char> sessionPubkey_;
+public:
+    StartSessionResponse(unsigned long requestID, const std::vector<unsigned char> &sessionPubkey);
+    static StartSessionResponse* readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket);
+    unsigned long requestID();
+    std::vector<unsigned char> sessionPubkey();
+    void writeToVch(std::vector<unsigned char>* vch);
     void writeToSocket(boost::asio::ip::tcp::socket& socket);
 };
 
 class CommandBatchResponse {
+    unsigned long requestID_;
     boost::shared_ptr<commands::results::Batch> commandResultBatch_;
     unsigned char completion_;
 public:
-    CommandBatchResponse(boost::shared_ptr<commands::results::Batch> commandResultBatch, unsigned char completion);
-    static CommandBatchResponse* readFromSocket(boost::asio::ip::tcp::socket& socket, commands::Batch* initiatingCommandBatch);
+    CommandBatchResponse(unsigned long requestID, boost::shared_ptr<commands::results::Batch> commandResultBatch, unsigned char completion);
+    static CommandBatchResponse* readFromSocket(unsigned long requestID, boost::asio::ip::tcp::socket& socket, commands::Batch* initiatingCommandBatch);
+    unsigned long requestID();
+    unsigned char completion();
+    void writeToVch(std::vector<unsigned char>* vch);
+    //see commands::results::Batch::writeToVch; the header counts the spliced bytes too
+    void writeToVch(std::vector<unsigned char>* vch, std::vector<commands::results::Splice>* splices);
     void writeToSocket(boost::asio::ip::tcp::socket& socket);
     boost::shared_ptr<commands::results::Batch> commandResultBatch();
 };
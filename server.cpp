@@ -9,6 +9,13 @@
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 #include <boost/chrono.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <deque>
+#include <cerrno>
+#include <sys/sendfile.h>
+#include <queue>
+#include <map>
 #include <pqxx/pqxx>
 
 #include "netvend/common_constants.h"
@@ -16,6 +23,10 @@
 #include "util/btc.h"
 #include "util/crypto.h"
 #include "util/networking.h"
+#include "util/verifiercache.h"
+#include "util/connectionpool.h"
+#include "util/asyncdb.h"
+#include "util/filecache.h"
 #include "netvend/commands.h"
 #include "netvend/packet.h"
 #include "netvend/response.h"
@@ -23,60 +34,71 @@
 
 using boost::asio::ip::tcp;
 
-pqxx::connection *dbConn;
+//work that needs the database leases a connection from here for as long as it runs
+database::ConnectionPool* dbPool;
+//read-only batches go here instead, when server.async-db-connections isn't 0
+database::AsyncConnectionPool* asyncDb = NULL;
 boost::property_tree::ptree config;
+crypto::VerifierCache* verifierCache;
+boost::atomic<unsigned long long> sigsVerified(0);
+boost::atomic<unsigned long long> macsVerified(0);
+boost::atomic<unsigned long long> handshakesProcessed(0);
+boost::atomic<unsigned long long> batchCommits(0);
+boost::atomic<unsigned long long> batchesCommitted(0);
+//time spent writing file data, for comparing whole-file updates with partial writes
+boost::atomic<unsigned long long> fileUpdates(0);
+boost::atomic<unsigned long long> fileUpdateBytes(0);
+boost::atomic<unsigned long long> fileUpdateMicros(0);
+boost::atomic<unsigned long long> partialFileWrites(0);
+boost::atomic<unsigned long long> partialFileWriteBytes(0);
+boost::atomic<unsigned long long> partialFileWriteMicros(0);
 
-networking::HandshakeResponse processHandshakePacket(boost::shared_ptr<networking::HandshakePacket> packet) {
-    crypto::RSAPubkey pubkey = packet->pubkey();
+networking::HandshakeResponse processHandshakePacket(pqxx::connection *dbConn, boost::shared_ptr<networking::HandshakePacket> packet) {
+    crypto::AgentPubkey pubkey = packet->pubkey();
     
     //find agentAddress from pubkey
-    std::string agentAddress = crypto::RSAPubkeyToNetvendAddress(pubkey);
+    std::string agentAddress = crypto::agentPubkeyToNetvendAddress(pubkey);
     
-    //do we already have a record for this agent?
-    bool isNewAgent = ! database::agentRowExists(dbConn, agentAddress);
+    //an agent that handshakes is about to send command batches, so have its verifier ready.
+    //building it also makes sure an RSA key decodes before we store it. An address
+    //is the hash of its key, so a verifier we already have is for this same key.
+    if (verifierCache->get(agentAddress).get() == NULL) {
+        verifierCache->put(agentAddress, boost::shared_ptr<const crypto::SigVerifier>(crypto::newVerifier(pubkey)));
+    }
+    
+    unsigned long defaultPocketID;
+    bool isNewAgent = database::registerAgent(dbConn, agentAddress, pubkey, &defaultPocketID);
+    handshakesProcessed++;
     
     if (isNewAgent) {
-        std::cout << "no agent found; inserting." << std::endl;
-        
-        //first create a pocket.
-        unsigned long defaultPocketID = database::insertPocket(dbConn);
-        //std::cout << defaultPocketID << std::endl;
-        
-        //encode the public key
-        std::vector<unsigned char> encodedPubkey = crypto::encodePubkey(pubkey);
+        std::cout << "no agent found; inserted." << std::endl;
         
-        //insert agent row
-        database::insertAgent(dbConn, agentAddress, encodedPubkey, defaultPocketID);
-        
-        //now that the agent row is inserted, update pocket to reflect owner
-        //we had to do this as a second step due to the pocket's foreign_key constraint
-        database::updatePocketOwner(dbConn, defaultPocketID, agentAddress);
-        
-        return networking::HandshakeResponse(true, defaultPocketID);
+        return networking::HandshakeResponse(packet->requestID(), true, defaultPocketID);
     }
     else {
         std::cout << "agent found." << std::endl;
         
-        return networking::HandshakeResponse(false);
+        return networking::HandshakeResponse(packet->requestID(), false);
     }
 }
 
-boost::shared_ptr<commands::results::CreatePocket> processCreatePocketCommand(std::string agentAddress, boost::shared_ptr<commands::CreatePocket> command) {    
-    unsigned int pocketID = database::insertPocket(dbConn, agentAddress);
+boost::shared_ptr<commands::results::CreatePocket> processCreatePocketCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::CreatePocket> command) {    
+    unsigned int pocketID = database::insertPocket(tx, agentAddress);
     
     int cost = 0;
     
     return boost::shared_ptr<commands::results::CreatePocket>(new commands::results::CreatePocket(cost, pocketID));
 }
 
-boost::shared_ptr<commands::results::RequestPocketDepositAddress> processRequestPocketDepositAddressCommand(std::string agentAddress, boost::shared_ptr<commands::RequestPocketDepositAddress> command) {
+boost::shared_ptr<commands::results::RequestPocketDepositAddress> processRequestPocketDepositAddressCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::RequestPocketDepositAddress> command) {
     unsigned long pocketID = command->pocketID();
     
-    database::verifyPocketOwner(dbConn, pocketID, agentAddress);
+    //checked up front rather than by the update, so only a pocket's owner can make us ask bitcoind for an address
+    database::verifyPocketOwner(tx, pocketID, agentAddress);
     
     std::string depositAddress = btc::getNewDepositAddress();
     
-    database::updatePocketDepositAddress(dbConn, agentAddress, pocketID, depositAddress);
+    database::updatePocketDepositAddress(tx, agentAddress, pocketID, depositAddress);
     
     boost::shared_ptr<commands::results::RequestPocketDepositAddress> rpdaResult(
       new commands::results::RequestPocketDepositAddress(0, depositAddress)
@@ -85,12 +107,12 @@ boost::shared_ptr<commands::results::RequestPocketDepositAddress> processRequest
     return rpdaResult;
 }
 
-boost::shared_ptr<commands::results::PocketTransfer> processPocketTransferCommand(std::string agentAddress, boost::shared_ptr<commands::PocketTransfer> command) {
+boost::shared_ptr<commands::results::PocketTransfer> processPocketTransferCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::PocketTransfer> command) {
     unsigned long fromPocketID = command->fromPocketID();
     unsigned long toPocketID = command->toPocketID();
     unsigned long long amount = command->amount();
     
-    database::pocketTransfer(dbConn, agentAddress, fromPocketID, toPocketID, amount);
+    database::pocketTransfer(tx, agentAddress, fromPocketID, toPocketID, amount);
     
     boost::shared_ptr<commands::results::PocketTransfer> ptResult(
       new commands::results::PocketTransfer(0)
@@ -99,14 +121,12 @@ boost::shared_ptr<commands::results::PocketTransfer> processPocketTransferComman
     return ptResult;
 }
 
-boost::shared_ptr<commands::results::CreateFile> processCreateFileCommand(std::string agentAddress, boost::shared_ptr<commands::CreateFile> command) {
+boost::shared_ptr<commands::results::CreateFile> processCreateFileCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::CreateFile> command) {
     unsigned long pocketID = command->pocketID();
     
-    database::verifyPocketOwner(dbConn, pocketID, agentAddress);
-    
     std::string name = command->name();
     
-    unsigned long fileID = database::insertFile(dbConn, agentAddress, name, pocketID);
+    unsigned long fileID = database::insertFile(tx, agentAddress, name, pocketID);
     
     boost::shared_ptr<commands::results::CreateFile> ccResult(
       new commands::results::CreateFile(0, fileID)
@@ -115,15 +135,17 @@ boost::shared_ptr<commands::results::CreateFile> processCreateFileCommand(std::s
     return ccResult;
 }
 
-boost::shared_ptr<commands::results::UpdateFileByID> processUpdateFileByIDCommand(std::string agentAddress, boost::shared_ptr<commands::UpdateFileByID> command) {
+boost::shared_ptr<commands::results::UpdateFileByID> processUpdateFileByIDCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::UpdateFileByID> command) {
     unsigned long fileID = command->fileID();
     
-    database::verifyFileOwner(dbConn, fileID, agentAddress);
-    
     unsigned char* data = command->data();
     unsigned short dataSize = command->dataSize();
     
-    database::updateFileByID(dbConn, fileID, data, dataSize);
+    boost::chrono::steady_clock::time_point writeStart = boost::chrono::steady_clock::now();
+    database::updateFileByID(tx, agentAddress, fileID, data, dataSize);
+    fileUpdateMicros += boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - writeStart).count();
+    fileUpdateBytes += dataSize;
+    fileUpdates++;
     
     boost::shared_ptr<commands::results::UpdateFileByID> ucbiResult(
       new commands::results::UpdateFileByID(0)
@@ -132,26 +154,115 @@ boost::shared_ptr<commands::results::UpdateFileByID> processUpdateFileByIDComman
     return ucbiResult;
 }
 
-boost::shared_ptr<commands::results::ReadFileByID> processReadFileByIDCommand(std::string agentAddress, boost::shared_ptr<commands::ReadFileByID> command) {
+boost::shared_ptr<commands::results::AppendToFile> processAppendToFileCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::AppendToFile> command) {
+    boost::chrono::steady_clock::time_point writeStart = boost::chrono::steady_clock::now();
+    database::appendToFile(tx, agentAddress, command->fileID(), command->data(), command->dataSize());
+    partialFileWriteMicros += boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - writeStart).count();
+    partialFileWriteBytes += command->dataSize();
+    partialFileWrites++;
+    
+    boost::shared_ptr<commands::results::AppendToFile> appendResult(
+      new commands::results::AppendToFile(0)
+    );
+    
+    return appendResult;
+}
+
+boost::shared_ptr<commands::results::WriteFileRange> processWriteFileRangeCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::WriteFileRange> command) {
+    boost::chrono::steady_clock::time_point writeStart = boost::chrono::steady_clock::now();
+    database::writeFileRange(tx, agentAddress, command->fileID(), command->offset(), command->data(), command->dataSize());
+    partialFileWriteMicros += boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - writeStart).count();
+    partialFileWriteBytes += command->dataSize();
+    partialFileWrites++;
+    
+    boost::shared_ptr<commands::results::WriteFileRange> rangeResult(
+      new commands::results::WriteFileRange(0)
+    );
+    
+    return rangeResult;
+}
+
+//the result of a ReadFileByID, whether its data was fetched ahead (see
+//prefetchReadRun()) or not. Spliced data stays where it is until it's sent.
+boost::shared_ptr<commands::results::ReadFileByID> readFileByIDResult(unsigned long fileID, boost::shared_ptr<const database::FileContents> fileData) {
+    if (fileData.get() == NULL) {
+        commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("f:") + boost::lexical_cast<std::string>(fileID), 0, true);
+        throw NetvendCommandException(error);
+    }
+    
+    boost::shared_ptr<commands::results::ReadFileByID> readResult;
+    if (fileData->spliced) {
+        readResult.reset(new commands::results::ReadFileByID(0, fileData->span));
+    }
+    else {
+        //the result keeps fileData alive, and with it the data, which is
+        //shared with the file cache rather than copied
+        boost::shared_ptr<const std::vector<unsigned char> > data(fileData, &fileData->data);
+        readResult.reset(new commands::results::ReadFileByID(0, data));
+    }
+    
+    return readResult;
+}
+
+boost::shared_ptr<commands::results::ReadFileByID> processReadFileByIDCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::ReadFileByID> command, bool fillFileCache) {
     unsigned long fileID = command->fileID();
     
-    std::vector<unsigned char> fileData;
+    boost::shared_ptr<const database::FileContents> fileData;
     try {
-        fileData = database::readFileByID(dbConn, fileID);
+        fileData = database::readFileByID(tx, fileID, fillFileCache);
     }
     catch (database::NoRowFoundException &e) {
         commands::errors::Error* error = new commands::errors::InvalidTargetError(boost::lexical_cast<std::string>(fileID), 0, true);
         throw NetvendCommandException(error);
     }
     
-    boost::shared_ptr<commands::results::ReadFileByID> readResult(
-      new commands::results::ReadFileByID(0, fileData)
-    );
+    return readFileByIDResult(fileID, fileData);
+}
+
+//Only the range's bytes are copied into the response (or, if spliced, sent
+//from the file); the rest of a cached file is left alone.
+boost::shared_ptr<commands::results::ReadFileRange> processReadFileRangeCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::ReadFileRange> command, bool fillFileCache) {
+    database::FileSlice slice = database::readFileRange(tx, command->fileID(), command->offset(), command->length(), fillFileCache);
     
-    return readResult;
+    boost::shared_ptr<commands::results::ReadFileRange> rangeResult;
+    if (slice.contents->spliced) {
+        commands::results::FileSpan span = slice.contents->span;
+        span.offset += slice.offset;
+        span.length = slice.length;
+        rangeResult.reset(new commands::results::ReadFileRange(0, span));
+    }
+    else {
+        boost::shared_ptr<const std::vector<unsigned char> > data(slice.contents, &slice.contents->data);
+        rangeResult.reset(new commands::results::ReadFileRange(0, data, slice.offset, slice.length));
+    }
+    
+    return rangeResult;
 }
 
-boost::shared_ptr<commands::results::Result> processCommand(std::string agentAddress, boost::shared_ptr<commands::Command> command) {
+//Reads that follow one another in a batch don't depend on each other, so the
+//whole run of ReadFileByID commands starting at first is fetched in one round
+//trip. Runs of one are left to processCommand.
+void prefetchReadRun(pqxx::transaction_base &tx, boost::shared_ptr<commands::Batch> cb, unsigned int first,
+                     bool fillFileCache, database::FilesData *prefetchedData, std::vector<bool> *prefetched) {
+    std::vector<boost::shared_ptr<commands::Command> >& commands = *(cb->commands());
+    
+    std::vector<unsigned long> fileIDs;
+    for (unsigned int i=first; i < commands.size() && commands[i]->typeChar() == commands::COMMANDTYPECHAR_READ_FILE_BY_ID; i++) {
+        boost::shared_ptr<commands::ReadFileByID> readCommand = boost::dynamic_pointer_cast<commands::ReadFileByID>(commands[i]);
+        if (readCommand.get() == NULL) break;
+        fileIDs.push_back(readCommand->fileID());
+    }
+    if (fileIDs.size() < 2) return;
+    
+    database::FilesData filesData = database::readFilesByID(tx, fileIDs, fillFileCache);
+    for (unsigned int i=0; i < filesData.size(); i++) {
+        (*prefetchedData)[first + i] = filesData[i];
+        (*prefetched)[first + i] = true;
+    }
+}
+
+//fillFileCache: see database::readFileByID()
+boost::shared_ptr<commands::results::Result> processCommand(pqxx::transaction_base &tx, std::string agentAddress, boost::shared_ptr<commands::Command> command, bool fillFileCache) {
     if (command->typeChar() == commands::COMMANDTYPECHAR_CREATE_POCKET) {
         boost::shared_ptr<commands::CreatePocket> cpCommand = 
           boost::dynamic_pointer_cast<commands::CreatePocket>(command);
@@ -160,7 +271,7 @@ boost::shared_ptr<commands::results::Result> processCommand(std::string agentAdd
             throw networking::NetvendDecodeException("Error decoding what seems to be a createpocket command.");
         }
         
-        return processCreatePocketCommand(agentAddress, cpCommand);
+        return processCreatePocketCommand(tx, agentAddress, cpCommand);
     }
     else if (command->typeChar() == commands::COMMANDTYPECHAR_REQUEST_POCKET_DEPOSIT_ADDRESS) {
         boost::shared_ptr<commands::RequestPocketDepositAddress> rpdaCommand = 
@@ -170,7 +281,7 @@ boost::shared_ptr<commands::results::Result> processCommand(std::string agentAdd
             throw networking::NetvendDecodeException("Error decoding what seems to be an rpda command.");
         }
         
-        return processRequestPocketDepositAddressCommand(agentAddress, rpdaCommand);
+        return processRequestPocketDepositAddressCommand(tx, agentAddress, rpdaCommand);
     }
     else if (command->typeChar() == commands::COMMANDTYPECHAR_POCKET_TRANSFER) {
         boost::shared_ptr<commands::PocketTransfer> ptCommand =
@@ -180,7 +291,7 @@ boost::shared_ptr<commands::results::Result> processCommand(std::string agentAdd
             throw networking::NetvendDecodeException("Error decoding what seems to be a pocketTransfer command.");
         }
         
-        return processPocketTransferCommand(agentAddress, ptCommand);
+        return processPocketTransferCommand(tx, agentAddress, ptCommand);
     }
     else if (command->typeChar() == commands::COMMANDTYPECHAR_CREATE_FILE) {
         boost::shared_ptr<commands::CreateFile> ccCommand = 
@@ -190,7 +301,7 @@ boost::shared_ptr<commands::results::Result> processCommand(std::string agentAdd
             throw networking::NetvendDecodeException("Error decoding what seems to be a CreateFile command.");
         }
         
-        return processCreateFileCommand(agentAddress, ccCommand);
+        return processCreateFileCommand(tx, agentAddress, ccCommand);
     }
     else if (command->typeChar() == commands::COMMANDTYPECHAR_UPDATE_FILE_BY_ID) {
         boost::shared_ptr<commands::UpdateFileByID> writeCommand = 
@@ -200,7 +311,27 @@ boost::shared_ptr<commands::results::Result> processCommand(std::string agentAdd
             throw networking::NetvendDecodeException("Error decoding what seems to be an ucbi command.");
         }
         
-        return processUpdateFileByIDCommand(agentAddress, writeCommand);
+        return processUpdateFileByIDCommand(tx, agentAddress, writeCommand);
+    }
+    else if (command->typeChar() == commands::COMMANDTYPECHAR_APPEND_TO_FILE) {
+        boost::shared_ptr<commands::AppendToFile> appendCommand = 
+        boost::dynamic_pointer_cast<commands::AppendToFile>(command);
+        
+        if (appendCommand.get() == NULL) {
+            throw networking::NetvendDecodeException("Error decoding what seems to be an appendToFile command.");
+        }
+        
+        return processAppendToFileCommand(tx, agentAddress, appendCommand);
+    }
+    else if (command->typeChar() == commands::COMMANDTYPECHAR_WRITE_FILE_RANGE) {
+        boost::shared_ptr<commands::WriteFileRange> rangeCommand = 
+        boost::dynamic_pointer_cast<commands::WriteFileRange>(command);
+        
+        if (rangeCommand.get() == NULL) {
+            throw networking::NetvendDecodeException("Error decoding what seems to be a writeFileRange command.");
+        }
+        
+        return processWriteFileRangeCommand(tx, agentAddress, rangeCommand);
     }
     else if (command->typeChar() == commands::COMMANDTYPECHAR_READ_FILE_BY_ID) {
         boost::shared_ptr<commands::ReadFileByID> readCommand =
@@ -210,7 +341,17 @@ boost::shared_ptr<commands::results::Result> processCommand(std::string agentAdd
             throw networking::NetvendDecodeException("Error decoding what seems to be a readFile command.");
         }
         
-        return processReadFileByIDCommand(agentAddress, readCommand);
+        return processReadFileByIDCommand(tx, agentAddress, readCommand, fillFileCache);
+    }
+    else if (command->typeChar() == commands::COMMANDTYPECHAR_READ_FILE_RANGE) {
+        boost::shared_ptr<commands::ReadFileRange> rangeCommand = 
+        boost::dynamic_pointer_cast<commands::ReadFileRange>(command);
+        
+        if (rangeCommand.get() == NULL) {
+            throw networking::NetvendDecodeException("Error decoding what seems to be a readFileRange command.");
+        }
+        
+        return processReadFileRangeCommand(tx, agentAddress, rangeCommand, fillFileCache);
     }
     else {
         throw networking::NetvendDecodeException((std::string("Error decoding command with commandtypechar ") + boost::lexical_cast<std::string>(command->typeChar())).c_str());
@@ -218,39 +359,122 @@ boost::shared_ptr<commands::results::Result> processCommand(std::string agentAdd
     return NULL;
 }
 
-networking::CommandBatchResponse processCommandBatchPacket(boost::shared_ptr<networking::CommandBatchPacket> packet) {
-    crypto::RSAPubkey pubkey;
-    try {
-        pubkey = database::fetchAgentPubkey(dbConn, packet->agentAddress());
-    }
-    catch (database::NoRowFoundException& e) {
-        std::cout << "No pubkey for agent; aborting." << std::endl;
-        //return;
+boost::shared_ptr<const crypto::SigVerifier> agentVerifier(std::string agentAddress) {
+    boost::shared_ptr<const crypto::SigVerifier> verifier = verifierCache->get(agentAddress);
+    if (verifier.get() == NULL) {
+        crypto::AgentPubkey pubkey;
+        try {
+            database::ConnectionLease lease(*dbPool);
+            pubkey = database::fetchAgentPubkey(lease.get(), agentAddress);
+        }
+        catch (database::NoRowFoundException& e) {
+            std::cout << "No pubkey for agent; aborting." << std::endl;
+            throw;
+        }
+        
+        verifier.reset(crypto::newVerifier(pubkey));
+        verifierCache->put(agentAddress, verifier);
     }
+    return verifier;
+}
+
+bool verifyCommandBatchPacket(boost::shared_ptr<networking::CommandBatchPacket> packet) {
+    boost::shared_ptr<const crypto::SigVerifier> verifier = agentVerifier(packet->agentAddress());
+    
+    bool sigValid = crypto::verifySig(*verifier, *(packet->commandBatchData()), packet->sig());
+    sigsVerified++;
+    
+    return sigValid;
+}
+
+//one signature covers every batch in the packet, through their Merkle root
+bool verifyAggregateCommandBatchPacket(boost::shared_ptr<networking::AggregateCommandBatchPacket> packet) {
+    boost::shared_ptr<const crypto::SigVerifier> verifier = agentVerifier(packet->agentAddress());
+    
+    std::vector<unsigned char> root = crypto::merkleRoot(packet->commandBatchesData());
+    bool sigValid = crypto::verifySig(*verifier, root, packet->sig());
+    sigsVerified++;
+    
+    return sigValid;
+}
+
+//Checks the agent's signature on its session pubkey, then does our half of
+//the exchange. The derived key is returned through sessionKey.
+networking::StartSessionResponse processStartSessionPacket(boost::shared_ptr<networking::StartSessionPacket> packet, std::vector<unsigned char>* sessionKey) {
+    boost::shared_ptr<const crypto::SigVerifier> verifier = agentVerifier(packet->agentAddress());
     
-    if (!crypto::verifySig(pubkey, *(packet->commandBatchData()), packet->sig())) {
-        std::cout << "signature verification failed." << std::endl;
-        //return error
+    bool sigValid = crypto::verifySig(*verifier, packet->sessionPubkey(), packet->sig());
+    sigsVerified++;
+    if (!sigValid) {
+        //unlike a CommandBatch, nothing from this agent is trusted until it has a session
+        throw std::runtime_error("session pubkey signature invalid");
     }
     
-    unsigned char* dataPtr = packet->commandBatchData()->data();
-    boost::shared_ptr<commands::Batch> cb(commands::Batch::consumeFromBuf(&dataPtr));
+    CryptoPP::AutoSeededRandomPool rng;
+    std::vector<unsigned char> serverPrivkey, serverPubkey;
+    crypto::generateSessionKeypair(rng, &serverPrivkey, &serverPubkey);
+    
+    *sessionKey = crypto::deriveSessionKey(serverPrivkey, packet->sessionPubkey(), serverPubkey, false);
     
+    return networking::StartSessionResponse(packet->requestID(), serverPubkey);
+}
+
+//The batch runs in a savepoint of tx, and each command in a savepoint of its
+//own within that. A command's error rolls back just that command, unless the
+//batch is atomic, in which case it rolls back the whole batch. Committing tx
+//is up to the caller, as is saying whether anything in tx may write (in which
+//case nothing read is put in the file cache). The IDs of any files the batch
+//creates are added to createdFiles.
+networking::CommandBatchResponse processCommandBatchData(pqxx::dbtransaction &tx, unsigned long requestID, std::string agentAddress, boost::shared_ptr<commands::Batch> cb,
+                                                         bool txWrites, std::vector<unsigned long> *createdFiles) {
     std::cout << cb->commands()->size() << " commands in commandBatch." << std::endl;
     
     boost::shared_ptr<commands::results::Batch> crb(new commands::results::Batch(cb.get()));
     
+    pqxx::subtransaction batchTx(tx, "CommandBatchWork");
+    unsigned int numSucceeded = 0;
+    bool rolledBack = false;
+    
+    database::FilesData prefetchedData(cb->commands()->size());
+    std::vector<bool> prefetched(cb->commands()->size(), false);
+    
     for (unsigned int i=0; i < cb->commands()->size(); i++) {
         boost::shared_ptr<commands::Command> command = (*(cb->commands()))[i];
+        if (!prefetched[i] && command->typeChar() == commands::COMMANDTYPECHAR_READ_FILE_BY_ID) {
+            prefetchReadRun(batchTx, cb, i, !txWrites, &prefetchedData, &prefetched);
+        }
+        
         try {
-            boost::shared_ptr<commands::results::Result> result = processCommand(packet->agentAddress(), command);
+            boost::shared_ptr<commands::results::Result> result;
+            if (prefetched[i]) {
+                //reads change nothing, so they don't need a savepoint
+                boost::shared_ptr<commands::ReadFileByID> readCommand = boost::dynamic_pointer_cast<commands::ReadFileByID>(command);
+                result = readFileByIDResult(readCommand->fileID(), prefetchedData[i]);
+            }
+            else {
+                pqxx::subtransaction commandTx(batchTx, "CommandWork");
+                result = processCommand(commandTx, agentAddress, command, !txWrites);
+                commandTx.commit();
+                
+                if (command->typeChar() == commands::COMMANDTYPECHAR_CREATE_FILE) {
+                    createdFiles->push_back(boost::dynamic_pointer_cast<commands::results::CreateFile>(result)->fileID());
+                }
+            }
+            
             crb->addResult(result);
+            numSucceeded++;
         }
         catch (NetvendCommandException &exception) {
+            //commandTx went out of scope uncommitted, so the command's changes are already rolled back
             boost::shared_ptr<commands::errors::Error> commandError = exception.commandError();
             std::cout << commandError->error() << std::endl;
             crb->addResult(commandError);
-            if (commandError->fatalToBatch()) {
+            if (cb->atomic()) {
+                std::cout << "command " << i << " had error " << commandError->what() << "; rolling back atomic batch" << std::endl;
+                rolledBack = true;
+                break;
+            }
+            else if (commandError->fatalToBatch()) {
                 std::cout << "command " << i << " had fatal error " << commandError->what() << std::endl;
                 break;
             }
@@ -260,48 +484,581 @@ networking::CommandBatchResponse processCommandBatchPacket(boost::shared_ptr<net
         }
     }
     
-    return networking::CommandBatchResponse(crb, commands::COMMANDBATCH_COMPLETION_ALL);
+    unsigned char completion;
+    if (rolledBack) {
+        batchTx.abort();
+        completion = commands::COMMANDBATCH_COMPLETION_NONE;
+    }
+    else {
+        batchTx.commit();
+        if (numSucceeded == cb->commands()->size())
+            completion = commands::COMMANDBATCH_COMPLETION_ALL;
+        else if (numSucceeded > 0)
+            completion = commands::COMMANDBATCH_COMPLETION_SOME;
+        else
+            completion = commands::COMMANDBATCH_COMPLETION_NONE;
+    }
+    
+    return networking::CommandBatchResponse(requestID, crb, completion);
 }
 
-class FeeHandler {
-    boost::chrono::process_real_cpu_clock::time_point lastFeeChargedTime;
+//Settles each pocket's upkeep fees when it's due to run dry, rather than
+//sweeping every pocket on an interval. Deadlines are kept in a priority
+//queue; a pocket's is recomputed whenever a committed batch touches it (its
+//rate or balance may have changed) and after it's settled. Entries left
+//behind by a recompute are skipped when they come up.
+class FeeScheduler {
+    typedef boost::chrono::steady_clock Clock;
+    typedef std::pair<Clock::time_point, unsigned long> Deadline;
+    
     pqxx::connection *feeDbConn;
+    
+    boost::mutex mutex_;
+    boost::condition_variable wake_;
+    std::vector<unsigned long> touchedPockets_;
+    std::vector<unsigned long> touchedFiles_;
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline> > deadlines_;
+    std::map<unsigned long, Clock::time_point> currentDeadlines_;
+    
+    size_t settleChunkSize_;
+    
+    boost::atomic<unsigned long long> settlements_;
+    boost::atomic<unsigned long long> settleMicros_;
 public:
-    FeeHandler() {
+    FeeScheduler() : settleChunkSize_(config.get<size_t>("fees.settle-chunk-size")), settlements_(0), settleMicros_(0) {
         database::prepareConnection(&feeDbConn);
     }
-    void operator()() {
-        chargeFees();
-        lastFeeChargedTime = boost::chrono::process_real_cpu_clock::now();
+    
+    //call once the change to the pocket or file has committed
+    void touchPocket(unsigned long pocketID) {
+        boost::mutex::scoped_lock lock(mutex_);
+        touchedPockets_.push_back(pocketID);
+        wake_.notify_one();
+    }
+    
+    void touchFile(unsigned long fileID) {
+        boost::mutex::scoped_lock lock(mutex_);
+        touchedFiles_.push_back(fileID);
+        wake_.notify_one();
+    }
+    
+    size_t scheduled() {
+        boost::mutex::scoped_lock lock(mutex_);
+        return currentDeadlines_.size();
+    }
+    
+    unsigned long long settlements() {
+        return settlements_;
+    }
+    
+    //total time spent in settlePocketFees
+    unsigned long long settleMicros() {
+        return settleMicros_;
+    }
+    
+    void run() {
+        schedule(database::fetchAllFeeDeadlines(feeDbConn));
         
         while (true) {
-            boost::chrono::process_real_cpu_clock::time_point wakeTime =
-                lastFeeChargedTime + boost::chrono::seconds(config.get<int>("fees.fee-interval"));
-            boost::this_thread::sleep_until(wakeTime);
+            std::vector<unsigned long> pockets, files, due;
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                while (touchedPockets_.empty() && touchedFiles_.empty() && !hasDue()) {
+                    if (deadlines_.empty()) {
+                        wake_.wait(lock);
+                    }
+                    else {
+                        wake_.wait_until(lock, deadlines_.top().first);
+                    }
+                }
+                pockets.swap(touchedPockets_);
+                files.swap(touchedFiles_);
+                
+                while (hasDue()) {
+                    unsigned long pocketID = deadlines_.top().second;
+                    deadlines_.pop();
+                    currentDeadlines_.erase(pocketID);
+                    due.push_back(pocketID);
+                }
+            }
+            //settling may not have emptied them (they were topped up since), so
+            //look again; and if settling fails, this is what puts them back
+            pockets.insert(pockets.end(), due.begin(), due.end());
             
-            lastFeeChargedTime = wakeTime;
+            try {
+                if (!due.empty()) {
+                    boost::chrono::steady_clock::time_point settleStart = boost::chrono::steady_clock::now();
+                    database::settlePocketFees(feeDbConn, due, settleChunkSize_);
+                    settleMicros_ += boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - settleStart).count();
+                    settlements_ += due.size();
+                    //files deleted by settling may have been the last users of some blobs
+                    database::collectBlobGarbage(feeDbConn);
+                }
+                schedule(database::fetchFeeDeadlines(feeDbConn, pockets, files));
+            }
+            catch (std::exception& e) {
+                std::cerr << "settling fees failed: " << e.what() << std::endl;
+                
+                //try again in a bit
+                boost::this_thread::sleep_for(boost::chrono::seconds(1));
+                boost::mutex::scoped_lock lock(mutex_);
+                touchedPockets_.insert(touchedPockets_.end(), pockets.begin(), pockets.end());
+                touchedFiles_.insert(touchedFiles_.end(), files.begin(), files.end());
+            }
+        }
+    }
+    
+private:
+    //with mutex_ held. Also drops stale entries off the top of deadlines_.
+    bool hasDue() {
+        while (!deadlines_.empty()) {
+            std::map<unsigned long, Clock::time_point>::iterator current = currentDeadlines_.find(deadlines_.top().second);
+            if (current != currentDeadlines_.end() && current->second == deadlines_.top().first) break;
+            deadlines_.pop();
+        }
+        return !deadlines_.empty() && deadlines_.top().first <= Clock::now();
+    }
+    
+    void schedule(const std::vector<database::FeeDeadline>& fetched) {
+        boost::mutex::scoped_lock lock(mutex_);
+        Clock::time_point now = Clock::now();
+        for (unsigned int i=0; i<fetched.size(); i++) {
+            if (!fetched[i].hasDeadline) {
+                currentDeadlines_.erase(fetched[i].pocketID);
+                continue;
+            }
             
-            chargeFees();
+            Clock::time_point when = now + boost::chrono::duration_cast<Clock::duration>(boost::chrono::duration<double>(std::max(fetched[i].secondsLeft, 0.0)));
+            currentDeadlines_[fetched[i].pocketID] = when;
+            deadlines_.push(Deadline(when, fetched[i].pocketID));
+        }
+    }
+};
+
+FeeScheduler* feeScheduler;
+
+//tells feeScheduler about the pockets (and files) a committed batch may have changed the fees or balance of
+void touchBatchPockets(boost::shared_ptr<commands::Batch> cb) {
+    for (unsigned int i=0; i < cb->commands()->size(); i++) {
+        boost::shared_ptr<commands::Command> command = (*(cb->commands()))[i];
+        switch (command->typeChar()) {
+            case commands::COMMANDTYPECHAR_POCKET_TRANSFER: {
+                boost::shared_ptr<commands::PocketTransfer> transfer = boost::dynamic_pointer_cast<commands::PocketTransfer>(command);
+                feeScheduler->touchPocket(transfer->fromPocketID());
+                feeScheduler->touchPocket(transfer->toPocketID());
+                break;
+            }
+            case commands::COMMANDTYPECHAR_CREATE_FILE:
+                feeScheduler->touchPocket(boost::dynamic_pointer_cast<commands::CreateFile>(command)->pocketID());
+                break;
+            //AppendToFile and WriteFileRange are UpdateFileByIDs too
+            case commands::COMMANDTYPECHAR_UPDATE_FILE_BY_ID:
+            case commands::COMMANDTYPECHAR_APPEND_TO_FILE:
+            case commands::COMMANDTYPECHAR_WRITE_FILE_RANGE:
+                feeScheduler->touchFile(boost::dynamic_pointer_cast<commands::UpdateFileByID>(command)->fileID());
+                break;
+        }
+    }
+}
+
+//the files a batch may change the data of
+void addBatchWrittenFiles(boost::shared_ptr<commands::Batch> cb, std::vector<unsigned long> *fileIDs) {
+    for (unsigned int i=0; i < cb->commands()->size(); i++) {
+        boost::shared_ptr<commands::Command> command = (*(cb->commands()))[i];
+        switch (command->typeChar()) {
+            case commands::COMMANDTYPECHAR_UPDATE_FILE_BY_ID:
+            case commands::COMMANDTYPECHAR_APPEND_TO_FILE:
+            case commands::COMMANDTYPECHAR_WRITE_FILE_RANGE:
+                fileIDs->push_back(boost::dynamic_pointer_cast<commands::UpdateFileByID>(command)->fileID());
+                break;
+        }
+    }
+}
+
+bool batchHasWrites(boost::shared_ptr<commands::Batch> cb) {
+    for (unsigned int i=0; i < cb->commands()->size(); i++) {
+        unsigned char typeChar = (*(cb->commands()))[i]->typeChar();
+        if (typeChar != commands::COMMANDTYPECHAR_READ_FILE_BY_ID && typeChar != commands::COMMANDTYPECHAR_READ_FILE_RANGE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//what runReadOnlyBatchAsync() can run: whole-file reads only. Ranged reads
+//go to the pool instead, where a miss fetches just the range.
+bool batchOnlyReadsWholeFiles(boost::shared_ptr<commands::Batch> cb) {
+    for (unsigned int i=0; i < cb->commands()->size(); i++) {
+        if ((*(cb->commands()))[i]->typeChar() != commands::COMMANDTYPECHAR_READ_FILE_BY_ID) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//A serialized response. The bytes of each splice (file data left on disk) go
+//out from its file, at its place in vch; see ConnectionHandler::writeFrontResponse.
+struct OutgoingResponse {
+    std::vector<unsigned char> vch;
+    std::vector<commands::results::Splice> splices;
+};
+
+//A parsed batch waiting to be run, and where its serialized response goes.
+//done gets an empty pointer if the batch couldn't be run or committed.
+struct CommandBatchJob {
+    unsigned long requestID;
+    std::string agentAddress;
+    boost::shared_ptr<commands::Batch> batch;
+    boost::function<void (boost::shared_ptr<OutgoingResponse>)> done;
+};
+
+//Runs jobs in one transaction, each batch in its own savepoint, and only hands
+//out their responses once that transaction has committed. A batch that fails
+//outside of a command error (a bad statement, say) is rolled back to its
+//savepoint without disturbing the others.
+void runCommandBatchGroup(const std::vector<CommandBatchJob> &jobs) {
+    std::vector<boost::shared_ptr<OutgoingResponse> > responses(jobs.size());
+    
+    //keeps the files being written out of the file cache until the
+    //transaction is over, committed or not
+    std::vector<unsigned long> writtenFiles;
+    bool groupWrites = false;
+    for (unsigned int i=0; i<jobs.size(); i++) {
+        addBatchWrittenFiles(jobs[i].batch, &writtenFiles);
+        groupWrites = groupWrites || batchHasWrites(jobs[i].batch);
+    }
+    database::FileWriteGuard writeGuard(database::fileCache(), writtenFiles);
+    //and new files may have been cached as not existing, so they're
+    //invalidated once the transaction is over
+    std::vector<unsigned long> createdFiles;
+    
+    try {
+        database::ConnectionLease lease(*dbPool);
+        pqxx::work tx(*(lease.get()), "CommandBatchGroupWork");
+        
+        for (unsigned int i=0; i<jobs.size(); i++) {
+            std::cout << "Processing CommandBatch " << jobs[i].requestID << "." << std::endl;
+            try {
+                networking::CommandBatchResponse response = processCommandBatchData(tx, jobs[i].requestID, jobs[i].agentAddress, jobs[i].batch, groupWrites, &createdFiles);
+                responses[i].reset(new OutgoingResponse());
+                response.writeToVch(&responses[i]->vch, &responses[i]->splices);
+            }
+            catch (pqxx::broken_connection& e) {
+                throw;
+            }
+            catch (std::exception& e) {
+                std::cerr << "processing CommandBatch " << jobs[i].requestID << " failed: " << e.what() << std::endl;
+            }
+        }
+        
+        tx.commit();
+        batchCommits++;
+        batchesCommitted += jobs.size();
+        
+        for (unsigned int i=0; i<jobs.size(); i++) {
+            if (responses[i].get() != NULL) touchBatchPockets(jobs[i].batch);
+        }
+    }
+    catch (std::exception& e) {
+        std::cerr << "committing " << jobs.size() << " CommandBatches failed: " << e.what() << std::endl;
+        for (unsigned int i=0; i<responses.size(); i++) {
+            responses[i].reset();
+        }
+    }
+    
+    if (database::fileCache() != NULL) {
+        for (unsigned int i=0; i<createdFiles.size(); i++) {
+            database::fileCache()->invalidate(createdFiles[i]);
+        }
+    }
+    
+    for (unsigned int i=0; i<jobs.size(); i++) {
+        jobs[i].done(responses[i]);
+    }
+}
+
+//Group commit. Write batches that become ready at about the same time, from
+//any connection, are collected for up to server.group-commit-window
+//microseconds (or until server.group-commit-max-size of them are waiting)
+//and then run and committed together by runCommandBatchGroup, so they share
+//one commit and one fsync.
+class GroupCommitter {
+    boost::asio::io_service& io_;
+    boost::asio::io_service::strand strand_;
+    boost::asio::deadline_timer timer_;
+    std::vector<CommandBatchJob> pending_;
+    long windowMicros_;
+    size_t maxGroupSize_;
+public:
+    GroupCommitter(boost::asio::io_service& io)
+      : io_(io), strand_(io), timer_(io),
+        windowMicros_(config.get<long>("server.group-commit-window")),
+        maxGroupSize_(config.get<size_t>("server.group-commit-max-size"))
+    {}
+    
+    bool enabled() {
+        return windowMicros_ > 0 && maxGroupSize_ > 1;
+    }
+    
+    void submit(const CommandBatchJob& job) {
+        strand_.post(boost::bind(&GroupCommitter::addJob, this, job));
+    }
+    
+private:
+    void addJob(const CommandBatchJob& job) {
+        pending_.push_back(job);
+        
+        if (pending_.size() >= maxGroupSize_) {
+            timer_.cancel();
+            flush();
+        }
+        else if (pending_.size() == 1) {
+            timer_.expires_from_now(boost::posix_time::microseconds(windowMicros_));
+            timer_.async_wait(strand_.wrap(boost::bind(&GroupCommitter::handleTimer, this, boost::asio::placeholders::error)));
+        }
+    }
+    
+    void handleTimer(const boost::system::error_code& error) {
+        if (error == boost::asio::error::operation_aborted) return;
+        
+        flush();
+    }
+    
+    void flush() {
+        if (pending_.empty()) return;
+        
+        std::vector<CommandBatchJob> group;
+        group.swap(pending_);
+        io_.post(boost::bind(&runCommandBatchGroup, group));
+    }
+};
+
+GroupCommitter* groupCommitter;
+
+//The response to a batch of nothing but ReadFileByID commands, built from data
+//already fetched, with the same per-command error handling that
+//processCommandBatchData gives them.
+networking::CommandBatchResponse readOnlyBatchResponse(unsigned long requestID, boost::shared_ptr<commands::Batch> cb, const database::FilesData& filesData) {
+    boost::shared_ptr<commands::results::Batch> crb(new commands::results::Batch(cb.get()));
+    
+    unsigned int numSucceeded = 0;
+    bool rolledBack = false;
+    
+    for (unsigned int i=0; i < cb->commands()->size(); i++) {
+        boost::shared_ptr<commands::ReadFileByID> readCommand = boost::dynamic_pointer_cast<commands::ReadFileByID>((*(cb->commands()))[i]);
+        try {
+            crb->addResult(readFileByIDResult(readCommand->fileID(), filesData[i]));
+            numSucceeded++;
+        }
+        catch (NetvendCommandException &exception) {
+            boost::shared_ptr<commands::errors::Error> commandError = exception.commandError();
+            crb->addResult(commandError);
+            if (cb->atomic()) {
+                rolledBack = true;
+                break;
+            }
+            else if (commandError->fatalToBatch()) {
+                break;
+            }
+        }
+    }
+    
+    unsigned char completion;
+    if (rolledBack || numSucceeded == 0)
+        completion = commands::COMMANDBATCH_COMPLETION_NONE;
+    else if (numSucceeded == cb->commands()->size())
+        completion = commands::COMMANDBATCH_COMPLETION_ALL;
+    else
+        completion = commands::COMMANDBATCH_COMPLETION_SOME;
+    
+    return networking::CommandBatchResponse(requestID, crb, completion);
+}
+
+void finishReadOnlyBatch(CommandBatchJob job, database::FilesData filesData, std::string error) {
+    boost::shared_ptr<OutgoingResponse> outgoing;
+    if (!error.empty()) {
+        std::cerr << "processing CommandBatch " << job.requestID << " failed: " << error << std::endl;
+    }
+    else {
+        try {
+            networking::CommandBatchResponse response = readOnlyBatchResponse(job.requestID, job.batch, filesData);
+            outgoing.reset(new OutgoingResponse());
+            response.writeToVch(&outgoing->vch, &outgoing->splices);
+        }
+        catch (std::exception& e) {
+            std::cerr << "processing CommandBatch " << job.requestID << " failed: " << e.what() << std::endl;
+            outgoing.reset();
+        }
+    }
+    
+    job.done(outgoing);
+}
+
+//Read-only batches don't need a transaction, so they skip the pool: their
+//reads go out as one query on an AsyncConnection, and the batch picks up again
+//in finishReadOnlyBatch once the results are in. No thread waits in between.
+void runReadOnlyBatchAsync(const CommandBatchJob& job) {
+    std::cout << "Processing CommandBatch " << job.requestID << " (read-only)." << std::endl;
+    
+    std::vector<unsigned long> fileIDs;
+    for (unsigned int i=0; i < job.batch->commands()->size(); i++) {
+        boost::shared_ptr<commands::ReadFileByID> readCommand = boost::dynamic_pointer_cast<commands::ReadFileByID>((*(job.batch->commands()))[i]);
+        fileIDs.push_back(readCommand->fileID());
+    }
+    
+    database::readFilesByIDAsync(*asyncDb, fileIDs, boost::bind(&finishReadOnlyBatch, job, _1, _2));
+}
+
+class StatsReporter {
+    boost::asio::deadline_timer timer_;
+    int interval_;
+    unsigned long long lastSigsVerified_;
+    unsigned long long lastMacsVerified_;
+    unsigned long long lastHandshakesProcessed_;
+    unsigned long long lastBatchCommits_;
+    unsigned long long lastAsyncQueries_;
+    std::map<std::string, database::TableCacheStats> lastTableCacheStats_;
+public:
+    StatsReporter(boost::asio::io_service& io)
+      : timer_(io), interval_(config.get<int>("server.stats-interval")), lastSigsVerified_(0), lastMacsVerified_(0), lastHandshakesProcessed_(0), lastBatchCommits_(0), lastAsyncQueries_(0)
+    {
+        if (interval_ > 0) {
+            startTimer();
+        }
+    }
+    
+private:
+    void startTimer() {
+        timer_.expires_from_now(boost::posix_time::seconds(interval_));
+        timer_.async_wait(boost::bind(&StatsReporter::handleTimer, this, boost::asio::placeholders::error));
+    }
+    
+    void handleTimer(const boost::system::error_code& error) {
+        if (error) return;
+        
+        std::cout << "verifier cache: " << verifierCache->size() << " entries, "
+                  << verifierCache->hits() << " hits, " << verifierCache->misses() << " misses" << std::endl;
+        
+        database::FileCache* fileCache = database::fileCache();
+        if (fileCache != NULL) {
+            std::cout << "file cache: " << fileCache->size() << " entries, " << fileCache->bytes() << " bytes, "
+                      << fileCache->hits() << " hits, " << fileCache->misses() << " misses, "
+                      << fileCache->rejected() << " not admitted, " << fileCache->coalesced() << " coalesced into other reads" << std::endl;
+        }
+        
+        unsigned long long totalSigsVerified = sigsVerified;
+        std::cout << "signatures verified: " << totalSigsVerified << " ("
+                  << (totalSigsVerified - lastSigsVerified_) / interval_ << "/s)" << std::endl;
+        lastSigsVerified_ = totalSigsVerified;
+        
+        unsigned long long totalMacsVerified = macsVerified;
+        std::cout << "session MACs verified: " << totalMacsVerified << " ("
+                  << (totalMacsVerified - lastMacsVerified_) / interval_ << "/s)" << std::endl;
+        lastMacsVerified_ = totalMacsVerified;
+        
+        unsigned long long totalHandshakesProcessed = handshakesProcessed;
+        std::cout << "handshakes processed: " << totalHandshakesProcessed << " ("
+                  << (totalHandshakesProcessed - lastHandshakesProcessed_) / interval_ << "/s)" << std::endl;
+        lastHandshakesProcessed_ = totalHandshakesProcessed;
+        
+        unsigned long long totalBatchCommits = batchCommits;
+        unsigned long long totalBatchesCommitted = batchesCommitted;
+        std::cout << "CommandBatch commits: " << totalBatchCommits << " ("
+                  << (totalBatchCommits - lastBatchCommits_) / interval_ << "/s), "
+                  << (totalBatchCommits > 0 ? (double)totalBatchesCommitted / totalBatchCommits : 0) << " batches per commit" << std::endl;
+        lastBatchCommits_ = totalBatchCommits;
+        
+        //waits is how often a lease found every connection taken; if that's
+        //more than a small fraction of leases, the pool is saturated
+        unsigned long long leases = dbPool->leases();
+        unsigned long long waits = dbPool->waits();
+        std::cout << "db pool: " << dbPool->inUse() << "/" << dbPool->size() << " in use (peak " << dbPool->peakInUse() << "), "
+                  << leases << " leases, " << waits << " waited, "
+                  << (waits > 0 ? dbPool->waitMicros() / waits : 0) << "us average wait" << std::endl;
+        
+        //what a partial write costs, next to rewriting a whole file
+        unsigned long long totalFileUpdates = fileUpdates;
+        unsigned long long totalPartialFileWrites = partialFileWrites;
+        std::cout << "file writes: " << totalFileUpdates << " whole ("
+                  << (totalFileUpdates > 0 ? (double)fileUpdateMicros / totalFileUpdates : 0) << "us, "
+                  << (totalFileUpdates > 0 ? (double)fileUpdateBytes / totalFileUpdates : 0) << " bytes each), "
+                  << totalPartialFileWrites << " partial ("
+                  << (totalPartialFileWrites > 0 ? (double)partialFileWriteMicros / totalPartialFileWrites : 0) << "us, "
+                  << (totalPartialFileWrites > 0 ? (double)partialFileWriteBytes / totalPartialFileWrites : 0) << " bytes each)" << std::endl;
+        
+        unsigned long long settlements = feeScheduler->settlements();
+        printTableCacheStats();
+        
+        std::cout << "fee scheduler: " << feeScheduler->scheduled() << " pockets scheduled, "
+                  << settlements << " settlements, "
+                  << (settlements > 0 ? (double)feeScheduler->settleMicros() / settlements : 0) << "us per pocket settled" << std::endl;
+        
+        if (asyncDb != NULL) {
+            unsigned long long totalAsyncQueries = asyncDb->queries();
+            std::cout << "async db: " << asyncDb->outstanding() << " queries outstanding on " << asyncDb->size() << " connections, "
+                      << totalAsyncQueries << " queries (" << (totalAsyncQueries - lastAsyncQueries_) / interval_ << "/s)" << std::endl;
+            lastAsyncQueries_ = totalAsyncQueries;
         }
+        
+        startTimer();
     }
     
-    void chargeFees() {
-        int creditPerByte = config.get<float>("fees.store-byte") * config.get<int>("fees.fee-interval") * config.get<int>("general.credits-per-satoshi");
-        int creditPerFile = config.get<float>("fees.store-file") * config.get<int>("fees.fee-interval") * config.get<int>("general.credits-per-satoshi");
-        database::chargeFileUpkeepFees(feeDbConn, creditPerFile, creditPerByte);
+    //buffer cache hit rate of the hot tables over the last interval
+    void printTableCacheStats() {
+        std::vector<database::TableCacheStats> stats;
+        try {
+            database::ConnectionLease lease(*dbPool);
+            stats = database::fetchTableCacheStats(lease.get());
+        }
+        catch (std::exception& e) {
+            std::cerr << "fetching table cache stats failed: " << e.what() << std::endl;
+            return;
+        }
+        
+        for (unsigned int i=0; i<stats.size(); i++) {
+            database::TableCacheStats& last = lastTableCacheStats_[stats[i].table];
+            unsigned long long hit = stats[i].blocksHit - last.blocksHit;
+            unsigned long long read = stats[i].blocksRead - last.blocksRead;
+            std::cout << "table " << stats[i].table << ": " << hit << " blocks hit, " << read << " read ("
+                      << (hit + read > 0 ? 100.0 * hit / (hit + read) : 100.0) << "% cache hits)" << std::endl;
+            last = stats[i];
+        }
     }
 };
 
 class ConnectionHandler
   : public boost::enable_shared_from_this<ConnectionHandler>
 {
+    boost::asio::io_service& io_;
+    boost::asio::io_service& verifyIo_;
     tcp::socket socket_;
+    boost::asio::io_service::strand strand_;
+    boost::asio::deadline_timer idleTimer_;
+    std::vector<unsigned char> readBuf_;
+    
+    //serialized responses waiting to go out, in completion order; the front
+    //one is being written whenever the queue is non-empty.
+    std::deque<boost::shared_ptr<OutgoingResponse> > writeQueue_;
+    //how much of the front response has been written: all of vch before
+    //writeVchPlace_, and spanSent_ bytes of splice writeSplice_
+    size_t writeVchPlace_;
+    size_t writeSplice_;
+    unsigned int spanSent_;
+    unsigned int packetsInFlight_;
+    bool awaitingPacket_;
+    bool readPaused_;
+    
+    //session state, set once a StartSession is processed; see openSession()
+    bool sessionOpen_;
+    std::string sessionAgentAddress_;
+    std::vector<unsigned char> sessionKey_;
+    unsigned long long nextSessionSeq_;
     
 public:
     typedef boost::shared_ptr<ConnectionHandler> pointer;
     
-    static pointer create(boost::asio::io_service& io) {
-        return pointer(new ConnectionHandler(io));
+    static pointer create(boost::asio::io_service& io, boost::asio::io_service& verifyIo) {
+        return pointer(new ConnectionHandler(io, verifyIo));
     }
     
     tcp::socket& socket() {
@@ -309,52 +1066,639 @@ public:
     }
     
     void start() {
-        std::cout << "Reading packet from client." << std::endl;
+        std::cout << "Reading packets from client." << std::endl;
         
-        boost::shared_ptr<networking::NetvendPacket> packet(networking::NetvendPacket::readFromSocket(socket_));
+        strand_.dispatch(boost::bind(&ConnectionHandler::readPacketHeader, shared_from_this()));
+    }
+
+private:
+    ConnectionHandler(boost::asio::io_service& io, boost::asio::io_service& verifyIo)
+      : io_(io), verifyIo_(verifyIo), socket_(io), strand_(io), idleTimer_(io), writeVchPlace_(0), writeSplice_(0), spanSent_(0), packetsInFlight_(0), awaitingPacket_(false), readPaused_(false), sessionOpen_(false), nextSessionSeq_(0)
+    {}
+    
+    //Every step below is an async operation whose handler holds a shared_ptr
+    //to this handler; once no reads, writes, timers or packets being
+    //processed are left, the handler (and its socket) is released.
+    //
+    //Packets are pipelined: as soon as one is read it is posted to the
+    //io_service to be processed on any worker, and we go straight back to
+    //reading the next one (up to server.max-pipelined-packets in flight).
+    //CommandBatch packets first go through verifyIo_, whose threads only
+    //check signatures, so the CPU-bound verifying runs on its own pool while
+    //the database-bound executing carries on in the main one.
+    //StartSession and AggregateCommandBatch packets go through verifyIo_ too;
+    //an AggregateCommandBatch then fans out into one processCommandBatch
+    //per batch. SessionCommandBatch
+    //packets only need an HMAC check, which is cheap enough to do right
+    //here in the read handler, in order, so sequence numbers are checked
+    //as the packets arrive.
+    //Each finished response is queued and written in completion order; the
+    //client matches it up by request ID. Everything that touches the socket,
+    //timer, queue or session runs through strand_.
+    
+    template <typename Handler>
+    void asyncRead(boost::asio::mutable_buffers_1 buffer, Handler handler) {
+        boost::asio::async_read(socket_, buffer, strand_.wrap(handler));
+    }
+    
+    bool idle() {
+        return packetsInFlight_ == 0 && writeQueue_.empty();
+    }
+    
+    void startIdleTimer() {
+        int idleTimeout = config.get<int>("server.idle-timeout");
+        if (idleTimeout <= 0) return;
         
-        if (packet->typeChar() == networking::PACKETTYPECHAR_HANDSHAKE) {
-            std::cout << "Handshake packet." << std::endl;
-            boost::shared_ptr<networking::HandshakePacket> hsPacket = boost::dynamic_pointer_cast<networking::HandshakePacket>(packet);
-            assert(hsPacket != NULL);
-            
-            std::cout << "Processing handshake." << std::endl;
-            networking::HandshakeResponse response = processHandshakePacket(hsPacket);
+        idleTimer_.expires_from_now(boost::posix_time::seconds(idleTimeout));
+        idleTimer_.async_wait(strand_.wrap(
+            boost::bind(&ConnectionHandler::handleIdleTimeout, shared_from_this(), boost::asio::placeholders::error)));
+    }
+    
+    void stopIdleTimer() {
+        //moving the expiry cancels any pending wait
+        idleTimer_.expires_at(boost::posix_time::pos_infin);
+    }
+    
+    void handleIdleTimeout(const boost::system::error_code& error) {
+        //the timer may have been reset after this handler was queued
+        if (error == boost::asio::error::operation_aborted
+         || idleTimer_.expires_at() > boost::asio::deadline_timer::traits_type::now()) {
+            return;
+        }
+        
+        std::cout << "Connection idle; closing." << std::endl;
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+    }
+    
+    void readPacketHeader() {
+        if (packetsInFlight_ >= config.get<unsigned int>("server.max-pipelined-packets")) {
+            //resumed from handleWriteResponse once a response has gone out
+            readPaused_ = true;
+            return;
+        }
+        readPaused_ = false;
+        awaitingPacket_ = true;
+        
+        //the connection only counts as idle if it isn't still working on
+        //earlier packets; otherwise the timer is started once it catches up.
+        if (idle()) {
+            startIdleTimer();
+        }
+        
+        readBuf_.resize(networking::PACKET_HEADER_SIZE);
+        
+        asyncRead(boost::asio::buffer(readBuf_),
+            boost::bind(&ConnectionHandler::handleReadPacketHeader, shared_from_this(), boost::asio::placeholders::error));
+    }
+    
+    void handleReadPacketHeader(const boost::system::error_code& error) {
+        awaitingPacket_ = false;
+        
+        if (error == boost::asio::error::eof) {
+            stopIdleTimer();
+            std::cout << "Client closed connection." << std::endl << std::endl;
+            return;
+        }
+        else if (error) {
+            stopIdleTimer();
+            std::cerr << "reading packet header failed with error " << error << std::endl;
+            return;
+        }
+        
+        //once a packet has started, the rest of it has to show up within the idle timeout
+        startIdleTimer();
+        
+        unsigned char typeChar;
+        unsigned long requestID;
+        unpack(readBuf_.data(), "cL", &typeChar, &requestID);
+        
+        if (typeChar == networking::PACKETTYPECHAR_HANDSHAKE) {
+            std::cout << "Handshake packet " << requestID << "." << std::endl;
+            readBuf_.resize(networking::HANDSHAKE_PACKET_HEADER_SIZE);
             
-            std::cout << "Sending response." << std::endl;
-            response.writeToSocket(socket_);
+            asyncRead(boost::asio::buffer(readBuf_),
+                boost::bind(&ConnectionHandler::handleReadHandshakeHeader, shared_from_this(), requestID, boost::asio::placeholders::error));
+        }
+        else if (typeChar == networking::PACKETTYPECHAR_COMMANDBATCH) {
+            std::cout << "CommandBatch packet " << requestID << "." << std::endl;
+            readBuf_.resize(networking::COMMANDBATCH_PACKET_HEADER_SIZE);
             
-            std::cout << "Response sent." << std::endl;
+            asyncRead(boost::asio::buffer(readBuf_),
+                boost::bind(&ConnectionHandler::handleReadCommandBatchHeader, shared_from_this(), requestID, boost::asio::placeholders::error));
         }
-        else if (packet->typeChar() == networking::PACKETTYPECHAR_COMMANDBATCH) {
-            std::cout << "CommandBatch packet." << std::endl;
-            boost::shared_ptr<networking::CommandBatchPacket> cbPacket = boost::dynamic_pointer_cast<networking::CommandBatchPacket>(packet);
-            assert(cbPacket.get() != NULL);
-            std::cout << "agent address: " << cbPacket->agentAddress() << std::endl;
+        else if (typeChar == networking::PACKETTYPECHAR_AGGREGATECOMMANDBATCH) {
+            std::cout << "AggregateCommandBatch packet " << requestID << "." << std::endl;
+            readBuf_.resize(networking::AGGREGATECOMMANDBATCH_PACKET_HEADER_SIZE);
             
-            std::cout << "Processing CommandBatch." << std::endl;
-            networking::CommandBatchResponse response = processCommandBatchPacket(cbPacket);
+            asyncRead(boost::asio::buffer(readBuf_),
+                boost::bind(&ConnectionHandler::handleReadAggregateCommandBatchHeader, shared_from_this(), requestID, boost::asio::placeholders::error));
+        }
+        else if (typeChar == networking::PACKETTYPECHAR_STARTSESSION) {
+            std::cout << "StartSession packet " << requestID << "." << std::endl;
+            readBuf_.resize(networking::STARTSESSION_PACKET_HEADER_SIZE);
             
-            std::cout << "Sending CommandBatchResponse." << std::endl;
-            response.writeToSocket(socket_);
+            asyncRead(boost::asio::buffer(readBuf_),
+                boost::bind(&ConnectionHandler::handleReadStartSessionHeader, shared_from_this(), requestID, boost::asio::placeholders::error));
+        }
+        else if (typeChar == networking::PACKETTYPECHAR_SESSIONCOMMANDBATCH) {
+            std::cout << "SessionCommandBatch packet " << requestID << "." << std::endl;
+            readBuf_.resize(networking::SESSIONCOMMANDBATCH_PACKET_HEADER_SIZE);
             
-            std::cout << "Response sent." << std::endl;
+            asyncRead(boost::asio::buffer(readBuf_),
+                boost::bind(&ConnectionHandler::handleReadSessionCommandBatchHeader, shared_from_this(), requestID, boost::asio::placeholders::error));
+        }
+        else {
+            stopIdleTimer();
+            std::cerr << "unrecognized packet typechar " << (int)typeChar << "; dropping connection." << std::endl;
+        }
+    }
+    
+    void handleReadHandshakeHeader(unsigned long requestID, const boost::system::error_code& error) {
+        if (error) {
+            stopIdleTimer();
+            std::cerr << "reading handshake header failed with error " << error << std::endl;
+            return;
+        }
+        
+        size_t bodySize;
+        try {
+            bodySize = networking::HandshakePacket::bodySizeFromHeader(readBuf_.data());
+        }
+        catch (crypto::UnknownKeyTypeException& e) {
+            stopIdleTimer();
+            std::cerr << e.what() << "; dropping connection." << std::endl;
+            return;
+        }
+        readBuf_.resize(networking::HANDSHAKE_PACKET_HEADER_SIZE + bodySize);
+        
+        asyncRead(boost::asio::buffer(readBuf_.data() + networking::HANDSHAKE_PACKET_HEADER_SIZE, bodySize),
+            boost::bind(&ConnectionHandler::handleReadHandshakeBody, shared_from_this(), requestID, boost::asio::placeholders::error));
+    }
+    
+    void handleReadHandshakeBody(unsigned long requestID, const boost::system::error_code& error) {
+        stopIdleTimer();
+        if (error) {
+            std::cerr << "reading handshake body failed with error " << error << std::endl;
+            return;
+        }
+        
+        unsigned char* ptr = readBuf_.data();
+        boost::shared_ptr<networking::HandshakePacket> hsPacket(networking::HandshakePacket::consumeFromBuf(requestID, &ptr));
+        
+        packetsInFlight_++;
+        io_.post(boost::bind(&ConnectionHandler::processHandshake, shared_from_this(), hsPacket));
+        
+        readPacketHeader();
+    }
+    
+    void handleReadCommandBatchHeader(unsigned long requestID, const boost::system::error_code& error) {
+        if (error) {
+            stopIdleTimer();
+            std::cerr << "reading CommandBatch header failed with error " << error << std::endl;
+            return;
+        }
+        
+        size_t bodySize;
+        try {
+            bodySize = networking::CommandBatchPacket::bodySizeFromHeader(readBuf_.data());
+        }
+        catch (crypto::UnknownKeyTypeException& e) {
+            stopIdleTimer();
+            std::cerr << e.what() << "; dropping connection." << std::endl;
+            return;
+        }
+        readBuf_.resize(networking::COMMANDBATCH_PACKET_HEADER_SIZE + bodySize);
+        
+        asyncRead(boost::asio::buffer(readBuf_.data() + networking::COMMANDBATCH_PACKET_HEADER_SIZE, bodySize),
+            boost::bind(&ConnectionHandler::handleReadCommandBatchBody, shared_from_this(), requestID, boost::asio::placeholders::error));
+    }
+    
+    void handleReadCommandBatchBody(unsigned long requestID, const boost::system::error_code& error) {
+        stopIdleTimer();
+        if (error) {
+            std::cerr << "reading CommandBatch body failed with error " << error << std::endl;
+            return;
+        }
+        
+        unsigned char* ptr = readBuf_.data();
+        boost::shared_ptr<networking::CommandBatchPacket> cbPacket(networking::CommandBatchPacket::consumeFromBuf(requestID, &ptr));
+        std::cout << "agent address: " << cbPacket->agentAddress() << std::endl;
+        
+        packetsInFlight_++;
+        verifyIo_.post(boost::bind(&ConnectionHandler::verifyCommandBatch, shared_from_this(), cbPacket));
+        
+        readPacketHeader();
+    }
+    
+    void handleReadAggregateCommandBatchHeader(unsigned long requestID, const boost::system::error_code& error) {
+        if (error) {
+            stopIdleTimer();
+            std::cerr << "reading AggregateCommandBatch header failed with error " << error << std::endl;
+            return;
+        }
+        
+        unsigned short numBatches = networking::AggregateCommandBatchPacket::numBatchesFromHeader(readBuf_.data());
+        if (numBatches == 0 || numBatches > config.get<unsigned int>("server.max-aggregate-batches")) {
+            stopIdleTimer();
+            std::cerr << "AggregateCommandBatch with " << numBatches << " batches; dropping connection." << std::endl;
+            return;
+        }
+        
+        size_t bodySize;
+        try {
+            bodySize = networking::AggregateCommandBatchPacket::bodySizeFromHeader(readBuf_.data());
+        }
+        catch (crypto::UnknownKeyTypeException& e) {
+            stopIdleTimer();
+            std::cerr << e.what() << "; dropping connection." << std::endl;
+            return;
+        }
+        //the stated size comes straight from the client, so don't allocate more than its batches could need
+        if (bodySize > numBatches * (PACK_H_SIZE + 65535) + MAX_SIG_SIZE) {
+            stopIdleTimer();
+            std::cerr << "AggregateCommandBatch too large; dropping connection." << std::endl;
+            return;
+        }
+        readBuf_.resize(networking::AGGREGATECOMMANDBATCH_PACKET_HEADER_SIZE + bodySize);
+        
+        asyncRead(boost::asio::buffer(readBuf_.data() + networking::AGGREGATECOMMANDBATCH_PACKET_HEADER_SIZE, bodySize),
+            boost::bind(&ConnectionHandler::handleReadAggregateCommandBatchBody, shared_from_this(), requestID, boost::asio::placeholders::error));
+    }
+    
+    void handleReadAggregateCommandBatchBody(unsigned long requestID, const boost::system::error_code& error) {
+        stopIdleTimer();
+        if (error) {
+            std::cerr << "reading AggregateCommandBatch body failed with error " << error << std::endl;
+            return;
+        }
+        
+        unsigned char* ptr = readBuf_.data();
+        boost::shared_ptr<networking::AggregateCommandBatchPacket> acbPacket;
+        try {
+            acbPacket.reset(networking::AggregateCommandBatchPacket::consumeFromBuf(requestID, &ptr));
+        }
+        catch (networking::NetvendDecodeException& e) {
+            std::cerr << e.what() << " Dropping connection." << std::endl;
+            closeSocket();
+            return;
+        }
+        std::cout << "agent address: " << acbPacket->agentAddress() << std::endl;
+        
+        //every batch gets its own response
+        packetsInFlight_ += acbPacket->commandBatchesData().size();
+        verifyIo_.post(boost::bind(&ConnectionHandler::verifyAggregateCommandBatch, shared_from_this(), acbPacket));
+        
+        readPacketHeader();
+    }
+    
+    void handleReadStartSessionHeader(unsigned long requestID, const boost::system::error_code& error) {
+        if (error) {
+            stopIdleTimer();
+            std::cerr << "reading StartSession header failed with error " << error << std::endl;
+            return;
+        }
+        
+        size_t bodySize;
+        try {
+            bodySize = networking::StartSessionPacket::bodySizeFromHeader(readBuf_.data());
+        }
+        catch (crypto::UnknownKeyTypeException& e) {
+            stopIdleTimer();
+            std::cerr << e.what() << "; dropping connection." << std::endl;
+            return;
+        }
+        readBuf_.resize(networking::STARTSESSION_PACKET_HEADER_SIZE + bodySize);
+        
+        asyncRead(boost::asio::buffer(readBuf_.data() + networking::STARTSESSION_PACKET_HEADER_SIZE, bodySize),
+            boost::bind(&ConnectionHandler::handleReadStartSessionBody, shared_from_this(), requestID, boost::asio::placeholders::error));
+    }
+    
+    void handleReadStartSessionBody(unsigned long requestID, const boost::system::error_code& error) {
+        stopIdleTimer();
+        if (error) {
+            std::cerr << "reading StartSession body failed with error " << error << std::endl;
+            return;
+        }
+        
+        unsigned char* ptr = readBuf_.data();
+        boost::shared_ptr<networking::StartSessionPacket> ssPacket(networking::StartSessionPacket::consumeFromBuf(requestID, &ptr));
+        std::cout << "agent address: " << ssPacket->agentAddress() << std::endl;
+        
+        packetsInFlight_++;
+        verifyIo_.post(boost::bind(&ConnectionHandler::processStartSession, shared_from_this(), ssPacket));
+        
+        readPacketHeader();
+    }
+    
+    void handleReadSessionCommandBatchHeader(unsigned long requestID, const boost::system::error_code& error) {
+        if (error) {
+            stopIdleTimer();
+            std::cerr << "reading SessionCommandBatch header failed with error " << error << std::endl;
+            return;
+        }
+        
+        size_t bodySize = networking::SessionCommandBatchPacket::bodySizeFromHeader(readBuf_.data());
+        readBuf_.resize(networking::SESSIONCOMMANDBATCH_PACKET_HEADER_SIZE + bodySize);
+        
+        asyncRead(boost::asio::buffer(readBuf_.data() + networking::SESSIONCOMMANDBATCH_PACKET_HEADER_SIZE, bodySize),
+            boost::bind(&ConnectionHandler::handleReadSessionCommandBatchBody, shared_from_this(), requestID, boost::asio::placeholders::error));
+    }
+    
+    void handleReadSessionCommandBatchBody(unsigned long requestID, const boost::system::error_code& error) {
+        stopIdleTimer();
+        if (error) {
+            std::cerr << "reading SessionCommandBatch body failed with error " << error << std::endl;
+            return;
+        }
+        
+        unsigned char* ptr = readBuf_.data();
+        boost::shared_ptr<networking::SessionCommandBatchPacket> scbPacket(networking::SessionCommandBatchPacket::consumeFromBuf(requestID, &ptr));
+        
+        //a client can only compute the MAC once it has our StartSession
+        //response, and openSession() runs before that is queued, so a
+        //well-behaved client never gets here without a session.
+        if (!sessionOpen_) {
+            std::cerr << "SessionCommandBatch with no open session; dropping connection." << std::endl;
+            closeSocket();
+            return;
+        }
+        if (scbPacket->seq() != nextSessionSeq_) {
+            std::cerr << "SessionCommandBatch out of sequence (got " << scbPacket->seq() << ", expected " << nextSessionSeq_ << "); dropping connection." << std::endl;
+            closeSocket();
+            return;
         }
+        if (!crypto::verifySessionMAC(sessionKey_, scbPacket->seq(), *(scbPacket->commandBatchData()), scbPacket->mac())) {
+            std::cerr << "SessionCommandBatch MAC invalid; dropping connection." << std::endl;
+            closeSocket();
+            return;
+        }
+        macsVerified++;
+        nextSessionSeq_++;
+        
+        packetsInFlight_++;
+        io_.post(boost::bind(&ConnectionHandler::processCommandBatch, shared_from_this(), requestID, sessionAgentAddress_, scbPacket->commandBatchData()));
+        
+        readPacketHeader();
+    }
+    
+    //processHandshake and processCommandBatch run outside the strand, so
+    //packets from one connection can be processed concurrently. They only
+    //hand their serialized response back through the strand.
+    
+    void processHandshake(boost::shared_ptr<networking::HandshakePacket> hsPacket) {
+        std::cout << "Processing handshake " << hsPacket->requestID() << "." << std::endl;
+        boost::shared_ptr<std::vector<unsigned char> > responseVch(new std::vector<unsigned char>());
+        try {
+            database::ConnectionLease lease(*dbPool);
+            networking::HandshakeResponse response = processHandshakePacket(lease.get(), hsPacket);
+            response.writeToVch(responseVch.get());
+        }
+        catch (std::exception& e) {
+            std::cerr << "processing handshake " << hsPacket->requestID() << " failed: " << e.what() << std::endl;
+            strand_.post(boost::bind(&ConnectionHandler::abortConnection, shared_from_this()));
+            return;
+        }
+        
+        strand_.post(boost::bind(&ConnectionHandler::queueVchResponse, shared_from_this(), responseVch));
+    }
+    
+    void verifyCommandBatch(boost::shared_ptr<networking::CommandBatchPacket> cbPacket) {
+        try {
+            if (!verifyCommandBatchPacket(cbPacket)) {
+                std::cerr << "CommandBatch " << cbPacket->requestID() << " signature invalid; dropping connection." << std::endl;
+                strand_.post(boost::bind(&ConnectionHandler::abortConnection, shared_from_this()));
+                return;
+            }
+        }
+        catch (std::exception& e) {
+            std::cerr << "verifying CommandBatch " << cbPacket->requestID() << " failed: " << e.what() << std::endl;
+            strand_.post(boost::bind(&ConnectionHandler::abortConnection, shared_from_this()));
+            return;
+        }
+        
+        io_.post(boost::bind(&ConnectionHandler::processCommandBatch, shared_from_this(), cbPacket->requestID(), cbPacket->agentAddress(), cbPacket->commandBatchData()));
+    }
+    
+    void verifyAggregateCommandBatch(boost::shared_ptr<networking::AggregateCommandBatchPacket> acbPacket) {
+        try {
+            if (!verifyAggregateCommandBatchPacket(acbPacket)) {
+                //none of its batches are run
+                std::cerr << "AggregateCommandBatch " << acbPacket->requestID() << " signature invalid; dropping connection." << std::endl;
+                strand_.post(boost::bind(&ConnectionHandler::abortConnection, shared_from_this()));
+                return;
+            }
+        }
+        catch (std::exception& e) {
+            std::cerr << "verifying AggregateCommandBatch " << acbPacket->requestID() << " failed: " << e.what() << std::endl;
+            strand_.post(boost::bind(&ConnectionHandler::abortConnection, shared_from_this()));
+            return;
+        }
+        
+        //from here on each batch is independent, as if it had come in its own packet
+        std::vector<boost::shared_ptr<std::vector<unsigned char> > > cbDatas = acbPacket->commandBatchesData();
+        for (unsigned int i=0; i<cbDatas.size(); i++) {
+            io_.post(boost::bind(&ConnectionHandler::processCommandBatch, shared_from_this(), acbPacket->requestID() + i, acbPacket->agentAddress(), cbDatas[i]));
+        }
+    }
+    
+    void processStartSession(boost::shared_ptr<networking::StartSessionPacket> ssPacket) {
+        std::cout << "Processing StartSession " << ssPacket->requestID() << "." << std::endl;
+        boost::shared_ptr<std::vector<unsigned char> > responseVch(new std::vector<unsigned char>());
+        std::vector<unsigned char> sessionKey;
+        try {
+            networking::StartSessionResponse response = processStartSessionPacket(ssPacket, &sessionKey);
+            response.writeToVch(responseVch.get());
+        }
+        catch (std::exception& e) {
+            std::cerr << "processing StartSession " << ssPacket->requestID() << " failed: " << e.what() << std::endl;
+            strand_.post(boost::bind(&ConnectionHandler::abortConnection, shared_from_this()));
+            return;
+        }
+        
+        strand_.post(boost::bind(&ConnectionHandler::openSession, shared_from_this(), ssPacket->agentAddress(), sessionKey, responseVch));
+    }
+    
+    //commandBatch packets (signed or session) end up here once authenticated
+    //write batches wait for a group commit if that's on; read-only ones go to
+    //the async connections if there are any; everything else is run straight
+    //away, as a group of one
+    void processCommandBatch(unsigned long requestID, std::string agentAddress, boost::shared_ptr<std::vector<unsigned char> > cbData) {
+        CommandBatchJob job;
+        job.requestID = requestID;
+        job.agentAddress = agentAddress;
+        job.done = boost::bind(&ConnectionHandler::finishCommandBatch, shared_from_this(), _1);
+        try {
+            unsigned char* dataPtr = cbData->data();
+            job.batch.reset(commands::Batch::consumeFromBuf(&dataPtr));
+        }
+        catch (std::exception& e) {
+            std::cerr << "decoding CommandBatch " << requestID << " failed: " << e.what() << std::endl;
+            strand_.post(boost::bind(&ConnectionHandler::abortConnection, shared_from_this()));
+            return;
+        }
+        
+        if (groupCommitter->enabled() && batchHasWrites(job.batch)) {
+            groupCommitter->submit(job);
+        }
+        else if (asyncDb != NULL && batchOnlyReadsWholeFiles(job.batch)) {
+            runReadOnlyBatchAsync(job);
+        }
+        else {
+            runCommandBatchGroup(std::vector<CommandBatchJob>(1, job));
+        }
+    }
+    
+    void finishCommandBatch(boost::shared_ptr<OutgoingResponse> response) {
+        if (response.get() == NULL) {
+            strand_.post(boost::bind(&ConnectionHandler::abortConnection, shared_from_this()));
+            return;
+        }
+        
+        strand_.post(boost::bind(&ConnectionHandler::queueResponse, shared_from_this(), response));
+    }
+    
+    void openSession(std::string agentAddress, std::vector<unsigned char> sessionKey, boost::shared_ptr<std::vector<unsigned char> > responseVch) {
+        //replaces any session already open on this connection
+        sessionOpen_ = true;
+        sessionAgentAddress_ = agentAddress;
+        sessionKey_ = sessionKey;
+        nextSessionSeq_ = 0;
+        
+        queueVchResponse(responseVch);
+    }
+    
+    void closeSocket() {
+        stopIdleTimer();
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+    }
+    
+    void abortConnection() {
+        //the client would wait forever on a response we can't produce, so hang up on it
+        packetsInFlight_--;
+        closeSocket();
+    }
+    
+    void queueVchResponse(boost::shared_ptr<std::vector<unsigned char> > responseVch) {
+        boost::shared_ptr<OutgoingResponse> response(new OutgoingResponse());
+        response->vch.swap(*responseVch);
+        queueResponse(response);
+    }
+    
+    void queueResponse(boost::shared_ptr<OutgoingResponse> response) {
+        packetsInFlight_--;
+        
+        bool writeInProgress = !writeQueue_.empty();
+        writeQueue_.push_back(response);
+        if (!writeInProgress) {
+            writeFrontResponse();
+        }
+    }
+    
+    void writeFrontResponse() {
+        std::cout << "Sending response." << std::endl;
+        
+        writeVchPlace_ = 0;
+        writeSplice_ = 0;
+        spanSent_ = 0;
+        writeResponsePiece();
+    }
+    
+    //the front response goes out a piece at a time: the vch up to the next
+    //splice, then that splice's span, straight from its file, and so on
+    void writeResponsePiece() {
+        OutgoingResponse& response = *(writeQueue_.front());
+        
+        size_t pieceEnd = writeSplice_ < response.splices.size() ? response.splices[writeSplice_].place : response.vch.size();
+        if (writeVchPlace_ < pieceEnd) {
+            boost::asio::async_write(socket_, boost::asio::buffer(response.vch.data() + writeVchPlace_, pieceEnd - writeVchPlace_), strand_.wrap(
+                boost::bind(&ConnectionHandler::handleWriteVchPiece, shared_from_this(), boost::asio::placeholders::error, pieceEnd)));
+        }
+        else if (writeSplice_ < response.splices.size()) {
+            sendSpan(boost::system::error_code());
+        }
+        else {
+            handleWriteResponse(boost::system::error_code());
+        }
+    }
+    
+    void handleWriteVchPiece(const boost::system::error_code& error, size_t pieceEnd) {
+        if (error) {
+            handleWriteResponse(error);
+            return;
+        }
+        
+        writeVchPlace_ = pieceEnd;
+        writeResponsePiece();
+    }
+    
+    //sendfile's from the span's file to the socket until it's all out, waiting
+    //for the socket to be writable whenever it fills up
+    void sendSpan(const boost::system::error_code& error) {
+        if (error) {
+            handleWriteResponse(error);
+            return;
+        }
+        
+        const commands::results::FileSpan& span = writeQueue_.front()->splices[writeSplice_].span;
+        
+        socket_.native_non_blocking(true);
+        while (spanSent_ < span.length) {
+            off_t offset = span.offset + spanSent_;
+            ssize_t sent = sendfile(socket_.native_handle(), span.file->fd(), &offset, span.length - spanSent_);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                socket_.async_write_some(boost::asio::null_buffers(), strand_.wrap(
+                    boost::bind(&ConnectionHandler::sendSpan, shared_from_this(), boost::asio::placeholders::error)));
+                return;
+            }
+            if (sent <= 0) {
+                //the file came up short
+                handleWriteResponse(boost::system::error_code(sent < 0 ? errno : EIO, boost::system::system_category()));
+                return;
+            }
+            spanSent_ += sent;
+        }
+        
+        writeSplice_++;
+        spanSent_ = 0;
+        writeResponsePiece();
+    }
+    
+    void handleWriteResponse(const boost::system::error_code& error) {
+        if (error) {
+            std::cerr << "writing response failed with error " << error << std::endl;
+            writeQueue_.clear();
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+            return;
+        }
+        
+        std::cout << "Response sent." << std::endl;
         std::cout << "Packet processed." << std::endl << std::endl;
+        
+        writeQueue_.pop_front();
+        if (!writeQueue_.empty()) {
+            writeFrontResponse();
+        }
+        
+        if (readPaused_) {
+            readPacketHeader();
+        }
+        else if (awaitingPacket_ && idle()) {
+            startIdleTimer();
+        }
     }
-
-private:
-    ConnectionHandler(boost::asio::io_service& io)
-      : socket_(io)
-    {}
 };
 
 class ListenServer {
     tcp::acceptor acceptor_;
+    boost::asio::io_service& verifyIo_;
     
 public:
-    ListenServer(boost::asio::io_service& io)
-      : acceptor_(io, tcp::endpoint(tcp::v4(), DEFAULT_SERVER_PORT))
+    ListenServer(boost::asio::io_service& io, boost::asio::io_service& verifyIo)
+      : acceptor_(io, tcp::endpoint(tcp::v4(), DEFAULT_SERVER_PORT)), verifyIo_(verifyIo)
     {
         startAccept();
     }
@@ -362,21 +1706,23 @@ public:
 private:
     void startAccept() {
         ConnectionHandler::pointer newConnectionHandler =
-          ConnectionHandler::create(acceptor_.get_io_service());
+          ConnectionHandler::create(acceptor_.get_io_service(), verifyIo_);
         
         acceptor_.async_accept(newConnectionHandler->socket(),
             boost::bind(&ListenServer::handleAccept, this, newConnectionHandler, boost::asio::placeholders::error));
     }
     
     void handleAccept(ConnectionHandler::pointer newConnectionHandler, const boost::system::error_code& error) {
+        //queue up the next accept first, so another worker thread can pick up
+        //the next connection while this one is being handled.
+        startAccept();
+        
         if (!error) {
             newConnectionHandler->start();
         }
         else {
             std::cerr << "accept (i think?) returned error code " << error << std::endl;
         }
-        
-        startAccept();
     }
 };
 
@@ -384,30 +1730,100 @@ void loadConfigVars() {
     boost::property_tree::ini_parser::read_ini("config.ini", config);
 }
 
+void runWorker(boost::asio::io_service& io) {
+    //an exception escaping a handler only takes down that connection;
+    //log it and go back to running the io_service.
+    while (true) {
+        try {
+            io.run();
+            break;
+        }
+        catch (std::exception& e) {
+            std::cerr << "worker caught exception: " << e.what() << std::endl;
+        }
+    }
+}
+
 int main() {
     std::cout << "Loading config... ";
     loadConfigVars();
     std::cout << "Done." << std::endl;
     
-    std::cout << "Preparing database connection... ";
-    database::prepareConnection(&dbConn);
-    std::cout << "Done." << std::endl << std::endl;
+    unsigned int numWorkers = config.get<unsigned int>("server.worker-threads");
+    if (numWorkers == 0) {
+        numWorkers = boost::thread::hardware_concurrency();
+    }
+    unsigned int numVerifiers = config.get<unsigned int>("server.verify-threads");
+    if (numVerifiers == 0) {
+        numVerifiers = boost::thread::hardware_concurrency();
+    }
+    
+    int creditsPerSatoshi = config.get<int>("general.credits-per-satoshi");
+    database::setFeeRates(config.get<double>("fees.store-file") * creditsPerSatoshi, config.get<double>("fees.store-byte") * creditsPerSatoshi);
+    
+    std::string blobStoreDir = config.get<std::string>("server.blob-store-dir");
+    if (!blobStoreDir.empty()) {
+        database::setBlobStore(new blobstore::BlobStore(blobStoreDir, config.get<unsigned long long>("server.blob-segment-size")));
+    }
+    
+    unsigned int dbPoolSize = config.get<unsigned int>("server.db-pool-size");
+    if (dbPoolSize == 0) {
+        dbPoolSize = numWorkers;
+    }
+    
+    verifierCache = new crypto::VerifierCache(config.get<size_t>("server.verifier-cache-size"), numWorkers * 4);
+    
+    size_t fileCacheBytes = config.get<size_t>("server.file-cache-bytes");
+    if (fileCacheBytes > 0) {
+        database::setFileCache(new database::FileCache(fileCacheBytes, numWorkers * 4));
+    }
+    
+    std::cout << "Opening " << dbPoolSize << " database connections... ";
+    dbPool = new database::ConnectionPool(dbPoolSize);
+    std::cout << "Done." << std::endl;
     
     try {
         boost::asio::io_service io;
+        boost::asio::io_service verifyIo;
+        //verifyIo only ever has work posted to it, so keep its threads from running out
+        boost::asio::io_service::work verifyWork(verifyIo);
+        
+        feeScheduler = new FeeScheduler();
+        boost::thread feeThread(boost::bind(&FeeScheduler::run, feeScheduler));
         
-        FeeHandler hs;
-        boost::thread hsThread(hs);
+        groupCommitter = new GroupCommitter(io);
+        
+        unsigned int numAsyncConns = config.get<unsigned int>("server.async-db-connections");
+        if (numAsyncConns > 0) {
+            std::cout << "Opening " << numAsyncConns << " async database connections... ";
+            asyncDb = new database::AsyncConnectionPool(io, numAsyncConns);
+            std::cout << "Done." << std::endl;
+        }
         
-        ListenServer ls(io);
+        ListenServer ls(io, verifyIo);
+        StatsReporter sr(io);
+        
+        std::cout << "Starting " << numWorkers << " worker threads and " << numVerifiers << " verifier threads." << std::endl << std::endl;
+        boost::thread_group workers;
+        for (unsigned int i=0; i<numWorkers; i++) {
+            workers.create_thread(boost::bind(&runWorker, boost::ref(io)));
+        }
+        for (unsigned int i=0; i<numVerifiers; i++) {
+            workers.create_thread(boost::bind(&runWorker, boost::ref(verifyIo)));
+        }
+        workers.join_all();
         
-        io.run();
+        //its sockets belong to io, so it goes first
+        delete asyncDb;
     }
     catch (std::exception& e) {
         std::cout << e.what() << std::endl;
     }
     
-    delete dbConn;
+    delete groupCommitter;
+    delete verifierCache;
+    delete database::fileCache();
+    delete dbPool;
     
     return 0;
 }
\ No newline at end of file
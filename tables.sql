@@ -1,5 +1,6 @@
 CREATE TABLE agents (
     agent_address character(34) NOT NULL,
+    key_type smallint NOT NULL DEFAULT 0,
     public_key bytea NOT NULL,
     default_pocket INT NOT NULL,
     PRIMARY KEY (agent_address)
@@ -10,6 +11,9 @@ CREATE TABLE pockets (
     owner character(34) REFERENCES agents(agent_address),
     amount bigint DEFAULT(0),
     deposit_address character(34),
+    file_count int NOT NULL DEFAULT 0,
+    total_bytes bigint NOT NULL DEFAULT 0,
+    fees_settled_at timestamptz NOT NULL DEFAULT now(),
     PRIMARY KEY (pocket_id)
 );
 
@@ -18,9 +22,37 @@ CREATE TABLE files (
     owner character(34) REFERENCES agents(agent_address),
     name varchar(256),
     pocket int NOT NULL REFERENCES pockets(pocket_id),
-    data bytea,
+    size int NOT NULL DEFAULT 0,
     PRIMARY KEY (file_id),
     UNIQUE (owner, name)
 );
 
+CREATE INDEX files_pocket ON files (pocket);
+
+CREATE TABLE blobs (
+    hash bytea NOT NULL,
+    segment int NOT NULL,
+    segment_offset bigint NOT NULL,
+    length int NOT NULL,
+    refcount int NOT NULL,
+    PRIMARY KEY (hash)
+);
+
+CREATE INDEX blobs_segment ON blobs (segment);
+CREATE INDEX blobs_dead ON blobs (hash) WHERE refcount = 0;
+
+CREATE TABLE file_data (
+    file_id int NOT NULL REFERENCES files(file_id) ON DELETE CASCADE,
+    blob_hash bytea REFERENCES blobs(hash),
+    PRIMARY KEY (file_id)
+);
+
+CREATE TABLE file_chunks (
+    file_id int NOT NULL REFERENCES files(file_id) ON DELETE CASCADE,
+    chunk_no int NOT NULL,
+    data bytea NOT NULL,
+    PRIMARY KEY (file_id, chunk_no)
+);
+ALTER TABLE file_chunks ALTER COLUMN data SET STORAGE PLAIN;
+
 ALTER TABLE agents ADD FOREIGN KEY (default_pocket) REFERENCES pockets(pocket_id);
\ No newline at end of file
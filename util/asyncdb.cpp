@@ -0,0 +1,381 @@
+#include "asyncdb.h"
+
+#include <map>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "database.h"
+#include "filecache.h"
+
+namespace database {
+
+AsyncQueryException::AsyncQueryException(std::string what) : runtime_error(what)
+{}
+
+AsyncConnection::AsyncConnection(boost::asio::io_service& io)
+: io_(io), strand_(io), socket_(io), conn_(NULL), busy_(false), needsReset_(false), outstanding_(0)
+{
+    connect();
+    if (PQstatus(conn_) != CONNECTION_OK) {
+        std::string error = PQerrorMessage(conn_);
+        PQfinish(conn_);
+        throw AsyncQueryException(error);
+    }
+}
+
+AsyncConnection::~AsyncConnection() {
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+    PQfinish(conn_);
+}
+
+void AsyncConnection::query(const std::string& sql, const std::vector<std::string>& params, AsyncQueryHandler handler) {
+    Query query;
+    query.sql = sql;
+    query.params = params;
+    query.handler = handler;
+
+    outstanding_++;
+    strand_.post(boost::bind(&AsyncConnection::enqueue, this, query));
+}
+
+size_t AsyncConnection::outstanding() {
+    return outstanding_;
+}
+
+//(re)opens conn_ and hands its socket to socket_. Connecting itself blocks, but
+//that only happens at startup and after the server drops us.
+void AsyncConnection::connect() {
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+
+    if (conn_ == NULL) {
+        conn_ = PQconnectdb(CONNECTION_STRING.c_str());
+    }
+    else {
+        PQreset(conn_);
+    }
+    if (PQstatus(conn_) != CONNECTION_OK) return;
+
+    needsReset_ = false;
+    PQsetnonblocking(conn_, 1);
+    //socket_ closes what it's given, and so does libpq, so give it its own descriptor
+    socket_.assign(dup(PQsocket(conn_)));
+}
+
+void AsyncConnection::enqueue(const Query& query) {
+    queue_.push_back(query);
+    startNext();
+}
+
+void AsyncConnection::startNext() {
+    if (busy_ || queue_.empty()) return;
+    busy_ = true;
+
+    if (needsReset_ || PQstatus(conn_) != CONNECTION_OK) {
+        connect();
+        if (PQstatus(conn_) != CONNECTION_OK) {
+            finishQuery(AsyncResult(), PQerrorMessage(conn_));
+            return;
+        }
+    }
+
+    const Query& query = queue_.front();
+    std::vector<const char*> values;
+    for (unsigned int i=0; i<query.params.size(); i++) {
+        values.push_back(query.params[i].c_str());
+    }
+
+    //text parameters, binary results
+    if (!PQsendQueryParams(conn_, query.sql.c_str(), values.size(), NULL, values.empty() ? NULL : &values[0], NULL, NULL, 1)) {
+        failConnection(PQerrorMessage(conn_));
+        return;
+    }
+
+    flush();
+}
+
+//a nonblocking connection may not get the whole query out at once
+void AsyncConnection::flush() {
+    int flushed = PQflush(conn_);
+    if (flushed < 0) {
+        failConnection(PQerrorMessage(conn_));
+    }
+    else if (flushed > 0) {
+        socket_.async_write_some(boost::asio::null_buffers(), strand_.wrap(boost::bind(&AsyncConnection::handleWritable, this, boost::asio::placeholders::error)));
+    }
+    else {
+        waitReadable();
+    }
+}
+
+void AsyncConnection::handleWritable(const boost::system::error_code& error) {
+    if (error) {
+        failConnection(error.message());
+        return;
+    }
+
+    flush();
+}
+
+void AsyncConnection::waitReadable() {
+    socket_.async_read_some(boost::asio::null_buffers(), strand_.wrap(boost::bind(&AsyncConnection::handleReadable, this, boost::asio::placeholders::error)));
+}
+
+void AsyncConnection::handleReadable(const boost::system::error_code& error) {
+    if (error) {
+        failConnection(error.message());
+        return;
+    }
+    if (!PQconsumeInput(conn_)) {
+        failConnection(PQerrorMessage(conn_));
+        return;
+    }
+
+    //a query can produce several results; keep the last, which is the one
+    //that matters for a single statement, until libpq says there are no more
+    while (!PQisBusy(conn_)) {
+        PGresult* result = PQgetResult(conn_);
+        if (result == NULL) {
+            AsyncResult finished = lastResult_;
+            lastResult_.reset();
+
+            if (finished.get() == NULL) {
+                finishQuery(AsyncResult(), "query returned no result");
+            }
+            else if (PQresultStatus(finished.get()) != PGRES_TUPLES_OK && PQresultStatus(finished.get()) != PGRES_COMMAND_OK) {
+                finishQuery(AsyncResult(), PQresultErrorMessage(finished.get()));
+            }
+            else {
+                finishQuery(finished, "");
+            }
+            return;
+        }
+        lastResult_.reset(result, PQclear);
+    }
+
+    waitReadable();
+}
+
+//libpq can't be trusted to be between queries after one of these, so the
+//connection is reset before it's used again
+void AsyncConnection::failConnection(std::string error) {
+    needsReset_ = true;
+    finishQuery(AsyncResult(), error);
+}
+
+void AsyncConnection::finishQuery(AsyncResult result, std::string error) {
+    Query query = queue_.front();
+    queue_.pop_front();
+    lastResult_.reset();
+    busy_ = false;
+    outstanding_--;
+
+    io_.post(boost::bind(query.handler, result, error));
+
+    startNext();
+}
+
+AsyncConnectionPool::AsyncConnectionPool(boost::asio::io_service& io, size_t size)
+: queries_(0)
+{
+    assert(size > 0);
+
+    for (size_t i=0; i<size; i++) {
+        conns_.push_back(new AsyncConnection(io));
+    }
+}
+
+AsyncConnectionPool::~AsyncConnectionPool() {
+    for (size_t i=0; i<conns_.size(); i++) {
+        delete conns_[i];
+    }
+}
+
+void AsyncConnectionPool::query(const std::string& sql, const std::vector<std::string>& params, AsyncQueryHandler handler) {
+    AsyncConnection* leastLoaded = conns_[0];
+    for (size_t i=1; i<conns_.size(); i++) {
+        if (conns_[i]->outstanding() < leastLoaded->outstanding()) {
+            leastLoaded = conns_[i];
+        }
+    }
+
+    queries_++;
+    leastLoaded->query(sql, params, handler);
+}
+
+size_t AsyncConnectionPool::size() {
+    return conns_.size();
+}
+
+size_t AsyncConnectionPool::outstanding() {
+    size_t total = 0;
+    for (size_t i=0; i<conns_.size(); i++) {
+        total += conns_[i]->outstanding();
+    }
+    return total;
+}
+
+unsigned long long AsyncConnectionPool::queries() {
+    return queries_;
+}
+
+long long getBinaryInt8(const PGresult* result, int row, int column) {
+    const unsigned char* value = (const unsigned char*)PQgetvalue(result, row, column);
+    unsigned long long n = 0;
+    for (int i=0; i<8; i++) {
+        n = (n << 8) | value[i];
+    }
+    return (long long)n;
+}
+
+const std::string READ_FILES_BY_ID_SQL = "SELECT file_data.file_id::int8, " + CHUNKED_FILE_DATA_SQL + ", "
+                                             "blobs.segment::int8, blobs.segment_offset::int8, blobs.length::int8 "
+                                         "FROM file_data JOIN files ON files.file_id = file_data.file_id "
+                                         "LEFT JOIN blobs ON blobs.hash = file_data.blob_hash "
+                                         "WHERE file_data.file_id = ANY($1::int8[])";
+
+//One readFilesByIDAsync() call, waiting on its own query and on any reads of
+//the same files (by other calls) that it joined instead. outstanding starts at
+//one, for the call itself, so the handler can't go off before everything's
+//been started.
+struct PendingFilesRead {
+    boost::mutex mutex;
+    FilesData filesData;
+    unsigned int outstanding;
+    std::string error;
+    boost::function<void (FilesData, std::string)> handler;
+};
+
+static void finishPendingPart(boost::shared_ptr<PendingFilesRead> pending, std::string error) {
+    bool done;
+    {
+        boost::mutex::scoped_lock lock(pending->mutex);
+        if (!error.empty() && pending->error.empty()) pending->error = error;
+        done = (--pending->outstanding == 0);
+    }
+    if (!done) return;
+
+    if (pending->error.empty()) {
+        pending->handler(pending->filesData, "");
+    }
+    else {
+        pending->handler(FilesData(pending->filesData.size()), pending->error);
+    }
+}
+
+static void handleJoinedRead(boost::shared_ptr<PendingFilesRead> pending, unsigned int position,
+                             bool ok, boost::shared_ptr<const FileContents> contents) {
+    if (ok) {
+        boost::mutex::scoped_lock lock(pending->mutex);
+        pending->filesData[position] = contents;
+    }
+    finishPendingPart(pending, ok ? "" : "a read of the same file failed");
+}
+
+//flights[i] is empty if there's no file cache
+static void handleFilesByIDResult(boost::shared_ptr<PendingFilesRead> pending, std::vector<unsigned long> fileIDs,
+                                  std::vector<unsigned int> positions, std::vector<FileCache::FlightPtr> flights,
+                                  AsyncResult result, std::string error) {
+    std::map<unsigned long, boost::shared_ptr<const FileContents> > found;
+    for (int row=0; result.get() != NULL && row < PQntuples(result.get()); row++) {
+        unsigned long fileID = getBinaryInt8(result.get(), row, 0);
+        boost::shared_ptr<FileContents> fileData;
+        if (PQgetisnull(result.get(), row, 2)) {
+            const unsigned char* data = (const unsigned char*)PQgetvalue(result.get(), row, 1);
+            fileData.reset(new FileContents());
+            fileData->spliced = false;
+            fileData->data.assign(data, data + PQgetlength(result.get(), row, 1));
+        }
+        else {
+            //from the page cache, usually, so not worth handing off to another thread
+            blobstore::BlobLocation location;
+            location.segment = getBinaryInt8(result.get(), row, 2);
+            location.offset = getBinaryInt8(result.get(), row, 3);
+            location.length = getBinaryInt8(result.get(), row, 4);
+            try {
+                if (blobStore() == NULL) throw blobstore::BlobStoreException("file data is in a blob store, but none is configured");
+                fileData = blobContents(location);
+            }
+            catch (blobstore::BlobStoreException& e) {
+                error = e.what();
+                result.reset();
+                break;
+            }
+        }
+        found[fileID] = fileData;
+    }
+
+    //a file with no row doesn't exist, and that's landed (and cached) too
+    bool ok = (result.get() != NULL);
+    for (unsigned int i=0; i<fileIDs.size(); i++) {
+        boost::shared_ptr<const FileContents> contents = ok ? found[fileIDs[i]] : boost::shared_ptr<const FileContents>();
+        if (flights[i].get() != NULL) fileCache()->land(flights[i], ok, contents);
+
+        boost::mutex::scoped_lock lock(pending->mutex);
+        pending->filesData[positions[i]] = contents;
+    }
+
+    finishPendingPart(pending, ok ? "" : error);
+}
+
+void readFilesByIDAsync(AsyncConnectionPool& pool, const std::vector<unsigned long>& fileIDs,
+                        boost::function<void (FilesData, std::string)> handler) {
+    boost::shared_ptr<PendingFilesRead> pending(new PendingFilesRead());
+    pending->filesData.resize(fileIDs.size());
+    pending->outstanding = 1;
+    pending->handler = handler;
+
+    //the files this leads the reads of, and where they go in filesData
+    std::vector<unsigned long> queryIDs;
+    std::vector<unsigned int> positions;
+    std::vector<FileCache::FlightPtr> flights;
+
+    for (unsigned int i=0; i<fileIDs.size(); i++) {
+        FileCache::FlightPtr flight;
+        if (fileCache() != NULL) {
+            boost::shared_ptr<const FileContents> contents;
+            {
+                boost::mutex::scoped_lock lock(pending->mutex);
+                pending->outstanding++;
+            }
+            FileCache::Lookup lookup = fileCache()->lookup(fileIDs[i], false, &contents, &flight,
+                                                           boost::bind(&handleJoinedRead, pending, i, _1, _2));
+            if (lookup == FileCache::LOOKUP_JOINED) continue;
+
+            boost::mutex::scoped_lock lock(pending->mutex);
+            pending->outstanding--;
+            if (lookup == FileCache::LOOKUP_HIT) {
+                pending->filesData[i] = contents;
+                continue;
+            }
+        }
+
+        queryIDs.push_back(fileIDs[i]);
+        positions.push_back(i);
+        flights.push_back(flight);
+    }
+
+    //all from the cache or other reads: no query
+    if (!queryIDs.empty()) {
+        std::string idArray = "{";
+        for (unsigned int i=0; i<queryIDs.size(); i++) {
+            if (i > 0) idArray += ",";
+            idArray += boost::lexical_cast<std::string>(queryIDs[i]);
+        }
+        idArray += "}";
+
+        {
+            boost::mutex::scoped_lock lock(pending->mutex);
+            pending->outstanding++;
+        }
+        pool.query(READ_FILES_BY_ID_SQL, std::vector<std::string>(1, idArray),
+                   boost::bind(&handleFilesByIDResult, pending, queryIDs, positions, flights, _1, _2));
+    }
+
+    finishPendingPart(pending, "");
+}
+
+}//namespace database
@@ -0,0 +1,104 @@
+#ifndef NETVEND_ASYNCDB_H
+#define NETVEND_ASYNCDB_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdexcept>
+#include <libpq-fe.h>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "database.h"
+
+namespace database {
+
+class AsyncQueryException : public std::runtime_error {
+public:
+    AsyncQueryException(std::string what);
+};
+
+//Results come back in binary format; see getBinaryInt8().
+typedef boost::shared_ptr<PGresult> AsyncResult;
+
+//Gets the result on success, or an empty pointer and a message on failure.
+//Called through io.post, never from inside the connection's strand.
+typedef boost::function<void (AsyncResult, std::string)> AsyncQueryHandler;
+
+//A raw libpq connection driven by the io_service instead of a blocked thread.
+//Queries are queued and sent one at a time (libpq allows only one in flight per
+//connection); while one runs, the connection's socket waits on the io_service
+//like any client socket, and no thread is tied up until results arrive.
+//
+//Queries run outside of any explicit transaction, so this is only for
+//single-statement reads.
+class AsyncConnection : boost::noncopyable {
+    struct Query {
+        std::string sql;
+        std::vector<std::string> params;
+        AsyncQueryHandler handler;
+    };
+
+    boost::asio::io_service& io_;
+    boost::asio::io_service::strand strand_;
+    boost::asio::posix::stream_descriptor socket_;
+    PGconn* conn_;
+
+    //everything below is only touched inside strand_
+    std::deque<Query> queue_;
+    bool busy_;
+    bool needsReset_;
+    AsyncResult lastResult_;
+
+    boost::atomic<size_t> outstanding_;
+public:
+    AsyncConnection(boost::asio::io_service& io);
+    ~AsyncConnection();
+
+    void query(const std::string& sql, const std::vector<std::string>& params, AsyncQueryHandler handler);
+
+    //queued plus running, for picking the least loaded connection
+    size_t outstanding();
+private:
+    void connect();
+    void enqueue(const Query& query);
+    void startNext();
+    void flush();
+    void handleWritable(const boost::system::error_code& error);
+    void waitReadable();
+    void handleReadable(const boost::system::error_code& error);
+    void failConnection(std::string error);
+    void finishQuery(AsyncResult result, std::string error);
+};
+
+//A fixed set of AsyncConnections sharing one io_service. Each query goes to
+//whichever connection has the least outstanding.
+class AsyncConnectionPool : boost::noncopyable {
+    std::vector<AsyncConnection*> conns_;
+    boost::atomic<unsigned long long> queries_;
+public:
+    AsyncConnectionPool(boost::asio::io_service& io, size_t size);
+    ~AsyncConnectionPool();
+
+    void query(const std::string& sql, const std::vector<std::string>& params, AsyncQueryHandler handler);
+
+    size_t size();
+    size_t outstanding();
+    unsigned long long queries();
+};
+
+//columns of a binary-format result
+long long getBinaryInt8(const PGresult* result, int row, int column);
+
+//The async counterpart of readFilesByID(): the files' data in the order asked
+//for, with an empty pointer for each that doesn't exist. Whatever isn't in the
+//file cache, or already being read by someone else, is fetched in one query.
+void readFilesByIDAsync(AsyncConnectionPool& pool, const std::vector<unsigned long>& fileIDs,
+                        boost::function<void (FilesData, std::string)> handler);
+
+}//namespace database
+
+#endif
@@ -0,0 +1,184 @@
+#include "blobstore.h"
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cryptopp/sha.h>
+
+namespace blobstore {
+
+BlobStoreException::BlobStoreException(std::string what) : runtime_error(what)
+{}
+
+static BlobStoreException systemError(std::string what, std::string path) {
+    return BlobStoreException(what + " " + path + ": " + strerror(errno));
+}
+
+std::vector<unsigned char> blobHash(const unsigned char* data, unsigned int length) {
+    std::vector<unsigned char> hash(CryptoPP::SHA256::DIGESTSIZE);
+    CryptoPP::SHA256().CalculateDigest(hash.data(), data, length);
+    return hash;
+}
+
+BlobStore::BlobStore(std::string dir, unsigned long long maxSegmentSize)
+: dir_(dir), maxSegmentSize_(maxSegmentSize), currentSegment_(0), currentSize_(0)
+{
+    DIR* dirHandle = opendir(dir_.c_str());
+    if (dirHandle == NULL) {
+        throw systemError("opening blob store", dir_);
+    }
+
+    unsigned int lastSegment = 0;
+    while (struct dirent* entry = readdir(dirHandle)) {
+        unsigned int segment;
+        if (sscanf(entry->d_name, "segment-%u.dat", &segment) == 1) {
+            sealedSegments_.insert(segment);
+            if (segment > lastSegment) lastSegment = segment;
+        }
+    }
+    closedir(dirHandle);
+
+    startSegment(lastSegment + 1);
+}
+
+BlobStore::~BlobStore()
+{}
+
+std::string BlobStore::segmentPath(unsigned int segment) {
+    char name[32];
+    snprintf(name, sizeof(name), "segment-%08u.dat", segment);
+    return dir_ + "/" + name;
+}
+
+//with mutex_ held, or from the constructor
+void BlobStore::startSegment(unsigned int segment) {
+    std::string path = segmentPath(segment);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        throw systemError("creating segment", path);
+    }
+
+    if (currentFile_) {
+        sealedSegments_.insert(currentSegment_);
+    }
+    currentFile_.reset(new SegmentFile(fd));
+    currentSegment_ = segment;
+    currentSize_ = 0;
+}
+
+BlobLocation BlobStore::append(const unsigned char* data, unsigned int length) {
+    BlobLocation location;
+    boost::shared_ptr<SegmentFile> file;
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (currentSize_ > 0 && currentSize_ + length > maxSegmentSize_) {
+            startSegment(currentSegment_ + 1);
+        }
+
+        location.segment = currentSegment_;
+        location.offset = currentSize_;
+        location.length = length;
+        currentSize_ += length;
+        file = currentFile_;
+        unlockedAppends_[location.segment]++;
+    }
+
+    unsigned int written = 0;
+    while (written < length) {
+        ssize_t n = pwrite(file->fd(), data + written, length - written, location.offset + written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            //the space taken is left unused; nothing will point into it
+            BlobStoreException error = systemError("writing to segment", segmentPath(location.segment));
+            appendLocked(location.segment);
+            throw error;
+        }
+        written += n;
+    }
+    //an fdatasync flushes whatever other appends have written by then too, so
+    //appends syncing at once mostly wait on the same flush
+    if (fdatasync(file->fd()) != 0) {
+        BlobStoreException error = systemError("syncing segment", segmentPath(location.segment));
+        appendLocked(location.segment);
+        throw error;
+    }
+
+    return location;
+}
+
+void BlobStore::appendLocked(unsigned int segment) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::map<unsigned int, unsigned int>::iterator it = unlockedAppends_.find(segment);
+    if (--(it->second) == 0) unlockedAppends_.erase(it);
+}
+
+//with mutex_ held
+boost::shared_ptr<SegmentFile> BlobStore::readFile(unsigned int segment) {
+    std::map<unsigned int, boost::shared_ptr<SegmentFile> >::iterator it = readFiles_.find(segment);
+    if (it != readFiles_.end()) return it->second;
+
+    std::string path = segmentPath(segment);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw systemError("opening segment", path);
+    }
+    boost::shared_ptr<SegmentFile> file(new SegmentFile(fd));
+    readFiles_[segment] = file;
+    return file;
+}
+
+boost::shared_ptr<SegmentFile> BlobStore::segmentFile(unsigned int segment) {
+    boost::mutex::scoped_lock lock(mutex_);
+    return readFile(segment);
+}
+
+std::vector<unsigned char> BlobStore::read(const BlobLocation& location) {
+    //held until the read is done, in case the segment is removed meanwhile
+    boost::shared_ptr<SegmentFile> file = segmentFile(location.segment);
+
+    //pread doesn't move the descriptor's offset, so readers can share it
+    std::vector<unsigned char> data(location.length);
+    unsigned int done = 0;
+    while (done < location.length) {
+        ssize_t n = pread(file->fd(), data.data() + done, location.length - done, location.offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw systemError("reading segment", segmentPath(location.segment));
+        }
+        done += n;
+    }
+    return data;
+}
+
+std::vector<unsigned int> BlobStore::removableSegments() {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    //A sealed segment gets no new appends, so once none are left waiting on
+    //their transactions to lock it, only those transactions' locks tell
+    //whether anything could still come to point into it.
+    std::vector<unsigned int> segments;
+    for (std::set<unsigned int>::iterator it = sealedSegments_.begin(); it != sealedSegments_.end(); it++) {
+        if (unlockedAppends_.count(*it) == 0) segments.push_back(*it);
+    }
+    return segments;
+}
+
+void BlobStore::removeSegment(unsigned int segment) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    //closed once any reads still using it are done
+    readFiles_.erase(segment);
+    sealedSegments_.erase(segment);
+
+    std::string path = segmentPath(segment);
+    if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+        throw systemError("removing segment", path);
+    }
+}
+
+}//namespace blobstore
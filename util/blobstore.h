@@ -0,0 +1,93 @@
+#ifndef NETVEND_BLOBSTORE_H
+#define NETVEND_BLOBSTORE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <unistd.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace blobstore {
+
+const unsigned int BLOB_HASH_SIZE = 32;
+
+class BlobStoreException : public std::runtime_error {
+public:
+    BlobStoreException(std::string what);
+};
+
+//where a blob's bytes are; kept in the database's blobs table, keyed by hash
+struct BlobLocation {
+    unsigned int segment;
+    unsigned long long offset;
+    unsigned int length;
+};
+
+std::vector<unsigned char> blobHash(const unsigned char* data, unsigned int length);
+
+//An open segment file, closed once the last shared_ptr to it goes. Removing
+//a segment only lets go of the store's own, so a read or a response span
+//still using the file finishes on it, and its descriptor can't be handed out
+//again meanwhile.
+class SegmentFile : boost::noncopyable {
+    int fd_;
+public:
+    explicit SegmentFile(int fd) : fd_(fd) {}
+    ~SegmentFile() { close(fd_); }
+    int fd() const { return fd_; }
+};
+
+//File payloads kept on local disk instead of in the database. Blobs are
+//appended to the current segment file in dir until it reaches maxSegmentSize,
+//when it's sealed and a new one started; nothing in a segment is ever
+//rewritten. Which blob (by content hash) is where, and how many files use it,
+//is up to the database: see the blobs table, and collectBlobGarbage() for how
+//segments are removed once nothing in them is used.
+class BlobStore : boost::noncopyable {
+    std::string dir_;
+    unsigned long long maxSegmentSize_;
+
+    boost::mutex mutex_;
+    unsigned int currentSegment_;
+    //shared with appends still writing to it, which may outlast it being current
+    boost::shared_ptr<SegmentFile> currentFile_;
+    //including space taken by appends still being written
+    unsigned long long currentSize_;
+    std::set<unsigned int> sealedSegments_;
+    //appends (by segment) whose transactions don't hold the segment's lock yet
+    std::map<unsigned int, unsigned int> unlockedAppends_;
+    //opened on first read and kept until the segment is removed
+    std::map<unsigned int, boost::shared_ptr<SegmentFile> > readFiles_;
+public:
+    //every segment already in dir is sealed; appends go to a new one
+    BlobStore(std::string dir, unsigned long long maxSegmentSize);
+    ~BlobStore();
+
+    //The blob is on disk (and synced) by the time this returns. Only taking
+    //the space is done under the mutex, so appends write and sync side by side.
+    //Its segment isn't offered for removal until appendLocked() is called for
+    //it, once the appending transaction holds the segment's lock.
+    BlobLocation append(const unsigned char* data, unsigned int length);
+    void appendLocked(unsigned int segment);
+    std::vector<unsigned char> read(const BlobLocation& location);
+    //for reading the segment directly (with pread or sendfile)
+    boost::shared_ptr<SegmentFile> segmentFile(unsigned int segment);
+
+    //Sealed segments that could be removed, if nothing in them is still used.
+    //Any transaction that appended to one and could still commit a reference
+    //into it holds its lock (see collectBlobGarbage()).
+    std::vector<unsigned int> removableSegments();
+    void removeSegment(unsigned int segment);
+private:
+    std::string segmentPath(unsigned int segment);
+    void startSegment(unsigned int segment);
+    boost::shared_ptr<SegmentFile> readFile(unsigned int segment);
+};
+
+}//namespace blobstore
+
+#endif
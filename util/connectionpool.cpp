@@ -0,0 +1,96 @@
+#include "connectionpool.h"
+
+#include <boost/chrono.hpp>
+
+namespace database {
+
+ConnectionPool::ConnectionPool(size_t size)
+: size_(size), peakInUse_(0), leases_(0), waits_(0), waitMicros_(0)
+{
+    assert(size_ > 0);
+    
+    for (size_t i=0; i<size_; i++) {
+        pqxx::connection* conn;
+        prepareConnection(&conn);
+        idle_.push_back(conn);
+    }
+}
+
+ConnectionPool::~ConnectionPool() {
+    //every lease should have been returned by now
+    for (size_t i=0; i<idle_.size(); i++) {
+        delete idle_[i];
+    }
+}
+
+pqxx::connection* ConnectionPool::acquire() {
+    boost::mutex::scoped_lock lock(mutex_);
+    
+    leases_++;
+    if (idle_.empty()) {
+        waits_++;
+        boost::chrono::steady_clock::time_point waitStart = boost::chrono::steady_clock::now();
+        while (idle_.empty()) {
+            released_.wait(lock);
+        }
+        waitMicros_ += boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - waitStart).count();
+    }
+    
+    pqxx::connection* conn = idle_.back();
+    idle_.pop_back();
+    
+    if (size_ - idle_.size() > peakInUse_) peakInUse_ = size_ - idle_.size();
+    
+    return conn;
+}
+
+//a connection the database dropped can go back in as is: pqxx reconnects it,
+//and re-prepares its statements, the next time it's used.
+void ConnectionPool::release(pqxx::connection* conn) {
+    boost::mutex::scoped_lock lock(mutex_);
+    idle_.push_back(conn);
+    released_.notify_one();
+}
+
+size_t ConnectionPool::size() {
+    return size_;
+}
+
+size_t ConnectionPool::inUse() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return size_ - idle_.size();
+}
+
+size_t ConnectionPool::peakInUse() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return peakInUse_;
+}
+
+unsigned long long ConnectionPool::leases() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return leases_;
+}
+
+unsigned long long ConnectionPool::waits() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return waits_;
+}
+
+unsigned long long ConnectionPool::waitMicros() {
+    boost::mutex::scoped_lock lock(mutex_);
+    return waitMicros_;
+}
+
+ConnectionLease::ConnectionLease(ConnectionPool& pool)
+: pool_(pool), conn_(pool.acquire())
+{}
+
+ConnectionLease::~ConnectionLease() {
+    pool_.release(conn_);
+}
+
+pqxx::connection* ConnectionLease::get() {
+    return conn_;
+}
+
+}//namespace database
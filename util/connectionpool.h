@@ -0,0 +1,54 @@
+#ifndef NETVEND_CONNECTIONPOOL_H
+#define NETVEND_CONNECTIONPOOL_H
+
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/noncopyable.hpp>
+#include <pqxx/pqxx>
+
+#include "util/database.h"
+
+namespace database {
+
+//A fixed number of connections, each opened and prepared with
+//prepareConnection(). Work that needs the database leases one for as long as
+//it runs (see ConnectionLease) and waits if they're all out.
+class ConnectionPool : boost::noncopyable {
+    boost::mutex mutex_;
+    boost::condition_variable released_;
+    std::vector<pqxx::connection*> idle_;
+    size_t size_;
+    
+    //stats, under mutex_
+    size_t peakInUse_;
+    unsigned long long leases_;
+    unsigned long long waits_;
+    unsigned long long waitMicros_;
+public:
+    ConnectionPool(size_t size);
+    ~ConnectionPool();
+    pqxx::connection* acquire();
+    void release(pqxx::connection* conn);
+    
+    size_t size();
+    size_t inUse();
+    size_t peakInUse();
+    unsigned long long leases();
+    unsigned long long waits();
+    unsigned long long waitMicros();
+};
+
+//Holds a connection from the pool until it goes out of scope.
+class ConnectionLease : boost::noncopyable {
+    ConnectionPool& pool_;
+    pqxx::connection* conn_;
+public:
+    ConnectionLease(ConnectionPool& pool);
+    ~ConnectionLease();
+    pqxx::connection* get();
+};
+
+}//namespace database
+
+#endif
@@ -2,22 +2,76 @@
 
 namespace crypto {
 
+UnknownKeyTypeException::UnknownKeyTypeException(unsigned char keyType)
+: std::runtime_error("unknown agent key type " + boost::lexical_cast<std::string>((int)keyType))
+{}
+
+KeyAgreementException::KeyAgreementException()
+: std::runtime_error("x25519 key agreement failed; bad session pubkey")
+{}
+
+AgentPubkey::AgentPubkey()
+: keyType_(KEYTYPE_RSA)
+{}
+
+AgentPubkey::AgentPubkey(unsigned char keyType, const std::vector<unsigned char> &encoded)
+: keyType_(keyType), encoded_(encoded)
+{
+    assert(encoded_.size() == pubkeySizeForKeyType(keyType_));
+}
+
+AgentPubkey::AgentPubkey(const RSAPubkey &pubkey)
+: keyType_(KEYTYPE_RSA), encoded_(encodePubkey(pubkey))
+{}
+
+unsigned char AgentPubkey::keyType() const {return keyType_;}
+
+const std::vector<unsigned char>& AgentPubkey::encoded() const {return encoded_;}
+
+size_t pubkeySizeForKeyType(unsigned char keyType) {
+    if (keyType == KEYTYPE_RSA) {
+        return DERENCODED_PUBKEY_SIZE;
+    }
+    else if (keyType == KEYTYPE_ED25519) {
+        return ED25519_PUBKEY_SIZE;
+    }
+    throw UnknownKeyTypeException(keyType);
+}
+
+size_t sigSizeForKeyType(unsigned char keyType) {
+    if (keyType == KEYTYPE_RSA) {
+        return MAX_SIG_SIZE;
+    }
+    else if (keyType == KEYTYPE_ED25519) {
+        return ED25519_SIG_SIZE;
+    }
+    throw UnknownKeyTypeException(keyType);
+}
+
 std::string RSAPubkeyToNetvendAddress(RSAPubkey pubkey) {
-    std::string pubkeyString;
+    return agentPubkeyToNetvendAddress(AgentPubkey(pubkey));
+}
+
+//the address is the hash of the encoded key, whatever its type. For RSA keys
+//that is the DER encoding, so existing RSA addresses are unchanged.
+std::string agentPubkeyToNetvendAddress(const AgentPubkey &pubkey) {
+    std::vector<unsigned char> addressVch(1 + CryptoPP::RIPEMD160::DIGESTSIZE);
+    addressVch[0] = AGENT_ADDRESS_VERSION_BYTE;
+    
     CryptoPP::RIPEMD160 hash;
-    pubkey.DEREncode(CryptoPP::StringSink(pubkeyString).Ref());
-    std::string hashedPubkeyString;
-    CryptoPP::StringSource(pubkeyString, true, new CryptoPP::HashFilter(hash, new CryptoPP::StringSink(hashedPubkeyString)));
-    std::vector<unsigned char> pubkeyVChr;
-    std::copy_n(hashedPubkeyString.begin(), hashedPubkeyString.size(), back_inserter(pubkeyVChr));
-    pubkeyVChr.insert(pubkeyVChr.begin(), AGENT_ADDRESS_VERSION_BYTE);
-    return EncodeBase58Check(pubkeyVChr);
+    hash.CalculateDigest(addressVch.data() + 1, pubkey.encoded().data(), pubkey.encoded().size());
+    
+    return EncodeBase58Check(addressVch);
 }
 
 std::vector<unsigned char> cryptoSign(std::vector<unsigned char> &dataVch, RSAPrivkey &privkey, CryptoPP::AutoSeededRandomPool &rng) {
     CryptoPP::RSASSA_PKCS1v15_SHA_Signer signer(privkey);
+    assert(signer.MaxSignatureLength() == MAX_SIG_SIZE);
+    return cryptoSign(dataVch, signer, rng);
+}
+
+std::vector<unsigned char> cryptoSign(std::vector<unsigned char> &dataVch, const SigSigner &signer, CryptoPP::AutoSeededRandomPool &rng) {
     size_t maxSize = signer.MaxSignatureLength();
-    assert(maxSize == MAX_SIG_SIZE);
     std::vector<unsigned char> sig(maxSize);
     size_t size = signer.SignMessage(rng, dataVch.data(), dataVch.size(), sig.data());
     sig.resize(size);
@@ -25,10 +79,115 @@ std::vector<unsigned char> cryptoSign(std::vector<unsigned char> &dataVch, RSAPr
 }
 
 bool verifySig(const RSAPubkey &pubkey, const std::vector<unsigned char> &dataVch, const std::vector<unsigned char> &sig) {
-    CryptoPP::RSASSA_PKCS1v15_SHA_Verifier verifier(pubkey);
+    RSAVerifier verifier(pubkey);
+    return verifySig(verifier, dataVch, sig);
+}
+
+bool verifySig(const SigVerifier &verifier, const std::vector<unsigned char> &dataVch, const std::vector<unsigned char> &sig) {
     return verifier.VerifyMessage(dataVch.data(), dataVch.size(), sig.data(), sig.size());
 }
 
+SigVerifier* newVerifier(const AgentPubkey &pubkey) {
+    if (pubkey.keyType() == KEYTYPE_RSA) {
+        return new RSAVerifier(decodePubkey(pubkey.encoded().data(), pubkey.encoded().size()));
+    }
+    else if (pubkey.keyType() == KEYTYPE_ED25519) {
+        return new CryptoPP::ed25519Verifier(pubkey.encoded().data());
+    }
+    throw UnknownKeyTypeException(pubkey.keyType());
+}
+
+std::vector<unsigned char> merkleRoot(const std::vector<boost::shared_ptr<std::vector<unsigned char> > > &leaves) {
+    static const unsigned char LEAF_PREFIX = 0x00;
+    static const unsigned char NODE_PREFIX = 0x01;
+    
+    assert(leaves.size() > 0);
+    
+    std::vector<std::vector<unsigned char> > level;
+    for (unsigned int i=0; i<leaves.size(); i++) {
+        std::vector<unsigned char> digest(CryptoPP::SHA256::DIGESTSIZE);
+        CryptoPP::SHA256 hash;
+        hash.Update(&LEAF_PREFIX, 1);
+        hash.Update(leaves[i]->data(), leaves[i]->size());
+        hash.Final(digest.data());
+        level.push_back(digest);
+    }
+    
+    while (level.size() > 1) {
+        std::vector<std::vector<unsigned char> > nextLevel;
+        for (unsigned int i=0; i+1 < level.size(); i+=2) {
+            std::vector<unsigned char> digest(CryptoPP::SHA256::DIGESTSIZE);
+            CryptoPP::SHA256 hash;
+            hash.Update(&NODE_PREFIX, 1);
+            hash.Update(level[i].data(), level[i].size());
+            hash.Update(level[i+1].data(), level[i+1].size());
+            hash.Final(digest.data());
+            nextLevel.push_back(digest);
+        }
+        if (level.size() % 2 == 1) {
+            nextLevel.push_back(level.back());
+        }
+        level.swap(nextLevel);
+    }
+    
+    return level[0];
+}
+
+void generateSessionKeypair(CryptoPP::AutoSeededRandomPool &rng, std::vector<unsigned char>* privkey, std::vector<unsigned char>* pubkey) {
+    CryptoPP::x25519 x;
+    privkey->resize(x.PrivateKeyLength());
+    pubkey->resize(x.PublicKeyLength());
+    assert(pubkey->size() == SESSION_PUBKEY_SIZE);
+    
+    x.GenerateKeyPair(rng, privkey->data(), pubkey->data());
+}
+
+std::vector<unsigned char> deriveSessionKey(const std::vector<unsigned char> &ourPrivkey, const std::vector<unsigned char> &clientPubkey, const std::vector<unsigned char> &serverPubkey, bool weAreClient) {
+    assert(clientPubkey.size() == SESSION_PUBKEY_SIZE && serverPubkey.size() == SESSION_PUBKEY_SIZE);
+    
+    CryptoPP::x25519 x;
+    std::vector<unsigned char> shared(x.AgreedValueLength());
+    const std::vector<unsigned char> &theirPubkey = weAreClient ? serverPubkey : clientPubkey;
+    if (!x.Agree(shared.data(), ourPrivkey.data(), theirPubkey.data())) {
+        throw KeyAgreementException();
+    }
+    
+    //salt with both pubkeys, so the key is tied to this exchange
+    std::vector<unsigned char> salt(clientPubkey);
+    salt.insert(salt.end(), serverPubkey.begin(), serverPubkey.end());
+    
+    static const std::string info = "netvend session key";
+    
+    std::vector<unsigned char> sessionKey(SESSION_KEY_SIZE);
+    CryptoPP::HKDF<CryptoPP::SHA256> hkdf;
+    hkdf.DeriveKey(sessionKey.data(), sessionKey.size(),
+                   shared.data(), shared.size(),
+                   salt.data(), salt.size(),
+                   (const unsigned char*)info.data(), info.size());
+    return sessionKey;
+}
+
+std::vector<unsigned char> sessionMAC(const std::vector<unsigned char> &sessionKey, unsigned long long seq, const std::vector<unsigned char> &dataVch) {
+    unsigned char seqbuf[PACK_Q_SIZE];
+    pack(seqbuf, "Q", seq);
+    
+    CryptoPP::HMAC<CryptoPP::SHA256> hmac(sessionKey.data(), sessionKey.size());
+    hmac.Update(seqbuf, PACK_Q_SIZE);
+    hmac.Update(dataVch.data(), dataVch.size());
+    
+    std::vector<unsigned char> mac(SESSION_MAC_SIZE);
+    hmac.Final(mac.data());
+    return mac;
+}
+
+bool verifySessionMAC(const std::vector<unsigned char> &sessionKey, unsigned long long seq, const std::vector<unsigned char> &dataVch, const std::vector<unsigned char> &mac) {
+    if (mac.size() != SESSION_MAC_SIZE) return false;
+    
+    std::vector<unsigned char> expected = sessionMAC(sessionKey, seq, dataVch);
+    //constant time, so a forger can't learn the tag byte by byte
+    return CryptoPP::VerifyBufsEqual(expected.data(), mac.data(), SESSION_MAC_SIZE);
+}
+
 std::vector<unsigned char> encodePubkey(RSAPubkey pubkey) {
     CryptoPP::ByteQueue bq;
     pubkey.DEREncode(bq);
@@ -51,4 +210,4 @@ RSAPubkey decodePubkey(const unsigned char* pubkeyData, size_t pubkeySize) {
     return pubkey;
 }
 
-}//namespace crypto
\ No newline at end of file
+}//namespace crypto
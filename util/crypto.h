@@ -3,30 +3,93 @@
 
 #include <cryptopp/osrng.h>
 #include <cryptopp/rsa.h>
+#include <cryptopp/xed25519.h>
 //#include <cryptopp/files.h>
 //#include <cryptopp/base64.h>
 //#include <cryptopp/hex.h>
 #include <cryptopp/ripemd.h>
+#include <cryptopp/sha.h>
+#include <cryptopp/hmac.h>
+#include <cryptopp/hkdf.h>
+#include <cryptopp/misc.h>
 #include <string>
+#include <vector>
+#include <stdexcept>
+#include <boost/shared_ptr.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include "netvend/common_constants.h"
 #include "util/b58check.h"
+#include "util/pack.h"
 
 namespace crypto {
     
 typedef CryptoPP::RSA::PublicKey RSAPubkey;
 typedef CryptoPP::RSA::PrivateKey RSAPrivkey;
+typedef CryptoPP::RSASSA_PKCS1v15_SHA_Verifier RSAVerifier;
+typedef CryptoPP::PK_Verifier SigVerifier;
+typedef CryptoPP::PK_Signer SigSigner;
+
+class UnknownKeyTypeException : public std::runtime_error {
+public:
+    UnknownKeyTypeException(unsigned char keyType);
+};
+
+class KeyAgreementException : public std::runtime_error {
+public:
+    KeyAgreementException();
+};
+
+//An agent's public key as it goes over the wire and into the agents table:
+//its key type plus the key's encoding (DER for RSA, the raw 32 bytes for ed25519).
+class AgentPubkey {
+    unsigned char keyType_;
+    std::vector<unsigned char> encoded_;
+public:
+    AgentPubkey();
+    AgentPubkey(unsigned char keyType, const std::vector<unsigned char> &encoded);
+    AgentPubkey(const RSAPubkey &pubkey);
+    unsigned char keyType() const;
+    const std::vector<unsigned char>& encoded() const;
+};
+
+size_t pubkeySizeForKeyType(unsigned char keyType);
+size_t sigSizeForKeyType(unsigned char keyType);
 
 std::string RSAPubkeyToNetvendAddress(RSAPubkey pubkey);
+std::string agentPubkeyToNetvendAddress(const AgentPubkey &pubkey);
 
 std::vector<unsigned char> cryptoSign(std::vector<unsigned char> &dataVch, RSAPrivkey &privkey, CryptoPP::AutoSeededRandomPool &rng);
+std::vector<unsigned char> cryptoSign(std::vector<unsigned char> &dataVch, const SigSigner &signer, CryptoPP::AutoSeededRandomPool &rng);
 
 bool verifySig(const RSAPubkey &pubkey, const std::vector<unsigned char> &dataVch, const std::vector<unsigned char> &sig);
 
+//a verifier only reads its key while verifying, so one can be shared between threads
+bool verifySig(const SigVerifier &verifier, const std::vector<unsigned char> &dataVch, const std::vector<unsigned char> &sig);
+
+//builds a verifier of the right kind for the pubkey's key type; the caller owns it
+SigVerifier* newVerifier(const AgentPubkey &pubkey);
+
+//Root of a SHA256 Merkle tree over leaves, in order. Leaves and interior
+//nodes are hashed with different prefix bytes so one can't pass for the
+//other; a node without a sibling is carried up to the next level as is.
+std::vector<unsigned char> merkleRoot(const std::vector<boost::shared_ptr<std::vector<unsigned char> > > &leaves);
+
+//Session mode. The client and server swap x25519 ephemeral pubkeys (the
+//client's signed with its agent key) and both derive the same session key,
+//which then authenticates each batch with an HMAC over its sequence number.
+void generateSessionKeypair(CryptoPP::AutoSeededRandomPool &rng, std::vector<unsigned char>* privkey, std::vector<unsigned char>* pubkey);
+
+std::vector<unsigned char> deriveSessionKey(const std::vector<unsigned char> &ourPrivkey, const std::vector<unsigned char> &clientPubkey, const std::vector<unsigned char> &serverPubkey, bool weAreClient);
+
+std::vector<unsigned char> sessionMAC(const std::vector<unsigned char> &sessionKey, unsigned long long seq, const std::vector<unsigned char> &dataVch);
+
+bool verifySessionMAC(const std::vector<unsigned char> &sessionKey, unsigned long long seq, const std::vector<unsigned char> &dataVch, const std::vector<unsigned char> &mac);
+
 std::vector<unsigned char> encodePubkey(RSAPubkey pubkey);
 
 RSAPubkey decodePubkey(const unsigned char* pubkeyData, size_t pubkeySize);
 
 }//namespace crypto
 
-#endif
\ No newline at end of file
+#endif
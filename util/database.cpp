@@ -1,5 +1,11 @@
 #include "database.h"
 
+#include <set>
+#include <algorithm>
+#include <boost/bind.hpp>
+
+#include "filecache.h"
+
 namespace database {
 
 NoRowFoundException::NoRowFoundException() : runtime_error("no row found")
@@ -8,30 +14,77 @@ NoRowFoundException::NoRowFoundException() : runtime_error("no row found")
 DuplicateUniqueValueException::DuplicateUniqueValueException() : runtime_error("tried inserting duplicate unique value")
 {}
 
+static blobstore::BlobStore* blobStore_ = NULL;
+
+void setBlobStore(blobstore::BlobStore* store) {
+    blobStore_ = store;
+}
+
+blobstore::BlobStore* blobStore() {
+    return blobStore_;
+}
+
+static FileCache* fileCache_ = NULL;
+
+void setFileCache(FileCache* cache) {
+    fileCache_ = cache;
+}
+
+FileCache* fileCache() {
+    return fileCache_;
+}
+
+static double creditsPerFileSecond_ = 0;
+static double creditsPerByteSecond_ = 0;
+
+void setFeeRates(double creditsPerFileSecond, double creditsPerByteSecond) {
+    creditsPerFileSecond_ = creditsPerFileSecond;
+    creditsPerByteSecond_ = creditsPerByteSecond;
+}
+
+//The fee SQL below is written against an unqualified pockets row.
+
+//credits per second the pocket is paying
+static std::string feeRateSQL() {
+    return "(file_count * " + boost::lexical_cast<std::string>(creditsPerFileSecond_) + "::float8 + "
+           "total_bytes * " + boost::lexical_cast<std::string>(creditsPerByteSecond_) + "::float8)";
+}
+
+//fees accrued since they were last settled, whether or not the pocket can pay them
+static std::string accruedFeesSQL() {
+    return "FLOOR(EXTRACT(EPOCH FROM now() - fees_settled_at)::float8 * " + feeRateSQL() + ")::bigint";
+}
+
+//what settling takes from the pocket
+static std::string owedFeesSQL() {
+    return "LEAST(amount, " + accruedFeesSQL() + ")";
+}
+
 void prepareConnection(pqxx::connection **dbConn) {
     //std::cout << "connecting to database..." << std::endl;
-    (*dbConn) = new pqxx::connection("dbname=netvend user=netvend password=badpass");
+    (*dbConn) = new pqxx::connection(CONNECTION_STRING);
     //std::cout << "connected." << std::endl;
     
     //std::cout << "peparing queries..." << std::endl;
     
-    (*dbConn)->prepare(FETCH_FILE_FEES_SUPPORTED_PER_POCKET, "SELECT "
-                                                                "sub.pocket AS pocket_id, "
-                                                                "sub.total_fees AS total_fees, "
-                                                                "(pockets.amount - sub.total_fees < 0) AS would_bankrupt "
-                                                             "FROM ("
-                                                                "SELECT "
-                                                                    "pocket, COUNT(*)*$1 + SUM(COALESCE(OCTET_LENGTH(data),0))*$2 AS total_fees "
-                                                                "FROM files "
-                                                                "GROUP BY pocket "
-                                                             ")"
-                                                                "AS sub "
-                                                             "LEFT JOIN pockets ON sub.pocket = pockets.pocket_id;"
-               );
-    
     (*dbConn)->prepare(CHECK_AGENT_EXISTS, "SELECT EXISTS(SELECT 1 FROM agents WHERE agent_address = $1)");
-    (*dbConn)->prepare(INSERT_AGENT, "INSERT INTO agents (agent_address, public_key, default_pocket) VALUES ($1, $2, $3)");
-    (*dbConn)->prepare(FETCH_AGENT_PUBKEY, "SELECT public_key FROM agents WHERE agent_address = $1");
+    (*dbConn)->prepare(INSERT_AGENT, "INSERT INTO agents (agent_address, key_type, public_key, default_pocket) VALUES ($1, $2, $3, $4)");
+    //creates the agent and its default pocket, each pointing at the other, in one statement.
+    //Both foreign keys are only checked at the end of the statement, once both rows exist.
+    //Returns no row if the agent already exists.
+    (*dbConn)->prepare(REGISTER_AGENT, "WITH new_pocket AS ("
+                                           "INSERT INTO pockets (owner) "
+                                           "SELECT $1 WHERE NOT EXISTS (SELECT 1 FROM agents WHERE agent_address = $1) "
+                                           "RETURNING pocket_id"
+                                       "), new_agent AS ("
+                                           "INSERT INTO agents (agent_address, key_type, public_key, default_pocket) "
+                                           "SELECT $1, $2, $3, pocket_id FROM new_pocket "
+                                           "ON CONFLICT (agent_address) DO NOTHING "
+                                           "RETURNING default_pocket"
+                                       ") "
+                                       "SELECT default_pocket FROM new_agent"
+               );
+    (*dbConn)->prepare(FETCH_AGENT_PUBKEY, "SELECT key_type, public_key FROM agents WHERE agent_address = $1");
     
     (*dbConn)->prepare(INSERT_POCKET_WITH_DEPOSIT_ADDRESS, "INSERT INTO pockets (owner, deposit_address) VALUES ($1, $2) RETURNING pocket_id");
     (*dbConn)->prepare(INSERT_POCKET, "INSERT INTO pockets (owner) VALUES ($1) RETURNING pocket_id");
@@ -39,14 +92,193 @@ void prepareConnection(pqxx::connection **dbConn) {
     (*dbConn)->prepare(FETCH_POCKET_OWNER, "SELECT owner FROM pockets WHERE pocket_id = $1"); 
     (*dbConn)->prepare(UPDATE_POCKET_OWNER, "UPDATE pockets SET owner = $2 WHERE pocket_id = $1");
     (*dbConn)->prepare(UPDATE_POCKET_DEPOSIT_ADDRESS, "UPDATE pockets SET deposit_address = $3 WHERE owner = $1 AND pocket_id = $2");
-    (*dbConn)->prepare(FETCH_POCKET_BALANCE, "SELECT amount FROM pockets WHERE pocket_id = $1");
-    (*dbConn)->prepare(DEDUCT_FROM_POCKET_WITH_OWNER, "UPDATE pockets SET amount = amount - $3 WHERE owner = $2 AND pocket_id = $1 AND amount - $3 >= 0");
-    (*dbConn)->prepare(ADD_TO_POCKET, "UPDATE pockets SET amount = amount + $2 WHERE pocket_id = $1");
-    
-    (*dbConn)->prepare(INSERT_FILE, "INSERT INTO files (owner, name, pocket) VALUES ($1, $2, $3) RETURNING file_id");
+    //what the pocket could spend, once its fees are settled
+    (*dbConn)->prepare(FETCH_POCKET_BALANCE, "SELECT amount - " + owedFeesSQL() + " FROM pockets WHERE pocket_id = $1");
+    //$3 credits from pocket $1, owned by $2, to pocket $4, in one round trip.
+    //The sender's fees are settled first, so it can't spend what it owes, and
+    //the receiver is only credited if the deduction went through. A pocket
+    //can't be updated twice in one statement, so a transfer to itself is
+    //netted out in the deduction.
+    (*dbConn)->prepare(POCKET_TRANSFER, "WITH deducted AS ("
+                                            "UPDATE pockets SET amount = amount - " + owedFeesSQL() + " - $3::bigint "
+                                                "+ CASE WHEN $4::int = $1::int THEN $3::bigint ELSE 0 END, "
+                                                "fees_settled_at = now() "
+                                            "WHERE pocket_id = $1::int AND owner = $2 AND amount - " + owedFeesSQL() + " - $3::bigint >= 0 "
+                                            "RETURNING pocket_id"
+                                        "), added AS ("
+                                            "UPDATE pockets SET amount = amount + $3::bigint "
+                                            "FROM deducted WHERE pockets.pocket_id = $4::int AND $4::int <> $1::int "
+                                            "RETURNING pockets.pocket_id"
+                                        ") "
+                                        "SELECT (SELECT COUNT(*) FROM deducted) AS deducted, (SELECT COUNT(*) FROM added) AS added");
+    
+    //statements that change something owned check the owner themselves, in the
+    //same round trip; when they touch no rows, the caller finds out why.
+    //they also keep the supporting pocket's file_count and total_bytes in step,
+    //settling its fees at the old rate first.
+    (*dbConn)->prepare(INSERT_FILE, "WITH new_file AS ("
+                                        "INSERT INTO files (owner, name, pocket) "
+                                        "SELECT $1, $2, $3 WHERE EXISTS (SELECT 1 FROM pockets WHERE pocket_id = $3 AND owner = $1) "
+                                        "RETURNING file_id, pocket"
+                                    "), stored AS ("
+                                        "INSERT INTO file_data (file_id) SELECT file_id FROM new_file"
+                                    "), counted AS ("
+                                        "UPDATE pockets SET file_count = file_count + 1, "
+                                            "amount = amount - " + owedFeesSQL() + ", fees_settled_at = now() "
+                                        "FROM new_file WHERE pockets.pocket_id = new_file.pocket"
+                                    ") "
+                                    "SELECT file_id FROM new_file");
+    //file payloads live in file_data, one row per file, so that checks and
+    //totals on files never read through them
     (*dbConn)->prepare(FETCH_FILE_OWNER, "SELECT owner FROM files WHERE file_id = $1");
-    (*dbConn)->prepare(UPDATE_FILE_BY_ID, "UPDATE files SET data = $2 WHERE file_id = $1");
-    (*dbConn)->prepare(READ_FILE_BY_ID, "SELECT data FROM files WHERE file_id = $1");
+    //old is locked first, so its size is the one this update replaces. $2 is
+    //the data, to be chunked, or NULL if it's in the blob $5. Chunks that come
+    //out the same as before aren't written.
+    (*dbConn)->prepare(UPDATE_FILE_BY_ID, "WITH resized AS ("
+                                              "UPDATE files SET size = $4 "
+                                              "FROM (SELECT file_id, size FROM files WHERE file_id = $1 AND owner = $3 FOR UPDATE) AS old "
+                                              "WHERE files.file_id = old.file_id "
+                                              "RETURNING files.file_id, files.pocket, $4 - old.size AS size_change"
+                                          "), stored AS ("
+                                              "UPDATE file_data SET blob_hash = $5 "
+                                              "FROM resized, (SELECT file_id, blob_hash FROM file_data WHERE file_id = $1 FOR UPDATE) AS prev "
+                                              "WHERE file_data.file_id = resized.file_id AND prev.file_id = resized.file_id "
+                                              "RETURNING prev.blob_hash AS released_hash"
+                                          "), released AS ("
+                                              "UPDATE blobs SET refcount = refcount - 1 FROM stored WHERE blobs.hash = stored.released_hash"
+                                          "), chunked AS ("
+                                              "INSERT INTO file_chunks (file_id, chunk_no, data) "
+                                              "SELECT resized.file_id, chunk.n, substring($2::bytea FROM chunk.n * " + FILE_CHUNK_SIZE_SQL + " + 1 FOR " + FILE_CHUNK_SIZE_SQL + ") "
+                                              "FROM resized, generate_series(0, (length($2::bytea) + " + FILE_CHUNK_SIZE_SQL + " - 1) / " + FILE_CHUNK_SIZE_SQL + " - 1) AS chunk(n) "
+                                              "ON CONFLICT (file_id, chunk_no) DO UPDATE SET data = EXCLUDED.data "
+                                              "WHERE file_chunks.data IS DISTINCT FROM EXCLUDED.data"
+                                          "), trimmed AS ("
+                                              "DELETE FROM file_chunks USING resized "
+                                              "WHERE file_chunks.file_id = resized.file_id "
+                                              "AND file_chunks.chunk_no >= (COALESCE(length($2::bytea), 0) + " + FILE_CHUNK_SIZE_SQL + " - 1) / " + FILE_CHUNK_SIZE_SQL +
+                                          ") "
+                                          "UPDATE pockets SET total_bytes = total_bytes + resized.size_change, "
+                                              "amount = amount - " + owedFeesSQL() + ", fees_settled_at = now() "
+                                          "FROM resized WHERE pockets.pocket_id = resized.pocket "
+                                          "RETURNING pocket_id");
+    (*dbConn)->prepare(READ_FILE_BY_ID, READ_FILE_DATA_SQL + "WHERE file_data.file_id = $1");
+    //only the chunks the range falls in are put together. substring() counts
+    //from 1; a blob's range is worked out in fileContentsFromRow()
+    (*dbConn)->prepare(READ_FILE_RANGE, "SELECT COALESCE(substring(("
+                                            "SELECT string_agg(file_chunks.data, ''::bytea ORDER BY file_chunks.chunk_no) "
+                                            "FROM file_chunks WHERE file_chunks.file_id = files.file_id AND file_data.blob_hash IS NULL "
+                                            "AND file_chunks.chunk_no >= $2::int / " + FILE_CHUNK_SIZE_SQL + " "
+                                            "AND file_chunks.chunk_no <= ($2::int + $3::int - 1) / " + FILE_CHUNK_SIZE_SQL + " "
+                                            "AND file_chunks.chunk_no < (files.size + " + FILE_CHUNK_SIZE_SQL + " - 1) / " + FILE_CHUNK_SIZE_SQL +
+                                        ") FROM $2::int % " + FILE_CHUNK_SIZE_SQL + " + 1 FOR $3::int), ''::bytea) AS data, "
+                                        "blobs.segment, blobs.segment_offset, blobs.length "
+                                        "FROM file_data JOIN files ON files.file_id = file_data.file_id "
+                                        "LEFT JOIN blobs ON blobs.hash = file_data.blob_hash "
+                                        "WHERE file_data.file_id = $1");
+    
+    //Writes to a file lock its pocket first, in a statement of their own, and
+    //only then the file: SETTLE_POCKET_FEES locks pockets before deleting
+    //their files, so taking them the other way round could deadlock with it.
+    //The lock is the one the write's own UPDATE of the pocket would take.
+    (*dbConn)->prepare(LOCK_FILE_POCKET, "SELECT pocket_id FROM pockets "
+                                         "WHERE pocket_id = (SELECT pocket FROM files WHERE file_id = $1) "
+                                         "FOR NO KEY UPDATE");
+    //Partial writes lock the file (and check it's the writer's) with
+    //FETCH_FILE_FOR_WRITE, in a statement of their own, before WRITE_FILE_RANGE
+    //reads the chunks it writes over, so those can't be from before another
+    //write to the file that committed while this one waited for it. Whole
+    //file updates to the blob store lock it the same way, before appending.
+    (*dbConn)->prepare(FETCH_FILE_FOR_WRITE, "SELECT files.size, blobs.segment, blobs.segment_offset, blobs.length "
+                                             "FROM files JOIN file_data ON file_data.file_id = files.file_id "
+                                             "LEFT JOIN blobs ON blobs.hash = file_data.blob_hash "
+                                             "WHERE files.file_id = $1 AND files.owner = $2 "
+                                             "FOR UPDATE OF files");
+    //$3 is written at $2, in a file that was $4 bytes long. Each chunk from
+    //the one the write (or the gap before it) starts in to the one it ends in
+    //is what was kept of it, padded with zeros up to where the write starts in
+    //it, with the write's piece of it laid over that.
+    (*dbConn)->prepare(WRITE_FILE_RANGE, "WITH resized AS ("
+                                             "UPDATE files SET size = GREATEST($4::int, $2::int + length($3::bytea)) "
+                                             "WHERE file_id = $1 "
+                                             "RETURNING file_id, pocket, size - $4::int AS size_change"
+                                         "), written AS ("
+                                             "INSERT INTO file_chunks (file_id, chunk_no, data) "
+                                             "SELECT resized.file_id, piece.chunk_no, "
+                                                 "overlay(piece.kept || decode(repeat('00', GREATEST(piece.at - length(piece.kept), 0)), 'hex') "
+                                                         "PLACING piece.written FROM piece.at + 1 FOR length(piece.written)) "
+                                             "FROM resized, ("
+                                                 "SELECT chunk.n AS chunk_no, "
+                                                     "substring(COALESCE(old.data, ''::bytea) FROM 1 FOR GREATEST($4::int - chunk.n * " + FILE_CHUNK_SIZE_SQL + ", 0)) AS kept, "
+                                                     "LEAST(GREATEST($2::int - chunk.n * " + FILE_CHUNK_SIZE_SQL + ", 0), " + FILE_CHUNK_SIZE_SQL + ") AS at, "
+                                                     "substring($3::bytea FROM GREATEST(chunk.n * " + FILE_CHUNK_SIZE_SQL + " - $2::int, 0) + 1 "
+                                                         "FOR GREATEST(LEAST((chunk.n + 1) * " + FILE_CHUNK_SIZE_SQL + ", $2::int + length($3::bytea)) "
+                                                                      "- GREATEST(chunk.n * " + FILE_CHUNK_SIZE_SQL + ", $2::int), 0)) AS written "
+                                                 "FROM generate_series(LEAST($2::int, $4::int) / " + FILE_CHUNK_SIZE_SQL + ", "
+                                                                      "($2::int + length($3::bytea) - 1) / " + FILE_CHUNK_SIZE_SQL + ") AS chunk(n) "
+                                                 "LEFT JOIN file_chunks AS old ON old.file_id = $1 AND old.chunk_no = chunk.n "
+                                                 "WHERE $2::int + length($3::bytea) > LEAST($2::int, $4::int)"
+                                             ") AS piece "
+                                             "ON CONFLICT (file_id, chunk_no) DO UPDATE SET data = EXCLUDED.data"
+                                         ") "
+                                         "UPDATE pockets SET total_bytes = total_bytes + resized.size_change, "
+                                             "amount = amount - " + owedFeesSQL() + ", fees_settled_at = now() "
+                                         "FROM resized WHERE pockets.pocket_id = resized.pocket "
+                                         "RETURNING pocket_id");
+    
+    //a file's data is either in file_chunks or, with a blob store, in the
+    //blob named by file_data.blob_hash. blobs.refcount is how many files use it.
+    (*dbConn)->prepare(ACQUIRE_BLOB, "UPDATE blobs SET refcount = refcount + 1 WHERE hash = $1");
+    (*dbConn)->prepare(INSERT_BLOB, "INSERT INTO blobs (hash, segment, segment_offset, length, refcount) VALUES ($1, $2, $3, $4, 1) "
+                                    "ON CONFLICT (hash) DO UPDATE SET refcount = blobs.refcount + 1");
+    (*dbConn)->prepare(DELETE_DEAD_BLOBS, "DELETE FROM blobs WHERE refcount = 0");
+    (*dbConn)->prepare(FETCH_USED_SEGMENTS, "SELECT DISTINCT segment FROM blobs WHERE segment = ANY($1::int[])");
+    //A transaction that appends a blob holds its segment's advisory lock,
+    //shared, until it ends; whatever it inserted into blobs is committed (or
+    //gone) by the time collectBlobGarbage() can take the lock for itself.
+    (*dbConn)->prepare(LOCK_BLOB_SEGMENT, "SELECT pg_advisory_xact_lock_shared(" + BLOB_SEGMENT_LOCK_SPACE_SQL + ", $1::int)");
+    (*dbConn)->prepare(TRY_LOCK_BLOB_SEGMENTS, "SELECT segment FROM unnest($1::int[]) AS segment "
+                                               "WHERE pg_try_advisory_xact_lock(" + BLOB_SEGMENT_LOCK_SPACE_SQL + ", segment)");
+    
+    //pocket and file IDs are passed as arrays (see idArrayParam), so these are
+    //planned once however many pockets they cover. A pocket's deadline is
+    //when it comes to owe a credit more than it has (see SETTLE_POCKET_FEES).
+    std::string feeDeadlineSQL = "SELECT pocket_id, "
+                                     "(amount + 1) / NULLIF(" + feeRateSQL() + ", 0) - EXTRACT(EPOCH FROM now() - fees_settled_at)::float8 AS seconds_left "
+                                 "FROM pockets ";
+    (*dbConn)->prepare(FETCH_ALL_FEE_DEADLINES, feeDeadlineSQL + "WHERE file_count > 0");
+    (*dbConn)->prepare(FETCH_FEE_DEADLINES, feeDeadlineSQL + "WHERE pocket_id = ANY($1::int[]) "
+                                                             "OR pocket_id IN (SELECT pocket FROM files WHERE file_id = ANY($2::int[]))");
+    //the pockets are locked (in order, so two of these can't deadlock) before
+    //anything is worked out from them. A pocket that owes more than it has left
+    //has run dry, and can't support its files any more; one that owes exactly
+    //what it has pays it all and keeps them, as it always has.
+    (*dbConn)->prepare(SETTLE_POCKET_FEES, "WITH settling AS ("
+                                               "SELECT pocket_id, (" + accruedFeesSQL() + " > amount AND file_count > 0) AS ran_dry "
+                                               "FROM pockets WHERE pocket_id = ANY($1::int[]) "
+                                               "ORDER BY pocket_id FOR UPDATE"
+                                           "), deleted AS ("
+                                               "DELETE FROM files USING settling "
+                                               "WHERE files.pocket = settling.pocket_id AND settling.ran_dry "
+                                               "RETURNING files.file_id"
+                                           "), released AS ("
+                                               "UPDATE blobs SET refcount = refcount - dropped.uses "
+                                               "FROM ("
+                                                   "SELECT file_data.blob_hash, COUNT(*) AS uses "
+                                                   "FROM file_data JOIN files ON files.file_id = file_data.file_id "
+                                                   "JOIN settling ON files.pocket = settling.pocket_id "
+                                                   "WHERE settling.ran_dry AND file_data.blob_hash IS NOT NULL "
+                                                   "GROUP BY file_data.blob_hash"
+                                               ") AS dropped "
+                                               "WHERE blobs.hash = dropped.blob_hash"
+                                           "), settled AS ("
+                                               "UPDATE pockets SET "
+                                                   "file_count = CASE WHEN settling.ran_dry THEN 0 ELSE file_count END, "
+                                                   "total_bytes = CASE WHEN settling.ran_dry THEN 0 ELSE total_bytes END, "
+                                                   "amount = amount - " + owedFeesSQL() + ", "
+                                                   "fees_settled_at = now() "
+                                               "FROM settling WHERE pockets.pocket_id = settling.pocket_id"
+                                           ") "
+                                           "SELECT file_id FROM deleted");
     
     //std::cout << "queries prepared." << std::endl;
 }
@@ -63,13 +295,13 @@ bool agentRowExists(pqxx::connection *dbConn, std::string agentAddress) {
     return exists;
 }
 
-void insertAgent(pqxx::connection *dbConn, std::string agentAddress, std::vector<unsigned char> DEREncodedPubkey, unsigned long defaultPocketID) {
+void insertAgent(pqxx::connection *dbConn, std::string agentAddress, const crypto::AgentPubkey &pubkey, unsigned long defaultPocketID) {
     pqxx::work tx(*dbConn, "InsertAgentWork");
     
     try {
-        pqxx::binarystring pubkeyBlob(DEREncodedPubkey.data(), DEREncodedPubkey.size());
+        pqxx::binarystring pubkeyBlob(pubkey.encoded().data(), pubkey.encoded().size());
         
-        tx.prepared(INSERT_AGENT)(agentAddress)(pubkeyBlob)(defaultPocketID).exec();
+        tx.prepared(INSERT_AGENT)(agentAddress)((int)pubkey.keyType())(pubkeyBlob)(defaultPocketID).exec();
         
         tx.commit();
     }
@@ -79,7 +311,28 @@ void insertAgent(pqxx::connection *dbConn, std::string agentAddress, std::vector
     }
 }
 
-crypto::RSAPubkey fetchAgentPubkey(pqxx::connection *dbConn, std::string agentAddress) {
+//Inserts the agent with a new default pocket unless it already exists, in one
+//round trip. Returns whether it was new, and if so sets defaultPocketID.
+bool registerAgent(pqxx::connection *dbConn, std::string agentAddress, const crypto::AgentPubkey &pubkey, unsigned long *defaultPocketID) {
+    pqxx::work tx(*dbConn, "RegisterAgentWork");
+    
+    pqxx::binarystring pubkeyBlob(pubkey.encoded().data(), pubkey.encoded().size());
+    pqxx::result result = tx.prepared(REGISTER_AGENT)(agentAddress)((int)pubkey.keyType())(pubkeyBlob).exec();
+    
+    if (result.size() == 0) {
+        //the agent was already there. If a concurrent handshake for the same
+        //agent got in first, our pocket may have been inserted anyway; drop it.
+        tx.abort();
+        return false;
+    }
+    
+    tx.commit();
+    
+    result[0][0].to(*defaultPocketID);
+    return true;
+}
+
+crypto::AgentPubkey fetchAgentPubkey(pqxx::connection *dbConn, std::string agentAddress) {
     pqxx::work tx(*dbConn, "FetchAgentPubkeyWork");
     pqxx::result result = tx.prepared(FETCH_AGENT_PUBKEY)(agentAddress).exec();
     tx.commit();
@@ -88,15 +341,16 @@ crypto::RSAPubkey fetchAgentPubkey(pqxx::connection *dbConn, std::string agentAd
         commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("agent ") + agentAddress, 0, true);
         throw NetvendCommandException(error);
     }
-    pqxx::binarystring pubkeyBlob(result[0][0]);
+    int keyType; result[0]["key_type"].to(keyType);
+    pqxx::binarystring pubkeyBlob(result[0]["public_key"]);
     
-    return crypto::decodePubkey(pubkeyBlob.data(), pubkeyBlob.size());
+    std::vector<unsigned char> encodedPubkey(pubkeyBlob.begin(), pubkeyBlob.end());
+    return crypto::AgentPubkey((unsigned char)keyType, encodedPubkey);
 }
 
 
 
-unsigned long insertPocket(pqxx::connection *dbConn, std::string ownerAddress, std::string depositAddress) {
-    pqxx::work tx(*dbConn, "InsertPocketWork");
+unsigned long insertPocket(pqxx::transaction_base &tx, std::string ownerAddress, std::string depositAddress) {
     pqxx::result result;
     
     try {
@@ -115,24 +369,20 @@ unsigned long insertPocket(pqxx::connection *dbConn, std::string ownerAddress, s
         throw NetvendCommandException(error);
     }
     
-    tx.commit();
-    
     unsigned long pocketID;
     result[0][0].to(pocketID);
     return pocketID;
 }
 
-unsigned long insertPocket(pqxx::connection *dbConn, std::string ownerAddress) {
-    return insertPocket(dbConn, ownerAddress, "");
+unsigned long insertPocket(pqxx::transaction_base &tx, std::string ownerAddress) {
+    return insertPocket(tx, ownerAddress, "");
 }
 
-unsigned long insertPocket(pqxx::connection *dbConn) {
-    return insertPocket(dbConn, "", "");
+unsigned long insertPocket(pqxx::transaction_base &tx) {
+    return insertPocket(tx, "", "");
 }
 
-std::string fetchPocketOwner(pqxx::connection *dbConn, unsigned long pocketID) {
-    pqxx::work tx(*dbConn, "FetchPocketOwnerWork");
-    
+std::string fetchPocketOwner(pqxx::transaction_base &tx, unsigned long pocketID) {
     pqxx::result result = tx.prepared(FETCH_POCKET_OWNER)(pocketID).exec();
     
     if (result.size() == 0) {
@@ -144,47 +394,39 @@ std::string fetchPocketOwner(pqxx::connection *dbConn, unsigned long pocketID) {
     return owner;
 }
 
-void verifyPocketOwner(pqxx::connection *dbConn, unsigned long pocketID, std::string agentAddress) {
-    if (fetchPocketOwner(dbConn, pocketID) != agentAddress) {
+void verifyPocketOwner(pqxx::transaction_base &tx, unsigned long pocketID, std::string agentAddress) {
+    if (fetchPocketOwner(tx, pocketID) != agentAddress) {
         commands::errors::Error* error = new commands::errors::TargetNotOwnedError(std::string("p:") + boost::lexical_cast<std::string>(pocketID), 0, true);
         throw NetvendCommandException(error);
     }
 }
 
-void updatePocketOwner(pqxx::connection *dbConn, unsigned long pocketID, std::string newOwnerAddress) {
-    pqxx::work tx(*dbConn, "UpdatePocketOwnerWork");
-    
+void updatePocketOwner(pqxx::transaction_base &tx, unsigned long pocketID, std::string newOwnerAddress) {
     pqxx::result result = tx.prepared(UPDATE_POCKET_OWNER)(pocketID)(newOwnerAddress).exec();
     
-    tx.commit();
-    
     if (result.affected_rows() == 0) {
         commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("p:") + boost::lexical_cast<std::string>(pocketID), 0, true);
         throw NetvendCommandException(error);
     }
 }
 
-void updatePocketDepositAddress(pqxx::connection *dbConn, std::string ownerAddress, unsigned long pocketID, std::string newDepositAddress) {
-    pqxx::work tx(*dbConn, "UpdatePocketDepositAddressWork");
-    
+void updatePocketDepositAddress(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long pocketID, std::string newDepositAddress) {
     pqxx::result result = tx.prepared(UPDATE_POCKET_DEPOSIT_ADDRESS)(ownerAddress)(pocketID)(newDepositAddress).exec();
     
-    tx.commit();
-    
     if (result.affected_rows() == 0) {
+        //no such pocket, or not ours
+        verifyPocketOwner(tx, pocketID, ownerAddress);
+        
         commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("p:") + boost::lexical_cast<std::string>(pocketID), 0, true);
         throw NetvendCommandException(error);
     }
 }
 
-void pocketTransfer(pqxx::connection *dbConn, std::string fromOwnerAddress, unsigned long fromPocketID, unsigned long toPocketID, unsigned long long amount) {
-    pqxx::work tx(*dbConn, "PocketTransferWork");
-    pqxx::result result;
-    
-    //first try to deduct from the sender
-    result = tx.prepared(DEDUCT_FROM_POCKET_WITH_OWNER)(fromPocketID)(fromOwnerAddress)(amount).exec();
+//on error the deduction and addition are left for the caller to roll back with the rest of tx
+void pocketTransfer(pqxx::transaction_base &tx, std::string fromOwnerAddress, unsigned long fromPocketID, unsigned long toPocketID, unsigned long long amount) {
+    pqxx::result result = tx.prepared(POCKET_TRANSFER)(fromPocketID)(fromOwnerAddress)(amount)(toPocketID).exec();
     
-    if (result.affected_rows() == 0) {
+    if (result[0]["deducted"].as<unsigned int>() == 0) {
         //something went wrong. Lets find out what!
         pqxx::result ownerResult = tx.prepared(FETCH_POCKET_OWNER)(fromPocketID).exec();
         if (ownerResult.size() == 0) {
@@ -201,7 +443,7 @@ void pocketTransfer(pqxx::connection *dbConn, std::string fromOwnerAddress, unsi
             //Only possibility left should be that pocket can't support transfer.
             pqxx::result balanceResult = tx.prepared(FETCH_POCKET_BALANCE)(fromPocketID).exec();
             unsigned long long balance = balanceResult[0][0].as<unsigned long long>();
-            if (balance - amount < 0) {
+            if (amount > balance) {
                 commands::errors::Error* error = new commands::errors::CreditInsufficientError(amount, balance, 0, true);
                 throw NetvendCommandException(error);
             }
@@ -213,21 +455,16 @@ void pocketTransfer(pqxx::connection *dbConn, std::string fromOwnerAddress, unsi
         }
     }
     
-    result = tx.prepared(ADD_TO_POCKET)(toPocketID)(amount).exec();
-    
-    if (result.affected_rows() == 0) {
+    if (toPocketID != fromPocketID && result[0]["added"].as<unsigned int>() == 0) {
         //no pocket with this pocket_id
         commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("p:") + boost::lexical_cast<std::string>(toPocketID), 0, true);
         throw NetvendCommandException(error);
     }
-    
-    tx.commit();
 }
 
 
 
-unsigned long insertFile(pqxx::connection *dbConn, std::string ownerAddress, std::string name, unsigned long pocketID) {
-    pqxx::work tx(*dbConn, "InsertFileWork");
+unsigned long insertFile(pqxx::transaction_base &tx, std::string ownerAddress, std::string name, unsigned long pocketID) {
     pqxx::result result;
     
     try {
@@ -238,16 +475,20 @@ unsigned long insertFile(pqxx::connection *dbConn, std::string ownerAddress, std
         throw NetvendCommandException(error);
     }
     
-    tx.commit();
+    if (result.size() == 0) {
+        //the pocket doesn't exist or isn't ours
+        verifyPocketOwner(tx, pocketID, ownerAddress);
+        
+        commands::errors::Error* error = new commands::errors::ServerLogicError(std::string("Creating file in pocket ") + boost::lexical_cast<std::string>(pocketID) + std::string(" failed for an unknown reason"), 0, true);
+        throw NetvendCommandException(error);
+    }
     
     unsigned long fileID;
     result[0][0].to(fileID);
     return fileID;
 }
 
-std::string fetchFileOwner(pqxx::connection *dbConn, unsigned long fileID) {
-    pqxx::work tx(*dbConn, "FetchFileOwnerWork");
-    
+std::string fetchFileOwner(pqxx::transaction_base &tx, unsigned long fileID) {
     pqxx::result result = tx.prepared(FETCH_FILE_OWNER)(fileID).exec();
     
     if (result.size() == 0) {
@@ -260,101 +501,447 @@ std::string fetchFileOwner(pqxx::connection *dbConn, unsigned long fileID) {
     return owner;
 }
 
-void verifyFileOwner(pqxx::connection *dbConn, unsigned long fileID, std::string agentAddress) {
-    if (fetchFileOwner(dbConn, fileID) != agentAddress) {
+void verifyFileOwner(pqxx::transaction_base &tx, unsigned long fileID, std::string agentAddress) {
+    if (fetchFileOwner(tx, fileID) != agentAddress) {
         commands::errors::Error* error = new commands::errors::TargetNotOwnedError(std::string("f:") + boost::lexical_cast<std::string>(fileID), 0, true);
         throw NetvendCommandException(error);
     }
 }
 
-void updateFileByID(pqxx::connection *dbConn, unsigned long fileID, unsigned char* data, unsigned short dataSize) {
-    pqxx::work tx(*dbConn, "UpdateFileByIDWork");
+//for a write that found no file of ownerAddress's with this ID
+static void throwFileNotWritable(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long fileID) {
+    //no such file, or not ours
+    verifyFileOwner(tx, fileID, ownerAddress);
+    
+    commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("f:") + boost::lexical_cast<std::string>(fileID), 0, true);
+    throw NetvendCommandException(error);
+}
+
+//one more file uses the blob with this content; it's stored first if it's new
+static void acquireBlob(pqxx::transaction_base &tx, const pqxx::binarystring &hashBlob, unsigned char* data, unsigned short dataSize) {
+    if (tx.prepared(ACQUIRE_BLOB)(hashBlob).exec().affected_rows() > 0) return;
+    
+    blobstore::BlobLocation location;
+    try {
+        location = blobStore_->append(data, dataSize);
+    }
+    catch (blobstore::BlobStoreException& e) {
+        std::cerr << e.what() << std::endl;
+        commands::errors::Error* error = new commands::errors::ServerLogicError("Storing file data failed", 0, true);
+        throw NetvendCommandException(error);
+    }
+    try {
+        tx.prepared(LOCK_BLOB_SEGMENT)(location.segment).exec();
+    }
+    catch (...) {
+        blobStore_->appendLocked(location.segment);
+        throw;
+    }
+    blobStore_->appendLocked(location.segment);
+    tx.prepared(INSERT_BLOB)(hashBlob)(location.segment)(location.offset)(location.length).exec();
+}
+
+void updateFileByID(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long fileID, unsigned char* data, unsigned short dataSize) {
     pqxx::result result;
     
-    pqxx::binarystring dataBlob(data, dataSize);
+    tx.prepared(LOCK_FILE_POCKET)(fileID).exec();
     
-    result = tx.prepared(UPDATE_FILE_BY_ID)(fileID)(dataBlob).exec();
+    if (blobStore_ != NULL) {
+        //Bytes appended to the blob store aren't taken back if the update then
+        //fails, so the file is locked and checked to be ours first.
+        if (tx.prepared(FETCH_FILE_FOR_WRITE)(fileID)(ownerAddress).exec().size() == 0) {
+            throwFileNotWritable(tx, ownerAddress, fileID);
+        }
+        
+        std::vector<unsigned char> hash = blobstore::blobHash(data, dataSize);
+        pqxx::binarystring hashBlob(hash.data(), hash.size());
+        acquireBlob(tx, hashBlob, data, dataSize);
+        
+        result = tx.prepared(UPDATE_FILE_BY_ID)(fileID)(std::string(), false)(ownerAddress)(dataSize)(hashBlob).exec();
+    }
+    else {
+        pqxx::binarystring dataBlob(data, dataSize);
+        result = tx.prepared(UPDATE_FILE_BY_ID)(fileID)(dataBlob)(ownerAddress)(dataSize)(std::string(), false).exec();
+    }
     
-    tx.commit();
+    if (result.size() == 0) {
+        throwFileNotWritable(tx, ownerAddress, fileID);
+    }
+}
+
+boost::shared_ptr<FileContents> blobContents(const blobstore::BlobLocation &location) {
+    boost::shared_ptr<FileContents> contents(new FileContents());
+    if (location.length >= SPLICE_MIN_FILE_SIZE) {
+        contents->spliced = true;
+        contents->span.file = blobStore_->segmentFile(location.segment);
+        contents->span.offset = location.offset;
+        contents->span.length = location.length;
+    }
+    else {
+        contents->spliced = false;
+        contents->data = blobStore_->read(location);
+    }
+    return contents;
+}
+
+//a range that covers any file
+const unsigned short WHOLE_FILE = 0xffff;
+
+static unsigned int contentsSize(const FileContents &contents) {
+    return contents.spliced ? contents.span.length : contents.data.size();
+}
+
+//where the blob of a row with a non-NULL segment is
+static blobstore::BlobLocation blobLocationFromRow(const pqxx::tuple &row) {
+    if (blobStore_ == NULL) {
+        commands::errors::Error* error = new commands::errors::ServerLogicError("File data is in a blob store, but none is configured", 0, true);
+        throw NetvendCommandException(error);
+    }
+    blobstore::BlobLocation location;
+    row["segment"].to(location.segment);
+    row["segment_offset"].to(location.offset);
+    row["length"].to(location.length);
+    return location;
+}
+
+//A row selected with READ_FILE_DATA_SQL or READ_FILE_RANGE. For the latter,
+//data is already just the range, but a blob's range is taken here.
+static boost::shared_ptr<FileContents> fileContentsFromRow(const pqxx::tuple &row, unsigned short offset, unsigned short length) {
+    if (row["segment"].is_null()) {
+        pqxx::binarystring fileDataBlob(row["data"]);
+        boost::shared_ptr<FileContents> contents(new FileContents());
+        contents->spliced = false;
+        contents->data.assign(fileDataBlob.begin(), fileDataBlob.end());
+        return contents;
+    }
     
-    if (result.affected_rows() == 0) {
-        commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("f:") + boost::lexical_cast<std::string>(fileID), 0, true);
+    blobstore::BlobLocation location = blobLocationFromRow(row);
+    
+    unsigned int skipped = std::min((unsigned int)offset, location.length);
+    location.offset += skipped;
+    location.length = std::min((unsigned int)length, location.length - skipped);
+    try {
+        return blobContents(location);
+    }
+    catch (blobstore::BlobStoreException& e) {
+        std::cerr << e.what() << std::endl;
+        commands::errors::Error* error = new commands::errors::ServerLogicError("Reading file data failed", 0, true);
         throw NetvendCommandException(error);
     }
 }
 
-std::vector<unsigned char> readFileByID(pqxx::connection *dbConn, unsigned long fileID) {
-    pqxx::work tx(*dbConn, "ReadFileByIDWork");
-    pqxx::result result = tx.prepared(READ_FILE_BY_ID)(fileID).exec();
-    tx.commit();
+//Partial writes go to the file's chunks, so a file in a blob is moved into
+//them first: its data, with this write made to it, replaces it whole, which
+//is the only time one costs more than the data it writes.
+static void writeFilePart(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long fileID, bool append, unsigned short offset, unsigned char* data, unsigned short dataSize) {
+    tx.prepared(LOCK_FILE_POCKET)(fileID).exec();
+    pqxx::result result = tx.prepared(FETCH_FILE_FOR_WRITE)(fileID)(ownerAddress).exec();
     
     if (result.size() == 0) {
-        commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("f:") + boost::lexical_cast<std::string>(fileID), 0, true);
+        throwFileNotWritable(tx, ownerAddress, fileID);
+    }
+    
+    unsigned int size;
+    result[0]["size"].to(size);
+    unsigned int start = append ? size : offset;
+    if (start + dataSize > MAX_FILE_SIZE) {
+        commands::errors::Error* error = new commands::errors::ServerLogicError(std::string("File f:") + boost::lexical_cast<std::string>(fileID) + std::string(" can't grow past ") + boost::lexical_cast<std::string>(MAX_FILE_SIZE) + std::string(" bytes"), 0, true);
         throw NetvendCommandException(error);
     }
-    pqxx::binarystring fileDataBlob(result[0][0]);
     
-    std::vector<unsigned char> fileDataVch;
-    fileDataVch.resize(fileDataBlob.size());
-    std::copy(fileDataBlob.begin(), fileDataBlob.end(), fileDataVch.begin());
-    return fileDataVch;
+    if (!result[0]["segment"].is_null()) {
+        blobstore::BlobLocation location = blobLocationFromRow(result[0]);
+        std::vector<unsigned char> fileData;
+        try {
+            fileData = blobStore_->read(location);
+        }
+        catch (blobstore::BlobStoreException& e) {
+            std::cerr << e.what() << std::endl;
+            commands::errors::Error* error = new commands::errors::ServerLogicError("Reading file data failed", 0, true);
+            throw NetvendCommandException(error);
+        }
+        
+        fileData.resize(std::max((unsigned int)fileData.size(), start + dataSize), 0);
+        std::copy_n(data, dataSize, fileData.begin() + start);
+        
+        pqxx::binarystring dataBlob(fileData.data(), fileData.size());
+        tx.prepared(UPDATE_FILE_BY_ID)(fileID)(dataBlob)(ownerAddress)((unsigned int)fileData.size())(std::string(), false).exec();
+        return;
+    }
+    
+    pqxx::binarystring dataBlob(data, dataSize);
+    tx.prepared(WRITE_FILE_RANGE)(fileID)(start)(dataBlob)(size).exec();
+}
+
+void appendToFile(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long fileID, unsigned char* data, unsigned short dataSize) {
+    writeFilePart(tx, ownerAddress, fileID, true, 0, data, dataSize);
 }
 
-void chargeFileUpkeepFees(pqxx::connection *dbConn, int creditPerFile, int creditPerByte) {
-    //get total bytes each pocket is responsible for supporting
-    pqxx::work fetchFeesTx(*dbConn, "FetchFileFeesSupportedPerPocketWork");
-    pqxx::result feesPerPocketResult = fetchFeesTx.prepared(FETCH_FILE_FEES_SUPPORTED_PER_POCKET)(creditPerFile)(creditPerByte).exec();
-    fetchFeesTx.commit();
+void writeFileRange(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long fileID, unsigned short offset, unsigned char* data, unsigned short dataSize) {
+    writeFilePart(tx, ownerAddress, fileID, false, offset, data, dataSize);
+}
+
+//empty if there's no such file
+static boost::shared_ptr<const FileContents> queryFileContents(pqxx::transaction_base &tx, unsigned long fileID) {
+    pqxx::result result = tx.prepared(READ_FILE_BY_ID)(fileID).exec();
+    if (result.size() == 0) return boost::shared_ptr<const FileContents>();
     
-    //if a pocket can't support the fees, we delete all the files supported by that pocket
-    //construct the delete query
+    return fileContentsFromRow(result[0], 0, WHOLE_FILE);
+}
+
+boost::shared_ptr<const FileContents> readFileByID(pqxx::transaction_base &tx, unsigned long fileID, bool fillCache) {
+    boost::shared_ptr<const FileContents> contents;
     
-    std::string removeFilesQuery = "DELETE FROM files WHERE pocket IN ";
-    std::string deductPocketsQuery = "UPDATE pockets SET amount = amount - CASE pocket_id ";
+    if (fileCache_ == NULL) {
+        contents = queryFileContents(tx, fileID);
+    }
+    else if (!fillCache) {
+        //a cached absence can't be trusted here: tx may have created the file
+        if (!fileCache_->get(fileID, &contents) || contents.get() == NULL) {
+            contents = queryFileContents(tx, fileID);
+        }
+    }
+    else {
+        boost::shared_ptr<FlightWait> wait(new FlightWait());
+        FileCache::FlightPtr flight;
+        switch (fileCache_->lookup(fileID, true, &contents, &flight, boost::bind(&FlightWait::land, wait, _1, _2))) {
+            case FileCache::LOOKUP_HIT:
+                break;
+            case FileCache::LOOKUP_JOINED:
+                if (!wait->wait(&contents)) {
+                    contents = queryFileContents(tx, fileID);
+                }
+                break;
+            case FileCache::LOOKUP_LEAD:
+                try {
+                    contents = queryFileContents(tx, fileID);
+                }
+                catch (...) {
+                    fileCache_->land(flight, false, contents);
+                    throw;
+                }
+                fileCache_->land(flight, true, contents);
+                break;
+        }
+    }
     
-    std::string bankruptPocketsList = "(";
-    std::string chargeablePocketsList = "(";
-    for (int i=0; i<feesPerPocketResult.size(); i++) {
-        //for each pocket, delete posts if it has too little credit, otherwise deduct
-        bool wouldBankrupt; feesPerPocketResult[i]["would_bankrupt"].to(wouldBankrupt);
-        if (wouldBankrupt) {
-            bankruptPocketsList.append(feesPerPocketResult[i]["pocket_id"].c_str()).append(",");
+    if (contents.get() == NULL) {
+        commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("f:") + boost::lexical_cast<std::string>(fileID), 0, true);
+        throw NetvendCommandException(error);
+    }
+    return contents;
+}
+
+//Reads several files in one round trip. A file that doesn't exist comes back
+//as an empty pointer.
+FilesData readFilesByID(pqxx::transaction_base &tx, const std::vector<unsigned long> &fileIDs, bool fillCache) {
+    FilesData filesData(fileIDs.size());
+    //which files are known (from the cache), which this leads the reads of,
+    //and which it's waiting on someone else's read of
+    std::vector<bool> known(fileIDs.size(), false);
+    std::vector<FileCache::FlightPtr> flights(fileIDs.size());
+    std::vector<boost::shared_ptr<FlightWait> > waits(fileIDs.size());
+    
+    for (unsigned int i=0; i<fileIDs.size() && fileCache_ != NULL; i++) {
+        if (!fillCache) {
+            //as in readFileByID, only what's there is trusted
+            known[i] = fileCache_->get(fileIDs[i], &filesData[i]) && filesData[i].get() != NULL;
+            continue;
         }
-        else {
-            chargeablePocketsList.append(feesPerPocketResult[i]["pocket_id"].c_str()).append(",");
-            deductPocketsQuery.append("WHEN ").append(feesPerPocketResult[i]["pocket_id"].c_str()).append(" THEN ").append(feesPerPocketResult[i]["total_fees"].c_str()).append(" ");
+        
+        boost::shared_ptr<FlightWait> wait(new FlightWait());
+        switch (fileCache_->lookup(fileIDs[i], true, &filesData[i], &flights[i], boost::bind(&FlightWait::land, wait, _1, _2))) {
+            case FileCache::LOOKUP_HIT:
+                known[i] = true;
+                break;
+            case FileCache::LOOKUP_JOINED:
+                waits[i] = wait;
+                break;
+            case FileCache::LOOKUP_LEAD:
+                break;
         }
     }
-    bool bankruptListEmpty = true;
-    if (bankruptPocketsList.size() > 1) {
-        bankruptPocketsList.pop_back();//remove trailing comma, end list, and add to query
-        bankruptListEmpty = false;
+    
+    //everything not known or waited on goes to the database, in one round trip
+    std::vector<pqxx::result> results(fileIDs.size());
+    try {
+        pqxx::pipeline pipe(tx, "ReadFilesByIDPipeline");
+        std::vector<pqxx::pipeline::query_id> queryIDs(fileIDs.size());
+        for (unsigned int i=0; i<fileIDs.size(); i++) {
+            if (known[i] || waits[i].get() != NULL) continue;
+            queryIDs[i] = pipe.insert(READ_FILE_DATA_SQL + "WHERE file_data.file_id = " + tx.quote(fileIDs[i]));
+        }
+        for (unsigned int i=0; i<fileIDs.size(); i++) {
+            if (known[i] || waits[i].get() != NULL) continue;
+            results[i] = pipe.retrieve(queryIDs[i]);
+        }
+        pipe.complete();
+        
+        for (unsigned int i=0; i<fileIDs.size(); i++) {
+            if (known[i] || waits[i].get() != NULL || results[i].size() == 0) continue;
+            filesData[i] = fileContentsFromRow(results[i][0], 0, WHOLE_FILE);
+        }
     }
-    bool chargeListEmpty = true;
-    if (chargeablePocketsList.size() > 1) {
-        chargeablePocketsList.pop_back();//remove trailing comma
-        chargeListEmpty = false;
+    catch (...) {
+        for (unsigned int i=0; i<fileIDs.size(); i++) {
+            if (flights[i].get() != NULL) fileCache_->land(flights[i], false, boost::shared_ptr<const FileContents>());
+        }
+        throw;
     }
-    bankruptPocketsList.append(")");
-    chargeablePocketsList.append(")");
     
-    removeFilesQuery.append(bankruptPocketsList);
-    deductPocketsQuery.append("END WHERE pocket_id IN ").append(chargeablePocketsList);
+    //what this led lands before it waits on anything, so nobody's left waiting on it
+    for (unsigned int i=0; i<fileIDs.size(); i++) {
+        if (flights[i].get() != NULL) fileCache_->land(flights[i], true, filesData[i]);
+    }
+    for (unsigned int i=0; i<fileIDs.size(); i++) {
+        if (waits[i].get() != NULL && !waits[i]->wait(&filesData[i])) {
+            filesData[i] = queryFileContents(tx, fileIDs[i]);
+        }
+    }
+    return filesData;
+}
+
+FileSlice readFileRange(pqxx::transaction_base &tx, unsigned long fileID, unsigned short offset, unsigned short length, bool fillCache) {
+    FileSlice slice;
+    slice.offset = 0;
+    slice.length = 0;
+    
+    //a cached absence is only trusted where readFileByID would trust it
+    boost::shared_ptr<const FileContents> cached;
+    if (fileCache_ != NULL && fileCache_->get(fileID, &cached) && (cached.get() != NULL || fillCache)) {
+        slice.contents = cached;
+        if (cached.get() != NULL) {
+            unsigned int size = contentsSize(*cached);
+            slice.offset = std::min((unsigned int)offset, size);
+            slice.length = std::min((unsigned int)length, size - slice.offset);
+        }
+    }
+    else {
+        pqxx::result result = tx.prepared(READ_FILE_RANGE)(fileID)(offset)(length).exec();
+        if (result.size() > 0) {
+            slice.contents = fileContentsFromRow(result[0], offset, length);
+            slice.length = contentsSize(*slice.contents);
+        }
+    }
+    
+    if (slice.contents.get() == NULL) {
+        commands::errors::Error* error = new commands::errors::InvalidTargetError(std::string("f:") + boost::lexical_cast<std::string>(fileID), 0, true);
+        throw NetvendCommandException(error);
+    }
+    return slice;
+}
+
+//an array parameter, as Postgres reads them from text
+static std::string idArrayParam(std::vector<unsigned long>::const_iterator begin, std::vector<unsigned long>::const_iterator end) {
+    std::string array = "{";
+    for (std::vector<unsigned long>::const_iterator it = begin; it != end; it++) {
+        if (it != begin) array.append(",");
+        array.append(boost::lexical_cast<std::string>(*it));
+    }
+    array.append("}");
+    return array;
+}
+
+static std::string idArrayParam(const std::vector<unsigned long> &ids) {
+    return idArrayParam(ids.begin(), ids.end());
+}
+
+static std::vector<FeeDeadline> feeDeadlinesFromResult(const pqxx::result &result) {
+    std::vector<FeeDeadline> deadlines(result.size());
+    for (unsigned int i=0; i<result.size(); i++) {
+        result[i]["pocket_id"].to(deadlines[i].pocketID);
+        deadlines[i].hasDeadline = !result[i]["seconds_left"].is_null();
+        deadlines[i].secondsLeft = deadlines[i].hasDeadline ? result[i]["seconds_left"].as<double>() : 0;
+    }
+    return deadlines;
+}
+
+std::vector<FeeDeadline> fetchAllFeeDeadlines(pqxx::connection *dbConn) {
+    pqxx::work tx(*dbConn, "FetchAllFeeDeadlinesWork");
+    pqxx::result result = tx.prepared(FETCH_ALL_FEE_DEADLINES).exec();
+    tx.commit();
+    
+    return feeDeadlinesFromResult(result);
+}
+
+std::vector<FeeDeadline> fetchFeeDeadlines(pqxx::connection *dbConn, const std::vector<unsigned long> &pocketIDs, const std::vector<unsigned long> &fileIDs) {
+    if (pocketIDs.empty() && fileIDs.empty()) return std::vector<FeeDeadline>();
+    
+    pqxx::work tx(*dbConn, "FetchFeeDeadlinesWork");
+    pqxx::result result = tx.prepared(FETCH_FEE_DEADLINES)(idArrayParam(pocketIDs))(idArrayParam(fileIDs)).exec();
+    tx.commit();
     
-    //deleting and deducting will be on the same tx.
-    pqxx::work tx(*dbConn, "DeductFeesAndDeleteFilesWork");
-    //run the delete query
-    if (!bankruptListEmpty) {
-        //std::cout << "running delete files query:" << std::endl << removeFilesQuery << std::endl << std::endl;
-        tx.exec(removeFilesQuery);
+    return feeDeadlinesFromResult(result);
+}
+
+void settlePocketFees(pqxx::connection *dbConn, const std::vector<unsigned long> &pocketIDs, size_t chunkSize) {
+    for (size_t first=0; first < pocketIDs.size(); first += chunkSize) {
+        size_t last = std::min(first + chunkSize, pocketIDs.size());
+        
+        pqxx::work tx(*dbConn, "SettlePocketFeesWork");
+        pqxx::result deleted = tx.prepared(SETTLE_POCKET_FEES)(idArrayParam(pocketIDs.begin() + first, pocketIDs.begin() + last)).exec();
+        tx.commit();
+        
+        if (fileCache_ != NULL) {
+            for (unsigned int i=0; i<deleted.size(); i++) {
+                fileCache_->invalidate(deleted[i][0].as<unsigned long>());
+            }
+        }
     }
-    //run the deduct query
-    if (!chargeListEmpty) {
-        //std::cout << "running charge pockets query:" << std::endl << deductPocketsQuery << std::endl << std::endl;
-        tx.exec(deductPocketsQuery);
+}
+
+void collectBlobGarbage(pqxx::connection *dbConn) {
+    if (blobStore_ == NULL) return;
+    
+    std::vector<unsigned int> removable = blobStore_->removableSegments();
+    std::vector<unsigned long> removableIDs(removable.begin(), removable.end());
+    
+    pqxx::work tx(*dbConn, "CollectBlobGarbageWork");
+    tx.prepared(DELETE_DEAD_BLOBS).exec();
+    //only segments no transaction that appended to them is still running in;
+    //the rest wait for the next collection. Used is looked up in a statement
+    //of its own, so it sees what those transactions committed.
+    std::vector<unsigned int> candidates;
+    pqxx::result usedResult;
+    if (!removable.empty()) {
+        pqxx::result lockedResult = tx.prepared(TRY_LOCK_BLOB_SEGMENTS)(idArrayParam(removableIDs)).exec();
+        for (unsigned int i=0; i<lockedResult.size(); i++) {
+            candidates.push_back(lockedResult[i][0].as<unsigned int>());
+        }
+    }
+    if (!candidates.empty()) {
+        std::vector<unsigned long> candidateIDs(candidates.begin(), candidates.end());
+        usedResult = tx.prepared(FETCH_USED_SEGMENTS)(idArrayParam(candidateIDs)).exec();
     }
+    tx.commit();
     
+    std::set<unsigned int> used;
+    for (unsigned int i=0; i<usedResult.size(); i++) {
+        used.insert(usedResult[i][0].as<unsigned int>());
+    }
+    for (unsigned int i=0; i<candidates.size(); i++) {
+        if (used.count(candidates[i]) == 0) {
+            blobStore_->removeSegment(candidates[i]);
+        }
+    }
+}
+
+std::vector<TableCacheStats> fetchTableCacheStats(pqxx::connection *dbConn) {
+    pqxx::work tx(*dbConn, "FetchTableCacheStatsWork");
+    pqxx::result result = tx.exec("SELECT relname, "
+                                      "heap_blks_hit + COALESCE(idx_blks_hit, 0) + COALESCE(toast_blks_hit, 0) AS blks_hit, "
+                                      "heap_blks_read + COALESCE(idx_blks_read, 0) + COALESCE(toast_blks_read, 0) AS blks_read "
+                                  "FROM pg_statio_user_tables WHERE relname IN ('pockets', 'files', 'file_data', 'file_chunks') "
+                                  "ORDER BY relname");
     tx.commit();
+    
+    std::vector<TableCacheStats> stats(result.size());
+    for (unsigned int i=0; i<result.size(); i++) {
+        result[i]["relname"].to(stats[i].table);
+        result[i]["blks_hit"].to(stats[i].blocksHit);
+        result[i]["blks_read"].to(stats[i].blocksRead);
+    }
+    return stats;
 }
 
 }//namespace database
\ No newline at end of file
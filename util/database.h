@@ -7,15 +7,18 @@
 
 #include "database.h"
 #include "crypto.h"
+#include "blobstore.h"
 #include "netvend/exception.h"
 #include "netvend/commands.h"
 
 namespace database {
 
-const std::string FETCH_FILE_FEES_SUPPORTED_PER_POCKET = "FetchFileFeesSupportedPerPocket";
-    
+//used by both the pqxx connections and the async ones (see asyncdb.h)
+const std::string CONNECTION_STRING = "dbname=netvend user=netvend password=badpass";
+
 const std::string CHECK_AGENT_EXISTS = "CheckAgentExists";
 const std::string INSERT_AGENT = "InsertAgent";
+const std::string REGISTER_AGENT = "RegisterAgent";
 const std::string FETCH_AGENT_PUBKEY = "FetchAgentPubkey";
 
 const std::string INSERT_POCKET_WITH_DEPOSIT_ADDRESS = "InsertPocketWithDeposit";
@@ -25,13 +28,56 @@ const std::string FETCH_POCKET_OWNER = "FetchPocketOwner";
 const std::string UPDATE_POCKET_OWNER = "UpdatePocketOwner";
 const std::string UPDATE_POCKET_DEPOSIT_ADDRESS = "UpdatePocketDepositAddress";
 const std::string FETCH_POCKET_BALANCE = "FetchPocketBalance";
-const std::string DEDUCT_FROM_POCKET_WITH_OWNER = "DeductFromPocketWithOwner";
-const std::string ADD_TO_POCKET = "AddToPocket";
+const std::string POCKET_TRANSFER = "PocketTransfer";
 
 const std::string INSERT_FILE = "InsertFile";
 const std::string FETCH_FILE_OWNER = "FetchFileOwner";
 const std::string UPDATE_FILE_BY_ID = "UpdateFileByID";
 const std::string READ_FILE_BY_ID = "ReadFileByID";
+const std::string READ_FILE_RANGE = "ReadFileRange";
+const std::string LOCK_FILE_POCKET = "LockFilePocket";
+const std::string FETCH_FILE_FOR_WRITE = "FetchFileForWrite";
+const std::string WRITE_FILE_RANGE = "WriteFileRange";
+
+const std::string ACQUIRE_BLOB = "AcquireBlob";
+const std::string INSERT_BLOB = "InsertBlob";
+const std::string DELETE_DEAD_BLOBS = "DeleteDeadBlobs";
+const std::string FETCH_USED_SEGMENTS = "FetchUsedSegments";
+const std::string LOCK_BLOB_SEGMENT = "LockBlobSegment";
+const std::string TRY_LOCK_BLOB_SEGMENTS = "TryLockBlobSegments";
+
+//Blob segments' advisory locks are keyed (BLOB_SEGMENT_LOCK_SPACE, segment);
+//the first key keeps them apart from any other advisory locks
+const int BLOB_SEGMENT_LOCK_SPACE = 0x4e56424c;
+const std::string BLOB_SEGMENT_LOCK_SPACE_SQL = boost::lexical_cast<std::string>(BLOB_SEGMENT_LOCK_SPACE);
+
+//sizes go over the wire as unsigned shorts
+const unsigned int MAX_FILE_SIZE = 0xffff;
+
+//Unless it's in a blob, a file's data is kept in file_chunks rows of
+//FILE_CHUNK_SIZE bytes (all but the last), so that a write only replaces the
+//chunks it touches. Chunks are stored inline and uncompressed, so they're kept
+//well under a page. Any at or past the end of the file (by files.size) are
+//left over from an overwrite that raced a write extending the file, and are
+//never read.
+const unsigned int FILE_CHUNK_SIZE = 4000;
+const std::string FILE_CHUNK_SIZE_SQL = boost::lexical_cast<std::string>(FILE_CHUNK_SIZE);
+
+//the data of the file in the current files and file_data row, put back
+//together from its chunks; empty if it's in a blob
+const std::string CHUNKED_FILE_DATA_SQL = "COALESCE((SELECT string_agg(file_chunks.data, ''::bytea ORDER BY file_chunks.chunk_no) "
+                                                    "FROM file_chunks WHERE file_chunks.file_id = files.file_id AND file_data.blob_hash IS NULL "
+                                                    "AND file_chunks.chunk_no < (files.size + " + FILE_CHUNK_SIZE_SQL + " - 1) / " + FILE_CHUNK_SIZE_SQL + "), "
+                                          "''::bytea)";
+
+//a file's data, wherever it's kept; see fileContentsFromRow()
+const std::string READ_FILE_DATA_SQL = "SELECT " + CHUNKED_FILE_DATA_SQL + " AS data, blobs.segment, blobs.segment_offset, blobs.length "
+                                       "FROM file_data JOIN files ON files.file_id = file_data.file_id "
+                                       "LEFT JOIN blobs ON blobs.hash = file_data.blob_hash ";
+
+const std::string FETCH_ALL_FEE_DEADLINES = "FetchAllFeeDeadlines";
+const std::string FETCH_FEE_DEADLINES = "FetchFeeDeadlines";
+const std::string SETTLE_POCKET_FEES = "SettlePocketFees";
 
 class NoRowFoundException : public std::runtime_error {
 public:
@@ -43,29 +89,123 @@ public:
     DuplicateUniqueValueException();
 };
 
+//Credits per second each file, and each byte of file data, costs the pocket
+//supporting it. Must be set before any connection is prepared: the statements
+//that settle fees have the rates built in.
+void setFeeRates(double creditsPerFileSecond, double creditsPerByteSecond);
+
+//Where file data goes when it's written; NULL (the default) keeps it in the
+//database. Files already in the blob store are read from it either way.
+void setBlobStore(blobstore::BlobStore* store);
+blobstore::BlobStore* blobStore();
+
+//Files at least this big that are in the blob store aren't read into memory:
+//they're sent to the client straight from their segment.
+const unsigned int SPLICE_MIN_FILE_SIZE = 4096;
+
+//a file's data, or, if spliced, where in the blob store to send it from (its
+//span keeps the segment open for as long as it's cached or being sent)
+struct FileContents {
+    std::vector<unsigned char> data;
+    bool spliced;
+    commands::results::FileSpan span;
+};
+
+//shared, once read, and never changed (see FileCache)
+typedef std::vector<boost::shared_ptr<const FileContents> > FilesData;
+
+//length bytes of contents (its data, or its span if spliced) from offset on
+struct FileSlice {
+    boost::shared_ptr<const FileContents> contents;
+    unsigned short offset;
+    unsigned short length;
+};
+
+class FileCache;
+
+//Where reads of file data look first; NULL (the default) always goes to the
+//database. See FileCache for what writers have to do to keep it current.
+void setFileCache(FileCache* cache);
+FileCache* fileCache();
+
+//throws blobstore::BlobStoreException
+boost::shared_ptr<FileContents> blobContents(const blobstore::BlobLocation &location);
+
 void prepareConnection(pqxx::connection **dbConn);
 
 
 bool agentRowExists(pqxx::connection *dbConn, std::string agentAddress);
-void insertAgent(pqxx::connection *dbConn, std::string agentAddress, std::vector<unsigned char> DEREncodedPubkey, unsigned long defaultPocketID);
-crypto::RSAPubkey fetchAgentPubkey(pqxx::connection *dbConn, std::string agentAddress);
-
-unsigned long insertPocket(pqxx::connection *dbConn, std::string ownerAddress, std::string depositAddress);
-unsigned long insertPocket(pqxx::connection *dbConn, std::string ownerAddress);
-unsigned long insertPocket(pqxx::connection *dbConn);
-std::string fetchPocketOwner(pqxx::connection *dbConn, unsigned long pocketID);
-void verifyPocketOwner(pqxx::connection *dbConn, unsigned long pocketID, std::string agentAddress);
-void updatePocketOwner(pqxx::connection *dbConn, unsigned long pocketID, std::string newOwnerAddress);
-void updatePocketDepositAddress(pqxx::connection* dbConn, std::string ownerAddress, unsigned long pocketID, std::string newDepositAddress);
-void pocketTransfer(pqxx::connection *dbConn, std::string fromOwnerAddress, unsigned long fromPocketID, unsigned long toPocketID, unsigned long long amount);
-
-unsigned long insertFile(pqxx::connection *dbConn, std::string ownerAddress, std::string name, unsigned long pocketID);
-std::string fetchFileOwner(pqxx::connection *dbConn, unsigned long fileID);
-void verifyFileOwner(pqxx::connection *dbConn, unsigned long fileID, std::string agentAddress);
-void updateFileByID(pqxx::connection *dbConn, unsigned long fileID, unsigned char* data, unsigned short dataSize);
-std::vector<unsigned char> readFileByID(pqxx::connection *dbConn, unsigned long fileID);
-
-void chargeFileUpkeepFees(pqxx::connection *dbConn, int creditPerFile, int creditPerByte);
+void insertAgent(pqxx::connection *dbConn, std::string agentAddress, const crypto::AgentPubkey &pubkey, unsigned long defaultPocketID);
+bool registerAgent(pqxx::connection *dbConn, std::string agentAddress, const crypto::AgentPubkey &pubkey, unsigned long *defaultPocketID);
+crypto::AgentPubkey fetchAgentPubkey(pqxx::connection *dbConn, std::string agentAddress);
+
+//The functions below run inside the caller's transaction (for commands, a
+//savepoint within the batch's transaction) and leave committing, or rolling
+//back after a NetvendCommandException, to the caller.
+
+unsigned long insertPocket(pqxx::transaction_base &tx, std::string ownerAddress, std::string depositAddress);
+unsigned long insertPocket(pqxx::transaction_base &tx, std::string ownerAddress);
+unsigned long insertPocket(pqxx::transaction_base &tx);
+std::string fetchPocketOwner(pqxx::transaction_base &tx, unsigned long pocketID);
+void verifyPocketOwner(pqxx::transaction_base &tx, unsigned long pocketID, std::string agentAddress);
+void updatePocketOwner(pqxx::transaction_base &tx, unsigned long pocketID, std::string newOwnerAddress);
+void updatePocketDepositAddress(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long pocketID, std::string newDepositAddress);
+void pocketTransfer(pqxx::transaction_base &tx, std::string fromOwnerAddress, unsigned long fromPocketID, unsigned long toPocketID, unsigned long long amount);
+
+unsigned long insertFile(pqxx::transaction_base &tx, std::string ownerAddress, std::string name, unsigned long pocketID);
+std::string fetchFileOwner(pqxx::transaction_base &tx, unsigned long fileID);
+void verifyFileOwner(pqxx::transaction_base &tx, unsigned long fileID, std::string agentAddress);
+void updateFileByID(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long fileID, unsigned char* data, unsigned short dataSize);
+//Partial writes: only the chunks the data lands in are written, however big
+//the file is. A file in the blob store is moved into chunks by the first one.
+//Writing past the end of the file fills the gap with zeros.
+void appendToFile(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long fileID, unsigned char* data, unsigned short dataSize);
+void writeFileRange(pqxx::transaction_base &tx, std::string ownerAddress, unsigned long fileID, unsigned short offset, unsigned char* data, unsigned short dataSize);
+//Both read through the file cache. What they fetch is only put in it (or
+//shared with concurrent reads of the same file) if fillCache is set, which it
+//mustn't be in a transaction that has written anything: that could be rolled
+//back, and what was read along with it.
+boost::shared_ptr<const FileContents> readFileByID(pqxx::transaction_base &tx, unsigned long fileID, bool fillCache);
+FilesData readFilesByID(pqxx::transaction_base &tx, const std::vector<unsigned long> &fileIDs, bool fillCache);
+//Up to length bytes of the file from offset on; fewer (or none) if that runs
+//past its end. A file in the cache is sliced there without copying; otherwise
+//only the range is fetched (with substring(), or from its blob), and nothing
+//is cached.
+FileSlice readFileRange(pqxx::transaction_base &tx, unsigned long fileID, unsigned short offset, unsigned short length, bool fillCache);
+
+//Upkeep fees accrue on each pocket from fees_settled_at on, at its current
+//rate, and are settled (taken from amount) by any statement that changes that
+//rate or spends from the pocket, and by settlePocketFees() once the pocket's
+//deadline comes.
+struct FeeDeadline {
+    unsigned long pocketID;
+    //false if the pocket costs nothing, and so never runs dry
+    bool hasDeadline;
+    //from now until its accrued fees pass its amount; can be negative
+    double secondsLeft;
+};
+
+std::vector<FeeDeadline> fetchAllFeeDeadlines(pqxx::connection *dbConn);
+//for the given pockets, and the pockets supporting the given files
+std::vector<FeeDeadline> fetchFeeDeadlines(pqxx::connection *dbConn, const std::vector<unsigned long> &pocketIDs, const std::vector<unsigned long> &fileIDs);
+//Settles the pockets' fees; the files of any that ran dry are deleted (and
+//dropped from the file cache). Done chunkSize pockets per transaction, so only
+//that many are locked at once.
+void settlePocketFees(pqxx::connection *dbConn, const std::vector<unsigned long> &pocketIDs, size_t chunkSize);
+
+//Deletes blobs no file uses any more, and removes the blob store's segments
+//that are left holding none of the rest.
+void collectBlobGarbage(pqxx::connection *dbConn);
+
+//Postgres's own counts of blocks each table (with its indexes and TOAST) found
+//in, or had to read into, shared buffers, since its stats were last reset.
+struct TableCacheStats {
+    std::string table;
+    unsigned long long blocksHit;
+    unsigned long long blocksRead;
+};
+
+std::vector<TableCacheStats> fetchTableCacheStats(pqxx::connection *dbConn);
 
 }//namespace database
 
@@ -0,0 +1,336 @@
+#include "filecache.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace database {
+
+//what an entry costs beyond its data: the entry itself, its FileContents, and
+//its place in the index
+const size_t ENTRY_OVERHEAD = 128;
+
+//bytes of a shard's capacity per key it might hold, roughly, when sizing its sketch
+const size_t SKETCH_BYTES_PER_KEY = 256;
+const size_t MIN_SKETCH_WIDTH = 1024;
+
+FrequencySketch::FrequencySketch(size_t width)
+: additions_(0)
+{
+    width_ = 1;
+    while (width_ < width) width_ <<= 1;
+
+    counters_.resize(ROWS * width_, 0);
+    sampleSize_ = 10 * width_;
+}
+
+static unsigned long long mixBits(unsigned long long x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+size_t FrequencySketch::index(unsigned long key, unsigned int row) {
+    return row * width_ + (mixBits(key + (row + 1) * 0x9e3779b97f4a7c15ULL) & (width_ - 1));
+}
+
+void FrequencySketch::record(unsigned long key) {
+    for (unsigned int row=0; row<ROWS; row++) {
+        unsigned char& counter = counters_[index(key, row)];
+        if (counter < MAX_COUNT) counter++;
+    }
+
+    if (++additions_ >= sampleSize_) {
+        age();
+    }
+}
+
+unsigned int FrequencySketch::estimate(unsigned long key) {
+    unsigned int lowest = MAX_COUNT;
+    for (unsigned int row=0; row<ROWS; row++) {
+        lowest = std::min(lowest, (unsigned int)counters_[index(key, row)]);
+    }
+    return lowest;
+}
+
+void FrequencySketch::age() {
+    for (size_t i=0; i<counters_.size(); i++) {
+        counters_[i] >>= 1;
+    }
+    additions_ /= 2;
+}
+
+FileCache::Shard::Shard(size_t sketchWidth)
+: bytes(0), epoch(0), sketch(sketchWidth), hits(0), misses(0), rejected(0), coalesced(0)
+{}
+
+FileCache::FileCache(size_t capacityBytes, unsigned int numShards)
+{
+    assert(numShards > 0);
+
+    shardCapacity_ = capacityBytes / numShards;
+
+    size_t sketchWidth = std::max(shardCapacity_ / SKETCH_BYTES_PER_KEY, MIN_SKETCH_WIDTH);
+    for (unsigned int i=0; i<numShards; i++) {
+        shards_.push_back(boost::shared_ptr<Shard>(new Shard(sketchWidth)));
+    }
+}
+
+FileCache::Shard& FileCache::shardFor(unsigned long fileID) {
+    return *(shards_[fileID % shards_.size()]);
+}
+
+//with shard.mutex held
+void FileCache::remove(Shard& shard, unsigned long fileID) {
+    boost::unordered_map<unsigned long, LRUList::iterator>::iterator it = shard.index.find(fileID);
+    if (it == shard.index.end()) return;
+
+    shard.bytes -= it->second->bytes;
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+}
+
+bool FileCache::get(unsigned long fileID, boost::shared_ptr<const FileContents>* contents) {
+    Shard& shard = shardFor(fileID);
+    boost::mutex::scoped_lock lock(shard.mutex);
+
+    shard.sketch.record(fileID);
+
+    boost::unordered_map<unsigned long, LRUList::iterator>::iterator it = shard.index.find(fileID);
+    if (it == shard.index.end()) {
+        shard.misses++;
+        return false;
+    }
+
+    shard.hits++;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    *contents = it->second->contents;
+    return true;
+}
+
+FileCache::Lookup FileCache::lookup(unsigned long fileID, bool blocking, boost::shared_ptr<const FileContents>* contents,
+                                    FlightPtr* flight, FlightWaiter waiter) {
+    Shard& shard = shardFor(fileID);
+    boost::mutex::scoped_lock lock(shard.mutex);
+
+    shard.sketch.record(fileID);
+
+    boost::unordered_map<unsigned long, LRUList::iterator>::iterator it = shard.index.find(fileID);
+    if (it != shard.index.end()) {
+        shard.hits++;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        *contents = it->second->contents;
+        return LOOKUP_HIT;
+    }
+    shard.misses++;
+
+    //a flight from before the last change may have read what it changed
+    boost::unordered_map<unsigned long, FlightPtr>::iterator current = shard.flights.find(fileID);
+    if (current != shard.flights.end() && current->second->epoch != shard.epoch) {
+        shard.flights.erase(current);
+        current = shard.flights.end();
+    }
+
+    if (current != shard.flights.end() && (current->second->blocking || !blocking)) {
+        current->second->waiters.push_back(waiter);
+        shard.coalesced++;
+        return LOOKUP_JOINED;
+    }
+
+    flight->reset(new Flight());
+    (*flight)->fileID = fileID;
+    (*flight)->epoch = shard.epoch;
+    (*flight)->blocking = blocking;
+    //while the file's being written, or if a flight others can't join is
+    //already under way, this one is the caller's alone
+    if (current == shard.flights.end() && shard.writing.count(fileID) == 0) {
+        shard.flights[fileID] = *flight;
+    }
+    return LOOKUP_LEAD;
+}
+
+void FileCache::land(FlightPtr flight, bool ok, boost::shared_ptr<const FileContents> contents) {
+    std::vector<FlightWaiter> waiters;
+    {
+        Shard& shard = shardFor(flight->fileID);
+        boost::mutex::scoped_lock lock(shard.mutex);
+
+        boost::unordered_map<unsigned long, FlightPtr>::iterator it = shard.flights.find(flight->fileID);
+        if (it != shard.flights.end() && it->second == flight) {
+            shard.flights.erase(it);
+        }
+
+        if (ok) insert(shard, flight->fileID, contents, flight->epoch);
+        waiters.swap(flight->waiters);
+    }
+
+    for (unsigned int i=0; i<waiters.size(); i++) {
+        waiters[i](ok, contents);
+    }
+}
+
+//with shard.mutex held
+void FileCache::insert(Shard& shard, unsigned long fileID, boost::shared_ptr<const FileContents> contents, Epoch epoch) {
+    size_t bytes = (contents.get() != NULL ? contents->data.size() : 0) + ENTRY_OVERHEAD;
+
+    //changed (or being changed) since it was read
+    if (epoch != shard.epoch || shard.writing.count(fileID) > 0) return;
+
+    remove(shard, fileID);
+
+    if (bytes > shardCapacity_) {
+        shard.rejected++;
+        return;
+    }
+
+    //the least recently used entries that would have to go to make room; the
+    //new one only gets in if it's wanted more than each of them
+    if (shard.bytes + bytes > shardCapacity_) {
+        unsigned int frequency = shard.sketch.estimate(fileID);
+        size_t freed = 0;
+        unsigned int victims = 0;
+        for (LRUList::reverse_iterator victim = shard.lru.rbegin(); shard.bytes - freed + bytes > shardCapacity_; victim++) {
+            if (shard.sketch.estimate(victim->fileID) >= frequency) {
+                shard.rejected++;
+                return;
+            }
+            freed += victim->bytes;
+            victims++;
+        }
+
+        for (; victims > 0; victims--) {
+            remove(shard, shard.lru.back().fileID);
+        }
+    }
+
+    Entry entry;
+    entry.fileID = fileID;
+    entry.contents = contents;
+    entry.bytes = bytes;
+    shard.lru.push_front(entry);
+    shard.index[fileID] = shard.lru.begin();
+    shard.bytes += bytes;
+}
+
+void FileCache::invalidate(unsigned long fileID) {
+    Shard& shard = shardFor(fileID);
+    boost::mutex::scoped_lock lock(shard.mutex);
+
+    shard.epoch++;
+    remove(shard, fileID);
+}
+
+void FileCache::beginWrite(unsigned long fileID) {
+    Shard& shard = shardFor(fileID);
+    boost::mutex::scoped_lock lock(shard.mutex);
+
+    shard.epoch++;
+    shard.writing[fileID]++;
+    remove(shard, fileID);
+}
+
+void FileCache::endWrite(unsigned long fileID) {
+    Shard& shard = shardFor(fileID);
+    boost::mutex::scoped_lock lock(shard.mutex);
+
+    //anything read while the write was open may be from before it committed
+    shard.epoch++;
+    if (--shard.writing[fileID] == 0) {
+        shard.writing.erase(fileID);
+    }
+}
+
+size_t FileCache::size() {
+    size_t total = 0;
+    for (unsigned int i=0; i<shards_.size(); i++) {
+        boost::mutex::scoped_lock lock(shards_[i]->mutex);
+        total += shards_[i]->lru.size();
+    }
+    return total;
+}
+
+size_t FileCache::bytes() {
+    size_t total = 0;
+    for (unsigned int i=0; i<shards_.size(); i++) {
+        boost::mutex::scoped_lock lock(shards_[i]->mutex);
+        total += shards_[i]->bytes;
+    }
+    return total;
+}
+
+unsigned long long FileCache::hits() {
+    unsigned long long total = 0;
+    for (unsigned int i=0; i<shards_.size(); i++) {
+        boost::mutex::scoped_lock lock(shards_[i]->mutex);
+        total += shards_[i]->hits;
+    }
+    return total;
+}
+
+unsigned long long FileCache::misses() {
+    unsigned long long total = 0;
+    for (unsigned int i=0; i<shards_.size(); i++) {
+        boost::mutex::scoped_lock lock(shards_[i]->mutex);
+        total += shards_[i]->misses;
+    }
+    return total;
+}
+
+unsigned long long FileCache::rejected() {
+    unsigned long long total = 0;
+    for (unsigned int i=0; i<shards_.size(); i++) {
+        boost::mutex::scoped_lock lock(shards_[i]->mutex);
+        total += shards_[i]->rejected;
+    }
+    return total;
+}
+
+unsigned long long FileCache::coalesced() {
+    unsigned long long total = 0;
+    for (unsigned int i=0; i<shards_.size(); i++) {
+        boost::mutex::scoped_lock lock(shards_[i]->mutex);
+        total += shards_[i]->coalesced;
+    }
+    return total;
+}
+
+FlightWait::FlightWait()
+: done_(false), ok_(false)
+{}
+
+void FlightWait::land(bool ok, boost::shared_ptr<const FileContents> contents) {
+    boost::mutex::scoped_lock lock(mutex_);
+    done_ = true;
+    ok_ = ok;
+    contents_ = contents;
+    landed_.notify_all();
+}
+
+bool FlightWait::wait(boost::shared_ptr<const FileContents>* contents) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!done_) {
+        landed_.wait(lock);
+    }
+    *contents = contents_;
+    return ok_;
+}
+
+FileWriteGuard::FileWriteGuard(FileCache* cache, const std::vector<unsigned long>& fileIDs)
+: cache_(cache), fileIDs_(fileIDs)
+{
+    if (cache_ == NULL) return;
+    for (unsigned int i=0; i<fileIDs_.size(); i++) {
+        cache_->beginWrite(fileIDs_[i]);
+    }
+}
+
+FileWriteGuard::~FileWriteGuard() {
+    if (cache_ == NULL) return;
+    for (unsigned int i=0; i<fileIDs_.size(); i++) {
+        cache_->endWrite(fileIDs_[i]);
+    }
+}
+
+}//namespace database
@@ -0,0 +1,184 @@
+#ifndef NETVEND_FILECACHE_H
+#define NETVEND_FILECACHE_H
+
+#include <list>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "database.h"
+
+namespace database {
+
+//Approximate counts of how often each key has been asked for lately (a
+//count-min sketch of 4-bit counters). Once as many keys have been recorded as
+//ten times its width, every count is halved, so old popularity fades.
+class FrequencySketch {
+    static const unsigned int ROWS = 4;
+    static const unsigned char MAX_COUNT = 15;
+
+    std::vector<unsigned char> counters_;
+    size_t width_;
+    unsigned long additions_;
+    unsigned long sampleSize_;
+public:
+    //width is rounded up to a power of two
+    FrequencySketch(size_t width);
+    void record(unsigned long key);
+    unsigned int estimate(unsigned long key);
+private:
+    size_t index(unsigned long key, unsigned int row);
+    void age();
+};
+
+//Read-through cache of file contents, bounded by bytes, keyed by file ID.
+//Entries are immutable and handed out shared, so any number of readers can use
+//one (and keep using it after it's evicted) without copying it.
+//
+//Like VerifierCache it's split into shards, each with its own lock, LRU and
+//frequency sketch. Eviction is LRU, but a file is only let in if it has been
+//asked for more often than everything it would push out (TinyLFU), so a burst
+//of one-off reads can't flush the popular files.
+//
+//That a file doesn't exist is cached too, as an entry with no contents, so
+//asking again and again for files that aren't there stays cheap.
+//
+//Misses are coalesced: while one reader is fetching a file from the database
+//(it's the flight's leader; see lookup()), others asking for the same file wait
+//on that read instead of starting their own, and it's handed to all of them,
+//and cached, when the leader lands it.
+//
+//Unlike a verifier, a file changes. Anything that changes or deletes files
+//either holds a FileWriteGuard on them while its transaction is open, or
+//invalidates them once it has committed; creating a file counts, since its
+//absence may be cached. Both bump the shard's epoch. A flight only takes
+//waiters, and only caches what it read, if no epoch has passed since it took
+//off, so nothing read from before a change outlives it.
+class FileCache : boost::noncopyable {
+public:
+    typedef unsigned long long Epoch;
+
+    //Told how a flight went: ok is false if the read failed (the waiter should
+    //then read the file itself), otherwise contents is the file, or empty if
+    //there's no such file.
+    typedef boost::function<void (bool, boost::shared_ptr<const FileContents>)> FlightWaiter;
+
+    struct Flight {
+        unsigned long fileID;
+        Epoch epoch;
+        //led by a reader that blocks in the meantime; see lookup()
+        bool blocking;
+        std::vector<FlightWaiter> waiters;
+    };
+    typedef boost::shared_ptr<Flight> FlightPtr;
+
+    enum Lookup {
+        LOOKUP_HIT,
+        LOOKUP_JOINED,
+        LOOKUP_LEAD
+    };
+private:
+    struct Entry {
+        unsigned long fileID;
+        //empty if the file doesn't exist
+        boost::shared_ptr<const FileContents> contents;
+        size_t bytes;
+    };
+    typedef std::list<Entry> LRUList;
+
+    struct Shard {
+        boost::mutex mutex;
+        LRUList lru;//most recently used at the front
+        boost::unordered_map<unsigned long, LRUList::iterator> index;
+        //files with a write open on them, and how many
+        boost::unordered_map<unsigned long, unsigned int> writing;
+        //reads under way that can still be joined
+        boost::unordered_map<unsigned long, FlightPtr> flights;
+        size_t bytes;
+        Epoch epoch;
+        FrequencySketch sketch;
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long rejected;
+        unsigned long long coalesced;
+
+        Shard(size_t sketchWidth);
+    };
+
+    std::vector<boost::shared_ptr<Shard> > shards_;
+    size_t shardCapacity_;
+
+    Shard& shardFor(unsigned long fileID);
+    void remove(Shard& shard, unsigned long fileID);
+    void insert(Shard& shard, unsigned long fileID, boost::shared_ptr<const FileContents> contents, Epoch epoch);
+public:
+    FileCache(size_t capacityBytes, unsigned int numShards);
+
+    //For reads that mustn't fill the cache (see database::readFileByID()).
+    //False on a miss; on a hit, *contents is empty if the file doesn't exist.
+    bool get(unsigned long fileID, boost::shared_ptr<const FileContents>* contents);
+
+    //On a hit, *contents is set as for get(). On a miss, either the caller
+    //joins a read of the file already under way, and waiter is called once
+    //it's landed, or *flight is set to a new one, which the caller has to
+    //read the file for and then land(), whatever happens.
+    //
+    //A blocking reader (one that will sit and wait for waiter) only joins
+    //flights led by other blocking readers, which land what they lead before
+    //waiting on anything themselves, so no set of them can end up waiting on
+    //each other. A non-blocking reader joins any flight.
+    Lookup lookup(unsigned long fileID, bool blocking, boost::shared_ptr<const FileContents>* contents,
+                  FlightPtr* flight, FlightWaiter waiter);
+    //Caches contents (if ok, and nothing has changed since the flight took
+    //off) and hands them to the flight's waiters, in this thread.
+    void land(FlightPtr flight, bool ok, boost::shared_ptr<const FileContents> contents);
+
+    //for after a change to the file has committed
+    void invalidate(unsigned long fileID);
+    //for around a transaction that changes the file: until endWrite(), the
+    //file is neither served from the cache nor put in it
+    void beginWrite(unsigned long fileID);
+    void endWrite(unsigned long fileID);
+
+    size_t size();
+    size_t bytes();
+    unsigned long long hits();
+    unsigned long long misses();
+    //reads not cached because they weren't asked for often enough
+    unsigned long long rejected();
+    //misses that joined a flight instead of going to the database
+    unsigned long long coalesced();
+};
+
+//A FlightWaiter for blocking readers: bind land() as the waiter, then wait().
+class FlightWait : boost::noncopyable {
+    boost::mutex mutex_;
+    boost::condition_variable landed_;
+    bool done_;
+    bool ok_;
+    boost::shared_ptr<const FileContents> contents_;
+public:
+    FlightWait();
+    void land(bool ok, boost::shared_ptr<const FileContents> contents);
+    //false if the flight's read failed
+    bool wait(boost::shared_ptr<const FileContents>* contents);
+};
+
+//Writes to the given files (duplicates are fine) are open, as far as the
+//cache is concerned, from construction until destruction; see
+//FileCache::beginWrite(). A NULL cache does nothing.
+class FileWriteGuard : boost::noncopyable {
+    FileCache* cache_;
+    std::vector<unsigned long> fileIDs_;
+public:
+    FileWriteGuard(FileCache* cache, const std::vector<unsigned long>& fileIDs);
+    ~FileWriteGuard();
+};
+
+}//namespace database
+
+#endif
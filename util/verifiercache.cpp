@@ -0,0 +1,87 @@
+#include "verifiercache.h"
+
+namespace crypto {
+
+VerifierCache::VerifierCache(size_t capacity, unsigned int numShards)
+{
+    assert(numShards > 0);
+    
+    shardCapacity_ = capacity / numShards;
+    if (shardCapacity_ == 0) shardCapacity_ = 1;
+    
+    for (unsigned int i=0; i<numShards; i++) {
+        boost::shared_ptr<Shard> shard(new Shard());
+        shard->hits = 0;
+        shard->misses = 0;
+        shards_.push_back(shard);
+    }
+}
+
+VerifierCache::Shard& VerifierCache::shardFor(const std::string& agentAddress) {
+    return *(shards_[boost::hash<std::string>()(agentAddress) % shards_.size()]);
+}
+
+//returns an empty pointer on a miss
+boost::shared_ptr<const SigVerifier> VerifierCache::get(const std::string& agentAddress) {
+    Shard& shard = shardFor(agentAddress);
+    boost::mutex::scoped_lock lock(shard.mutex);
+    
+    boost::unordered_map<std::string, LRUList::iterator>::iterator it = shard.index.find(agentAddress);
+    if (it == shard.index.end()) {
+        shard.misses++;
+        return boost::shared_ptr<const SigVerifier>();
+    }
+    
+    shard.hits++;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+}
+
+void VerifierCache::put(const std::string& agentAddress, boost::shared_ptr<const SigVerifier> verifier) {
+    Shard& shard = shardFor(agentAddress);
+    boost::mutex::scoped_lock lock(shard.mutex);
+    
+    boost::unordered_map<std::string, LRUList::iterator>::iterator it = shard.index.find(agentAddress);
+    if (it != shard.index.end()) {
+        it->second->second = verifier;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return;
+    }
+    
+    shard.lru.push_front(std::make_pair(agentAddress, verifier));
+    shard.index[agentAddress] = shard.lru.begin();
+    
+    if (shard.lru.size() > shardCapacity_) {
+        shard.index.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+    }
+}
+
+size_t VerifierCache::size() {
+    size_t total = 0;
+    for (unsigned int i=0; i<shards_.size(); i++) {
+        boost::mutex::scoped_lock lock(shards_[i]->mutex);
+        total += shards_[i]->lru.size();
+    }
+    return total;
+}
+
+unsigned long long VerifierCache::hits() {
+    unsigned long long total = 0;
+    for (unsigned int i=0; i<shards_.size(); i++) {
+        boost::mutex::scoped_lock lock(shards_[i]->mutex);
+        total += shards_[i]->hits;
+    }
+    return total;
+}
+
+unsigned long long VerifierCache::misses() {
+    unsigned long long total = 0;
+    for (unsigned int i=0; i<shards_.size(); i++) {
+        boost::mutex::scoped_lock lock(shards_[i]->mutex);
+        total += shards_[i]->misses;
+    }
+    return total;
+}
+
+}//namespace crypto
@@ -0,0 +1,45 @@
+#ifndef NETVEND_VERIFIERCACHE_H
+#define NETVEND_VERIFIERCACHE_H
+
+#include <list>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "util/crypto.h"
+
+namespace crypto {
+
+//Bounded LRU of ready-to-use signature verifiers, keyed by agent address.
+//An address is derived from its pubkey, so an entry never goes stale and
+//never needs invalidating. The cache is split into shards, each with its
+//own lock, so workers looking up different agents rarely contend.
+class VerifierCache {
+    typedef std::list<std::pair<std::string, boost::shared_ptr<const SigVerifier> > > LRUList;
+    
+    struct Shard {
+        boost::mutex mutex;
+        LRUList lru;//most recently used at the front
+        boost::unordered_map<std::string, LRUList::iterator> index;
+        unsigned long long hits;
+        unsigned long long misses;
+    };
+    
+    std::vector<boost::shared_ptr<Shard> > shards_;
+    size_t shardCapacity_;
+    
+    Shard& shardFor(const std::string& agentAddress);
+public:
+    VerifierCache(size_t capacity, unsigned int numShards);
+    boost::shared_ptr<const SigVerifier> get(const std::string& agentAddress);
+    void put(const std::string& agentAddress, boost::shared_ptr<const SigVerifier> verifier);
+    size_t size();
+    unsigned long long hits();
+    unsigned long long misses();
+};
+
+}//namespace crypto
+
+#endif